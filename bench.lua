@@ -0,0 +1,66 @@
+local socket = require 'socket'
+
+-- Measure the binding's own overhead against the in-process fake server, run through
+-- `make bench` which needs no audio stack
+local lua_pa = require 'lua_pa'
+
+if lua_pa.backend() ~= 'fake' then
+	print('bench.lua needs LUA_PA_BACKEND=fake')
+	os.exit(1)
+end
+
+local events = tonumber(arg[1]) or 20000
+local rate = tonumber(arg[2]) or 0
+local calls = tonumber(arg[3]) or 2000
+local devices = #lua_pa.get_all_sinks()
+
+-- Blocking calls, nothing but the binding and the mainloop handoff
+local started = socket.gettime()
+for i = 1, calls do
+	lua_pa.get_all_sinks()
+end
+local list_us = (socket.gettime() - started) / calls * 1e6
+
+started = socket.gettime()
+for i = 1, calls do
+	lua_pa.set_volume_sink('fake_sink_0', i % 100)
+end
+local set_us = (socket.gettime() - started) / calls * 1e6
+
+-- Let the change events of the set calls drain before counting
+while lua_pa.fake_pending() > 0 do
+	socket.select(nil, nil, 0.01)
+end
+socket.select(nil, nil, 0.1)
+
+local delivered = 0
+local last = nil
+lua_pa.connect_signal('pulseaudio::sink_change', function()
+	delivered = delivered + 1
+	last = socket.gettime()
+end)
+
+-- Each step moves its device to a volume it does not have yet, so none is suppressed
+local steps = {}
+for i = 1, events do
+	local device = i % devices
+	local round = math.floor((i - device) / devices)
+	steps[i] = { event = 'change', type = 'sink', name = 'fake_sink_' .. device, volume = round % 2 == 0 and 10 or 90 }
+end
+
+started = socket.gettime()
+lua_pa.fake_script(steps, { rate = rate })
+
+local deadline = started + 30 + (rate > 0 and events / rate or 0)
+while delivered < events and socket.gettime() < deadline do
+	socket.select(nil, nil, 0.01)
+end
+local elapsed = (last or socket.gettime()) - started
+
+print(string.format('devices:        %d', devices))
+print(string.format('get_all_sinks:  %.1fus per call', list_us))
+print(string.format('set_volume:     %.1fus per call', set_us))
+print(string.format('events:         %d of %d delivered in %.2fs', delivered, events, elapsed))
+print(string.format('throughput:     %.0f events/s', delivered / math.max(elapsed, 1e-9)))
+
+os.exit(delivered == events and 0 or 1)
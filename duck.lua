@@ -0,0 +1,71 @@
+local socket = require 'socket'
+
+-- Duck a music stream under a phone stream on a private daemon, run through `make duck`. The
+-- streams are paplay clients playing silence, their volumes are read back with pactl
+local lua_pa = require 'lua_pa'
+
+local failures = 0
+local function check(ok, what)
+	print(what .. (ok and ' OK' or ' ERROR'))
+	if not ok then failures = failures + 1 end
+end
+
+local function wait_for(f)
+	for _ = 1, 50 do
+		if f() then return true end
+		socket.select(nil, nil, 0.1)
+	end
+	return false
+end
+
+-- Starts a stream with the role and returns the pid of its paplay
+local function play(role)
+	local p = io.popen('paplay --raw --property=media.role=' .. role .. ' /dev/zero >/dev/null 2>&1 & echo $!')
+	local pid = p:read('*l')
+	p:close()
+	return pid
+end
+
+-- The volume in percent of the first channel of the stream with the role and its index, nil while
+-- there is none
+local function volume(role)
+	local p = io.popen('pactl list sink-inputs 2>/dev/null')
+	local out = p:read('*a')
+	p:close()
+	-- One block per stream, each starting at its "Sink Input #" header
+	local marked = ('\n' .. out):gsub('\nSink Input #', '\1')
+	for block in marked:gmatch('\1([^\1]*)') do
+		if block:find('media.role = "' .. role .. '"', 1, true) then
+			return tonumber(block:match('Volume:[^\n]-(%d+)%%')), block:match('^(%d+)')
+		end
+	end
+	return nil
+end
+
+local rule = lua_pa.add_duck_rule { trigger = { role = 'phone' }, target = { role = 'music' }, level = 20, fade_ms = 200 }
+check(rule ~= nil, 'lua_pa.add_duck_rule')
+
+local music = play('music')
+check(wait_for(function() return volume('music') == 100 end), 'music stream playing')
+
+local phone = play('phone')
+check(wait_for(function() local v = volume('music') return v and v <= 25 end), 'music ducked under phone')
+
+os.execute('kill ' .. phone)
+check(wait_for(function() return volume('music') == 100 end), 'music restored after phone')
+
+-- A volume set on the ducked stream is kept, the restore scales it back up from the duck level
+phone = play('phone')
+check(wait_for(function() local v = volume('music') return v and v <= 25 end), 'music ducked again')
+local _, music_index = volume('music')
+os.execute('pactl set-sink-input-volume ' .. music_index .. ' 10%')
+check(wait_for(function() return volume('music') == 10 end), 'music volume changed while ducked')
+-- The change is picked up with a query of its own, give it a round trip before the restore starts
+socket.select(nil, nil, 0.2)
+os.execute('kill ' .. phone)
+check(wait_for(function() local v = volume('music') return v and math.abs(v - 50) <= 1 end), 'music restored to the changed volume')
+
+lua_pa.remove_duck_rule(rule)
+os.execute('kill ' .. music)
+
+os.exit(failures == 0 and 0 or 1)
@@ -0,0 +1,107 @@
+local socket = require 'socket'
+
+-- Check the binding's behaviour against the in-process fake server, run through `make fake` which
+-- needs no audio stack. The fake starts with fake_sink_0/1 and fake_source_0/1, the first of each
+-- being the default
+local lua_pa = require 'lua_pa'
+
+if lua_pa.backend() ~= 'fake' then
+	print('fake.lua needs LUA_PA_BACKEND=fake')
+	os.exit(1)
+end
+
+local failures = 0
+local function check(ok, what)
+	print(what .. (ok and ' OK' or ' ERROR'))
+	if not ok then failures = failures + 1 end
+end
+
+-- Waits for the script and the deferred events to drain, then for their dispatch threads
+local function settle()
+	for _ = 1, 100 do
+		if lua_pa.fake_pending() == 0 then break end
+		socket.select(nil, nil, 0.01)
+	end
+	socket.select(nil, nil, 0.1)
+end
+
+local function names(devices)
+	local out = {}
+	for _, device in ipairs(devices or {}) do out[#out + 1] = device.name end
+	table.sort(out)
+	return table.concat(out, ',')
+end
+
+-- Getters and lists
+local sinks = lua_pa.get_all_sinks()
+check(names(sinks) == 'fake_sink_0,fake_sink_1', 'lua_pa.get_all_sinks')
+check(names(lua_pa.get_all_sources()) == 'fake_source_0,fake_source_1', 'lua_pa.get_all_sources')
+
+local sink = lua_pa.get_sink_by_name('fake_sink_1')
+check(sink ~= nil and sink.name == 'fake_sink_1' and type(sink.index) == 'number', 'lua_pa.get_sink_by_name')
+check(lua_pa.get_sink_by_name('fake_sink_missing') == nil, 'lua_pa.get_sink_by_name missing')
+
+local default = lua_pa.get_default_sink()
+check(default ~= nil and default.name == 'fake_sink_0', 'lua_pa.get_default_sink')
+
+-- A volume set gives exactly one change, carrying the new volume and only the volume bit
+local changes = {}
+lua_pa.connect_signal('pulseaudio::sink_change', function(description, name, index, volume, muted, changed)
+	changes[#changes + 1] = { name = name, index = index, volume = volume, muted = muted, changed = changed }
+end)
+
+local target = sink.volume == 40 and 60 or 40
+check(lua_pa.set_volume_sink('fake_sink_1', target), 'lua_pa.set_volume_sink')
+settle()
+local change = changes[1]
+check(#changes == 1 and change.name == 'fake_sink_1' and change.index == sink.index and change.volume == target
+	and change.changed == 8, 'pulseaudio::sink_change once with the volume mask')
+check(lua_pa.get_sink_by_name('fake_sink_1').volume == target, 'lua_pa.set_volume_sink reads back')
+
+-- Setting the same volume again changes nothing a handler can see
+changes = {}
+lua_pa.set_volume_sink('fake_sink_1', target)
+settle()
+check(#changes == 0, 'pulseaudio::sink_change suppressed when nothing changed')
+
+-- A mute carries only the mute bit
+lua_pa.set_mute_sink('fake_sink_1', true)
+settle()
+check(#changes == 1 and changes[1].muted == true and changes[1].changed == 16, 'pulseaudio::sink_change mute mask')
+
+-- Devices added and removed by a script reach their handlers
+local added, removed = nil, nil
+lua_pa.connect_signal('pulseaudio::sink_new', function(device) added = device end)
+lua_pa.connect_signal('pulseaudio::sink_remove', function(name) removed = name end)
+
+lua_pa.fake_script({
+	{ event = 'new', type = 'sink', name = 'fake_sink_new', description = 'scripted sink' },
+	{ event = 'remove', type = 'sink', name = 'fake_sink_new' },
+}, { rate = 0 })
+settle()
+check(added ~= nil and added.name == 'fake_sink_new' and added.description == 'scripted sink', 'fake_script pulseaudio::sink_new')
+check(removed == 'fake_sink_new', 'fake_script pulseaudio::sink_remove')
+check(lua_pa.get_sink_by_name('fake_sink_new') == nil, 'fake_script removed sink is gone')
+
+-- Default switching, and handlers scoped to the default follow it
+local default_changes = {}
+lua_pa.connect_signal('pulseaudio::sink_change', function(_, name)
+	default_changes[#default_changes + 1] = name
+end, { default = true })
+
+check(lua_pa.set_default_sink('fake_sink_1'), 'lua_pa.set_default_sink')
+settle()
+default = lua_pa.get_default_sink()
+check(default ~= nil and default.name == 'fake_sink_1', 'lua_pa.get_default_sink after switching')
+
+lua_pa.set_volume_sink('fake_sink_0', 15)
+lua_pa.set_volume_sink('fake_sink_1', 25)
+settle()
+check(#default_changes == 1 and default_changes[1] == 'fake_sink_1', 'default scoped handler follows the default')
+
+lua_pa.fake_script({ { event = 'default', type = 'sink', name = 'fake_sink_0' } }, { rate = 0 })
+settle()
+default = lua_pa.get_default_sink()
+check(default ~= nil and default.name == 'fake_sink_0', 'fake_script default')
+
+os.exit(failures == 0 and 0 or 1)
@@ -0,0 +1,136 @@
+local socket = require 'socket'
+
+-- Exercise the native PipeWire backend, run through `make pipewire` which starts a private
+-- daemon with two null sinks and a virtual source for it
+local lua_pa = require 'lua_pa'
+
+local sink_name = 'lua_pa_pw_sink'
+local quoted_name = 'lua_pa_pw_"quoted\\sink'
+local source_name = 'lua_pa_pw_source'
+
+local function run(command)
+	local p = io.popen(command .. ' 2>/dev/null')
+	local out = p:read('*a')
+	p:close()
+	return out
+end
+
+local function wait_for(check)
+	for _ = 1, 50 do
+		if check() then return true end
+		socket.select(nil, nil, 0.1)
+	end
+	return false
+end
+
+local function find(devices, name)
+	for _, device in ipairs(devices) do
+		if device.name == name then return device end
+	end
+	return nil
+end
+
+if lua_pa.backend() ~= 'pipewire' then
+	print('lua_pa.backend pipewire ERROR')
+	os.exit(1)
+end
+print('lua_pa.backend pipewire OK')
+
+-- Test listing and getting the daemon's devices
+local sinks = lua_pa.get_all_sinks()
+local sources = lua_pa.get_all_sources()
+if not sinks or not find(sinks, sink_name) or not find(sinks, quoted_name) or not sources or not find(sources, source_name) then
+	print('lua_pa.get_all_sinks pipewire ERROR')
+	os.exit(1)
+end
+print('lua_pa.get_all_sinks pipewire OK')
+
+local sink = lua_pa.get_sink_by_name(sink_name)
+if not sink or sink.description ~= 'lua_pa sink' then
+	print('lua_pa.get_sink_by_name pipewire ERROR')
+	os.exit(1)
+end
+print('lua_pa.get_sink_by_name pipewire OK')
+
+-- Test that volume and mute reach the node and come back through its Props
+local changed = {}
+lua_pa.connect_signal('pulseaudio::sink_change', function(_, name, _, volume, muted)
+	changed[#changed + 1] = { name = name, volume = volume, muted = muted }
+end, { device = sink_name })
+
+if not lua_pa.set_volume_sink(sink_name, 40) or not lua_pa.set_mute_sink(sink_name, true) then
+	print('lua_pa.set_volume_sink pipewire ERROR')
+	os.exit(1)
+end
+local set_ok = wait_for(function()
+	sink = lua_pa.get_sink_by_name(sink_name)
+	return sink and math.abs(sink.volume - 40) <= 1 and sink.mute
+end)
+if not set_ok then
+	print('lua_pa.set_volume_sink pipewire ERROR')
+	os.exit(1)
+end
+print('lua_pa.set_volume_sink pipewire OK')
+
+if not lua_pa.set_volume_source(source_name, 25) or not wait_for(function()
+	local source = lua_pa.get_source_by_name(source_name)
+	return source and math.abs(source.volume - 25) <= 1
+end) then
+	print('lua_pa.set_volume_source pipewire ERROR')
+	os.exit(1)
+end
+print('lua_pa.set_volume_source pipewire OK')
+
+if not wait_for(function() return #changed > 0 end) or changed[#changed].name ~= sink_name then
+	print('pulseaudio::sink_change pipewire ERROR')
+	os.exit(1)
+end
+print('pulseaudio::sink_change pipewire OK')
+
+-- Test that a default name with quotes and backslashes goes out as valid JSON. Without a session
+-- manager the configured default is not followed, read it back from the metadata instead
+if not lua_pa.set_default_sink(quoted_name) then
+	print('lua_pa.set_default_sink pipewire ERROR')
+	os.exit(1)
+end
+local configured = run('pw-metadata 0 default.configured.audio.sink')
+if not configured:find('"name": "lua_pa_pw_\\"quoted\\\\sink"', 1, true) then
+	print('lua_pa.set_default_sink pipewire ERROR', configured)
+	os.exit(1)
+end
+print('lua_pa.set_default_sink pipewire OK')
+
+-- Test that the backend follows default.audio.sink, which a session manager would write
+run("pw-metadata 0 default.audio.sink '{ \"name\": \"" .. sink_name .. "\" }' Spa:String:JSON")
+if not wait_for(function()
+	local default = lua_pa.get_default_sink()
+	return default and default.name == sink_name
+end) then
+	print('lua_pa.get_default_sink pipewire ERROR')
+	os.exit(1)
+end
+print('lua_pa.get_default_sink pipewire OK')
+
+-- Test new and remove signals for a node created and destroyed behind the backend's back
+local added, removed = nil, nil
+lua_pa.connect_signal('pulseaudio::sink_new', function(device)
+	if device and device.name == 'lua_pa_pw_new' then added = device end
+end)
+lua_pa.connect_signal('pulseaudio::sink_remove', function(name)
+	if name == 'lua_pa_pw_new' then removed = name end
+end)
+
+run("pw-cli create-node adapter '{ factory.name = support.null-audio-sink node.name = lua_pa_pw_new "
+	.. "media.class = Audio/Sink audio.position = [ FL FR ] object.linger = true }'")
+if not wait_for(function() return added ~= nil end) then
+	print('pulseaudio::sink_new pipewire ERROR')
+	os.exit(1)
+end
+print('pulseaudio::sink_new pipewire OK')
+
+run('pw-cli destroy ' .. added.index)
+if not wait_for(function() return removed ~= nil end) or lua_pa.get_sink_by_name('lua_pa_pw_new') then
+	print('pulseaudio::sink_remove pipewire ERROR')
+	os.exit(1)
+end
+print('pulseaudio::sink_remove pipewire OK')
@@ -0,0 +1,59 @@
+#!/bin/sh
+# Runs pipewire.lua against a private pipewire daemon so the host setup is never touched.
+# Needs a build made with PIPEWIRE=1
+
+LUA=${LUA:-lua}
+
+tmp=$(mktemp -d)
+trap 'kill $pw_pid 2>/dev/null; wait $pw_pid 2>/dev/null; rm -rf "$tmp"' EXIT INT TERM
+
+export XDG_RUNTIME_DIR="$tmp"
+export PIPEWIRE_RUNTIME_DIR="$tmp"
+export PIPEWIRE_REMOTE=pipewire-0
+unset PULSE_SERVER
+
+# No session manager runs, so the "default" metadata object is created here and the tests write
+# default.audio.sink themselves where one would follow default.configured.audio.sink
+cat > "$tmp/pipewire.conf" <<'EOF'
+context.properties = {
+	core.daemon = true
+	core.name = pipewire-0
+	support.dbus = false
+}
+context.spa-libs = {
+	audio.convert.* = audioconvert/libspa-audioconvert
+	support.* = support/libspa-support
+}
+context.modules = [
+	{ name = libpipewire-module-protocol-native }
+	{ name = libpipewire-module-metadata }
+	{ name = libpipewire-module-spa-node-factory }
+	{ name = libpipewire-module-client-node }
+	{ name = libpipewire-module-adapter }
+]
+context.objects = [
+	{ factory = metadata args = { metadata.name = default } }
+	{ factory = spa-node-factory args = { factory.name = support.node.driver node.name = Dummy-Driver priority.driver = 1 } }
+	{ factory = adapter args = { factory.name = support.null-audio-sink node.name = lua_pa_pw_sink
+		node.description = "lua_pa sink" media.class = Audio/Sink audio.position = [ FL FR ] } }
+	{ factory = adapter args = { factory.name = support.null-audio-sink node.name = "lua_pa_pw_\"quoted\\sink"
+		media.class = Audio/Sink audio.position = [ FL FR ] } }
+	{ factory = adapter args = { factory.name = support.null-audio-sink node.name = lua_pa_pw_source
+		media.class = Audio/Source/Virtual audio.position = [ FL FR ] } }
+]
+EOF
+
+pipewire -c "$tmp/pipewire.conf" &
+pw_pid=$!
+
+i=0
+while [ ! -S "$tmp/pipewire-0" ]; do
+	i=$((i + 1))
+	if [ $i -gt 50 ]; then
+		echo "pipewire did not start"
+		exit 1
+	fi
+	sleep 0.1
+done
+
+LUA_PA_BACKEND=pipewire LUA_CPATH="./bin/?.so;$LUA_CPATH;;" "$LUA" pipewire.lua
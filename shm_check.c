@@ -0,0 +1,41 @@
+// Reads a segment published by lua_pa.export_shm(name) through lua_pa_shm.h, the way another
+// process would, and prints the default sink as name, volume and mute separated by tabs.
+// test.lua compares that against what lua_pa itself reports
+#include <stddef.h>
+#include <stdio.h>
+
+#include "src/lua_pa_shm.h"
+
+// The layout is an ABI shared with readers built against older copies of the header
+_Static_assert(sizeof(lua_pa_shm_device_t) == 272, "lua_pa_shm_device_t layout changed");
+_Static_assert(offsetof(lua_pa_shm_t, updated_usec) == 32, "lua_pa_shm_t header layout changed");
+_Static_assert(offsetof(lua_pa_shm_t, sinks) == 40, "lua_pa_shm_t header layout changed");
+_Static_assert(offsetof(lua_pa_shm_t, sources) == 40 + 272 * LUA_PA_SHM_MAX_DEVICES, "lua_pa_shm_t layout changed");
+
+int main(int argc, char** argv) {
+	if (argc != 2) {
+		fprintf(stderr, "usage: %s name\n", argv[0]);
+		return 2;
+	}
+
+	lua_pa_shm_t* shm = lua_pa_shm_open(argv[1]);
+	if (!shm) {
+		fprintf(stderr, "cannot open segment %s\n", argv[1]);
+		return 1;
+	}
+
+	lua_pa_shm_t copy;
+	lua_pa_shm_device_t sink;
+	int r = lua_pa_shm_read(shm, &copy);
+	if (r == 0)
+		r = lua_pa_shm_read_default(shm, 0, &sink);
+	lua_pa_shm_close(shm);
+
+	if (r != 0 || copy.num_sinks == 0 || copy.num_sinks > LUA_PA_SHM_MAX_DEVICES || copy.default_sink >= copy.num_sinks) {
+		fprintf(stderr, "inconsistent segment %s (%d)\n", argv[1], r);
+		return 1;
+	}
+
+	printf("%s\t%u\t%u\n", sink.name, sink.volume, sink.mute);
+	return 0;
+}
@@ -2,15 +2,61 @@
 
 static lua_pa_state* pa_state = NULL;
 
+// Connected from the Lua thread, read from the mainloop, dispatch and spectrum threads. Entries
+// are only ever appended, a reader copies the one it looks at under handlers_mutex
 static signal_handler_t* signal_handlers = NULL;
 
 static size_t num_signal_handlers = 0;
+static pthread_mutex_t handlers_mutex = PTHREAD_MUTEX_INITIALIZER;
 
 static active_sink_sources_t* active_sinks = NULL;
 static size_t num_sinks = 0;
 static active_sink_sources_t* active_sources = NULL;
 static size_t num_sources = 0;
 
+static const lua_pa_backend_t pulse_backend;
+static const lua_pa_backend_t fake_backend;
+#ifdef LUA_PA_PIPEWIRE
+static const lua_pa_backend_t pipewire_backend;
+static const lua_pa_backend_t* backend = &pipewire_backend;
+#else
+static const lua_pa_backend_t* backend = &pulse_backend;
+#endif
+
+static char* default_sink_name = NULL;
+static char* default_source_name = NULL;
+static pthread_mutex_t defaults_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+// What the server reported, mirrored to shm and the cache
+static const signal_registry_t live_registry = {
+	&active_sinks, &num_sinks, &active_sources, &num_sources, &default_sink_name, &default_source_name, 1
+};
+
+// Module-wide timeout and the one of the call in progress, which entry points set from their
+// timeout_ms option. Both are only touched on the caller's thread
+static pa_usec_t default_timeout = 5 * PA_USEC_PER_SEC;
+static pa_usec_t call_timeout = 5 * PA_USEC_PER_SEC;
+
+// Counters read by stats(), guarded by the mainloop lock
+static struct {
+	lua_Integer operations;
+	lua_Integer timeouts;
+} stats;
+
+// Warm-start cache under $XDG_RUNTIME_DIR, pulse backend only. While map is set the getters answer
+// from the devices indexed in it, the live registry replaces it once the context is ready.
+// Guarded by the mainloop lock
+static struct {
+	char* path;
+	void* map;
+	size_t size;
+	backend_device_t* devices[2];
+	size_t num[2];
+	const char* defaults[2];
+	pa_time_event* flush;
+	int dirty;
+} warm;
+
 static pa_sink_info* deep_copy_sink_info(const pa_sink_info* info) {
 	pa_sink_info* info_copy = malloc(sizeof(pa_sink_info));
 	if (!info_copy) {
@@ -29,9 +75,17 @@ static pa_sink_info* deep_copy_sink_info(const pa_sink_info* info) {
 	} else {
 		info_copy->name = NULL;
 	}
+	info_copy->description = info->description ? strdup(info->description) : NULL;
 	return info_copy;
 }
 
+static void free_sink_info_copy(pa_sink_info* info) {
+	if (!info) return;
+	free((char*)info->name);
+	free((char*)info->description);
+	free(info);
+}
+
 static pa_source_info* deep_copy_source_info(const pa_source_info* info) {
 	pa_source_info* info_copy = malloc(sizeof(pa_source_info));
 	if (!info_copy) {
@@ -50,91 +104,735 @@ static pa_source_info* deep_copy_source_info(const pa_source_info* info) {
 	} else {
 		info_copy->name = NULL;
 	}
+	info_copy->description = info->description ? strdup(info->description) : NULL;
 	return info_copy;
 }
 
-static int lua_sink_factory(lua_State* L, const pa_sink_info* info) {
+static void free_source_info_copy(pa_source_info* info) {
+	if (!info) return;
+	free((char*)info->name);
+	free((char*)info->description);
+	free(info);
+}
+
+static int cvolume_to_percent(const pa_cvolume* volume) {
+	return (int)round(100 * pow(10, pa_sw_volume_to_dB(pa_cvolume_avg(volume)) / 60));
+}
+
+static void percent_to_cvolume(int volume, pa_cvolume* cvolume) {
+	if (volume < 0) volume = 0;
+	if (volume > 100) volume = 100;
+	pa_cvolume_set(cvolume, 1, pa_sw_volume_from_dB(60 * log10(volume / 100.0)));
+}
+
+static struct timeval* timeval_after(struct timeval* tv, pa_usec_t usec) {
+	gettimeofday(tv, NULL);
+	tv->tv_sec += usec / 1000000;
+	tv->tv_usec += usec % 1000000;
+	if (tv->tv_usec >= 1000000) {
+		tv->tv_sec++;
+		tv->tv_usec -= 1000000;
+	}
+	return tv;
+}
+
+static void deadline_cb(pa_mainloop_api* api __attribute__((unused)), pa_time_event* e __attribute__((unused)), const struct timeval* tv __attribute__((unused)), void* userdata) {
+	*(int*)userdata = 1;
+	pa_threaded_mainloop_signal(pa_state->mainloop, 0);
+}
+
+// Arms a timer that sets *expired once call_timeout passed, 0 waits forever. The mainloop must be locked
+static pa_time_event* deadline_start(int* expired) {
+	*expired = 0;
+	if (call_timeout == 0) return NULL;
+
+	struct timeval tv;
+	pa_mainloop_api* api = pa_threaded_mainloop_get_api(pa_state->mainloop);
+	return api->time_new(api, timeval_after(&tv, call_timeout), deadline_cb, expired);
+}
+
+// Returns -1 when the deadline passed
+static int deadline_stop(pa_time_event* e, int expired) {
+	if (e) {
+		pa_mainloop_api* api = pa_threaded_mainloop_get_api(pa_state->mainloop);
+		api->time_free(e);
+	}
+
+	if (!expired) return 0;
+	stats.timeouts++;
+	return -1;
+}
+
+// Waits for operations that were all issued before the first wait, the mainloop must be locked.
+// Returns -1 when the deadline passed, the operations still running are then cancelled so
+// their callbacks never run against the caller's stack
+static int wait_all_operations(pa_operation** ops, size_t count) {
+	int expired;
+	pa_time_event* deadline = deadline_start(&expired);
+
+	for (size_t i = 0; i < count; i++) {
+		if (!ops[i]) continue;
+		while (!expired && pa_operation_get_state(ops[i]) == PA_OPERATION_RUNNING)
+			pa_threaded_mainloop_wait(pa_state->mainloop);
+		if (pa_operation_get_state(ops[i]) == PA_OPERATION_RUNNING)
+			pa_operation_cancel(ops[i]);
+		pa_operation_unref(ops[i]);
+		ops[i] = NULL;
+		stats.operations++;
+	}
+
+	return deadline_stop(deadline, expired);
+}
+
+static int wait_operation(pa_operation* op) {
+	return wait_all_operations(&op, 1);
+}
+
+// Waits until the context connected, which is only ever pending after a warm start.
+// Returns -1 when the deadline passed or the connection failed
+static int pulse_ready( ) {
+	pa_context_state_t state = pa_context_get_state(pa_state->ctx);
+	if (state == PA_CONTEXT_READY) return 0;
+
+	int expired;
+	pa_time_event* deadline = deadline_start(&expired);
+
+	while (!expired && PA_CONTEXT_IS_GOOD(state) && state != PA_CONTEXT_READY) {
+		pa_threaded_mainloop_wait(pa_state->mainloop);
+		state = pa_context_get_state(pa_state->ctx);
+	}
+
+	if (deadline_stop(deadline, expired) < 0 || state != PA_CONTEXT_READY) return -1;
+	return 0;
+}
+
+// Stores the last delivered state of a device and returns the fields that differ from it.
+// monitor_of_sink is PA_INVALID_INDEX for sinks and for sources that monitor nothing
+static unsigned int device_registry_update(active_sink_sources_t** devices, size_t* count, uint32_t index, const char* name, const char* description, const pa_cvolume* volume, int mute, uint32_t monitor_of_sink) {
+	active_sink_sources_t* d = NULL;
+	for (size_t i = 0; i < *count; i++) {
+		if ((*devices)[i].index == index) {
+			d = &(*devices)[i];
+			break;
+		}
+	}
+
+	if (!d) {
+		active_sink_sources_t* grown = realloc(*devices, (*count + 1) * sizeof(active_sink_sources_t));
+		if (!grown) return LUA_PA_FIELD_ALL;
+		*devices = grown;
+		d = &grown[(*count)++];
+		d->index = index;
+		d->name = strdup(name ? name : "");
+		d->description = strdup(description ? description : "");
+		d->volume = cvolume_to_percent(volume);
+		d->mute = mute;
+		d->monitor_of_sink = monitor_of_sink;
+		return LUA_PA_FIELD_ALL;
+	}
+
+	d->monitor_of_sink = monitor_of_sink;
+	unsigned int changed = 0;
+	int v = cvolume_to_percent(volume);
+
+	if (name && strcmp(d->name, name) != 0) {
+		free((char*)d->name);
+		d->name = strdup(name);
+		changed |= LUA_PA_FIELD_NAME;
+	}
+	if (description && strcmp(d->description, description) != 0) {
+		free(d->description);
+		d->description = strdup(description);
+		changed |= LUA_PA_FIELD_DESCRIPTION;
+	}
+	if (d->volume != v) {
+		d->volume = v;
+		changed |= LUA_PA_FIELD_VOLUME;
+	}
+	if (!d->mute != !mute) {
+		d->mute = mute;
+		changed |= LUA_PA_FIELD_MUTE;
+	}
+
+	return changed;
+}
+
+static const char* const device_field_names[] = {
+	"description", "name", "index", "volume", "mute", "set_volume", "set_mute", "set_default",
+	"latency", "configured_latency", "sample_spec", "channel_map", "state", NULL
+};
+
+// Drops index from a registry, returns its name for the remove signal or NULL when it was not there
+static char* device_registry_remove(active_sink_sources_t** devices, size_t* count, uint32_t index) {
+	for (size_t i = 0; i < *count; i++) {
+		if ((*devices)[i].index != index) continue;
+
+		char* name = (char*)(*devices)[i].name;
+		free((*devices)[i].description);
+
+		for (size_t j = i; j + 1 < *count; j++)
+			(*devices)[j] = (*devices)[j + 1];
+		(*count)--;
+
+		if (*count == 0) {
+			free(*devices);
+			*devices = NULL;
+		} else {
+			active_sink_sources_t* shrunk = realloc(*devices, *count * sizeof(active_sink_sources_t));
+			if (shrunk) *devices = shrunk;
+		}
+		return name;
+	}
+	return NULL;
+}
+
+// The fields device_registry_update() diffs, the only ones a change handler can be scoped to
+static const char* const device_change_field_names[] = {
+	"description", "name", "index", "volume", "mute", NULL
+};
+
+static const char* const device_state_names[] = { "running", "idle", "suspended", NULL };
+
+static void lua_device_fields(lua_State* L, unsigned int fields, const char* description, const char* name, uint32_t index, const pa_cvolume* volume, int mute) {
+	if (fields & LUA_PA_FIELD_DESCRIPTION) {
+		lua_pushstring(L, "description");
+		lua_pushstring(L, description);
+		lua_settable(L, -3);
+	}
+
+	if (fields & LUA_PA_FIELD_NAME) {
+		lua_pushstring(L, "name");
+		lua_pushstring(L, name);
+		lua_settable(L, -3);
+	}
+
+	if (fields & LUA_PA_FIELD_INDEX) {
+		lua_pushstring(L, "index");
+		lua_pushinteger(L, index);
+		lua_settable(L, -3);
+	}
+
+	if (fields & LUA_PA_FIELD_VOLUME) {
+		double dB = pa_sw_volume_to_dB(pa_cvolume_avg(volume));
+		int v = (int)round(100 * pow(10, dB / 60));
+		lua_pushstring(L, "volume");
+		lua_pushinteger(L, v);
+		lua_settable(L, -3);
+	}
+
+	if (fields & LUA_PA_FIELD_MUTE) {
+		lua_pushstring(L, "mute");
+		lua_pushboolean(L, mute);
+		lua_settable(L, -3);
+	}
+}
+
+// Latency in microseconds, the rest as plain Lua values
+static void lua_device_timing_fields(lua_State* L, unsigned int fields, pa_usec_t latency, pa_usec_t configured_latency, const pa_sample_spec* ss, const pa_channel_map* map, int state) {
+	if (fields & LUA_PA_FIELD_LATENCY) {
+		lua_pushinteger(L, (lua_Integer)latency);
+		lua_setfield(L, -2, "latency");
+	}
+
+	if (fields & LUA_PA_FIELD_CONFIGURED_LATENCY) {
+		lua_pushinteger(L, (lua_Integer)configured_latency);
+		lua_setfield(L, -2, "configured_latency");
+	}
+
+	if (fields & LUA_PA_FIELD_SAMPLE_SPEC) {
+		lua_createtable(L, 0, 3);
+		lua_pushstring(L, pa_sample_format_to_string(ss->format));
+		lua_setfield(L, -2, "format");
+		lua_pushinteger(L, ss->rate);
+		lua_setfield(L, -2, "rate");
+		lua_pushinteger(L, ss->channels);
+		lua_setfield(L, -2, "channels");
+		lua_setfield(L, -2, "sample_spec");
+	}
+
+	if (fields & LUA_PA_FIELD_CHANNEL_MAP) {
+		lua_createtable(L, map->channels, 0);
+		for (int i = 0; i < map->channels; i++) {
+			lua_pushstring(L, pa_channel_position_to_string(map->map[i]));
+			lua_rawseti(L, -2, i + 1);
+		}
+		lua_setfield(L, -2, "channel_map");
+	}
+
+	if (fields & LUA_PA_FIELD_STATE) {
+		lua_pushstring(L, state >= 0 && state <= 2 ? device_state_names[state] : "unknown");
+		lua_setfield(L, -2, "state");
+	}
+}
+
+static int lua_sink_factory_fields(lua_State* L, const pa_sink_info* info, unsigned int fields) {
 	if (!L || !info || !info->name) return 1;
 
 	lua_newtable(L);
 
-	lua_pushstring(L, "description");
-	lua_pushstring(L, info->description);
-	lua_settable(L, -3);
-	lua_pushstring(L, "name");
-	lua_pushstring(L, info->name);
-	lua_settable(L, -3);
+	lua_device_fields(L, fields, info->description, info->name, info->index, &info->volume, info->mute);
+	lua_device_timing_fields(L, fields, info->latency, info->configured_latency, &info->sample_spec, &info->channel_map, info->state);
+
+	if (fields & LUA_PA_FIELD_SET_VOLUME) {
+		lua_pushstring(L, "set_volume");
+		lua_pushcfunction(L, lua_pa_set_volume_sink);
+		lua_settable(L, -3);
+	}
+
+	if (fields & LUA_PA_FIELD_SET_MUTE) {
+		lua_pushstring(L, "set_mute");
+		lua_pushcfunction(L, lua_pa_set_mute_sink);
+		lua_settable(L, -3);
+	}
+
+	if (fields & LUA_PA_FIELD_SET_DEFAULT) {
+		lua_pushstring(L, "set_default");
+		lua_pushcfunction(L, lua_pa_set_default_sink);
+		lua_settable(L, -3);
+	}
+
+	return 0;
+}
 
-	lua_pushstring(L, "index");
-	lua_pushinteger(L, info->index);
-	lua_settable(L, -3);
+static int lua_source_factory_fields(lua_State* L, const pa_source_info* info, unsigned int fields) {
+	if (!L || !info || !info->name) return 1;
 
-	double dB = pa_sw_volume_to_dB(pa_cvolume_avg(&info->volume));
-	int v = (int)round(100 * pow(10, dB / 60));
-	lua_pushstring(L, "volume");
-	lua_pushinteger(L, v);
-	lua_settable(L, -3);
+	lua_newtable(L);
 
-	lua_pushstring(L, "mute");
-	lua_pushboolean(L, info->mute);
-	lua_settable(L, -3);
+	lua_device_fields(L, fields, info->description, info->name, info->index, &info->volume, info->mute);
+	lua_device_timing_fields(L, fields, info->latency, info->configured_latency, &info->sample_spec, &info->channel_map, info->state);
 
-	lua_pushstring(L, "set_volume");
-	lua_pushcfunction(L, lua_pa_set_volume_sink);
-	lua_settable(L, -3);
+	if (fields & LUA_PA_FIELD_SET_VOLUME) {
+		lua_pushstring(L, "set_volume");
+		lua_pushcfunction(L, lua_pa_set_volume_source);
+		lua_settable(L, -3);
+	}
 
-	lua_pushstring(L, "set_mute");
-	lua_pushcfunction(L, lua_pa_set_mute_sink);
-	lua_settable(L, -3);
+	if (fields & LUA_PA_FIELD_SET_MUTE) {
+		lua_pushstring(L, "set_mute");
+		lua_pushcfunction(L, lua_pa_set_mute_source);
+		lua_settable(L, -3);
+	}
 
-	lua_pushstring(L, "set_default");
-	lua_pushcfunction(L, lua_pa_set_default_sink);
-	lua_settable(L, -3);
+	if (fields & LUA_PA_FIELD_SET_DEFAULT) {
+		lua_pushstring(L, "set_default");
+		lua_pushcfunction(L, lua_pa_set_default_source);
+		lua_settable(L, -3);
+	}
 
 	return 0;
 }
 
+static int lua_sink_factory(lua_State* L, const pa_sink_info* info) {
+	return lua_sink_factory_fields(L, info, LUA_PA_FIELD_ALL);
+}
+
 static int lua_source_factory(lua_State* L, const pa_source_info* info) {
-	if (!L || !info || !info->name) return 1;
+	return lua_source_factory_fields(L, info, LUA_PA_FIELD_ALL);
+}
 
-	lua_newtable(L);
+// Sets call_timeout from the timeout_ms field of the option table at idx, or to the module default
+static void lua_pa_check_timeout(lua_State* L, int idx) {
+	call_timeout = default_timeout;
 
-	lua_pushstring(L, "description");
-	lua_pushstring(L, info->description);
-	lua_settable(L, -3);
+	if (idx == 0 || !lua_istable(L, idx)) return;
 
-	lua_pushstring(L, "name");
-	lua_pushstring(L, info->name);
-	lua_settable(L, -3);
+	lua_getfield(L, idx, "timeout_ms");
+	if (!lua_isnil(L, -1)) {
+		lua_Integer ms = luaL_checkinteger(L, -1);
+		luaL_argcheck(L, ms >= 0, idx, "timeout_ms must not be negative");
+		call_timeout = (pa_usec_t)ms * PA_USEC_PER_MSEC;
+	}
+	lua_pop(L, 1);
+}
+
+static int lua_pa_push_timeout(lua_State* L) {
+	lua_pushnil(L);
+	lua_pushstring(L, "timeout");
+	return 2;
+}
+
+// All fields, no filter
+static void list_query_defaults(list_query_t* q) {
+	q->L = NULL;
+	q->count = 0;
+	q->fields = LUA_PA_FIELD_ALL;
+	q->state = -1;
+	q->monitor = -1;
+	q->mute = -1;
+}
 
-	lua_pushstring(L, "index");
-	lua_pushinteger(L, info->index);
-	lua_settable(L, -3);
+// Parses {fields = {...}, filter = {state = ..., monitor = ..., mute = ...}} at idx
+static void lua_pa_check_list_query(lua_State* L, int idx, list_query_t* q) {
+	list_query_defaults(q);
+	q->L = L;
+
+	if (lua_isnoneornil(L, idx)) return;
+	luaL_checktype(L, idx, LUA_TTABLE);
+
+	lua_getfield(L, idx, "fields");
+	if (lua_istable(L, -1)) {
+		q->fields = 0;
+		size_t n = lua_rawlen(L, -1);
+		for (size_t i = 1; i <= n; i++) {
+			lua_rawgeti(L, -1, i);
+			q->fields |= 1u << luaL_checkoption(L, -1, NULL, device_field_names);
+			lua_pop(L, 1);
+		}
+	}
+	lua_pop(L, 1);
 
-	double dB = pa_sw_volume_to_dB(pa_cvolume_avg(&info->volume));
-	int v = (int)round(100 * pow(10, dB / 60));
+	lua_getfield(L, idx, "filter");
+	if (lua_istable(L, -1)) {
+		lua_getfield(L, -1, "state");
+		if (!lua_isnil(L, -1))
+			q->state = luaL_checkoption(L, -1, NULL, device_state_names);
+		lua_pop(L, 1);
 
-	lua_pushstring(L, "volume");
-	lua_pushinteger(L, v);
-	lua_settable(L, -3);
+		lua_getfield(L, -1, "monitor");
+		if (!lua_isnil(L, -1))
+			q->monitor = lua_toboolean(L, -1);
+		lua_pop(L, 1);
 
-	lua_pushstring(L, "mute");
-	lua_pushboolean(L, info->mute);
-	lua_settable(L, -3);
+		lua_getfield(L, -1, "mute");
+		if (!lua_isnil(L, -1))
+			q->mute = lua_toboolean(L, -1);
+		lua_pop(L, 1);
+	}
+	lua_pop(L, 1);
+}
 
-	lua_pushstring(L, "set_volume");
-	lua_pushcfunction(L, lua_pa_set_volume_source);
-	lua_settable(L, -3);
+static int sink_matches(const list_query_t* q, const pa_sink_info* info) {
+	if (q->state >= 0 && (int)info->state != q->state) return 0;
+	if (q->monitor == 1) return 0;
+	if (q->mute >= 0 && !info->mute != !q->mute) return 0;
+	return 1;
+}
 
-	lua_pushstring(L, "set_mute");
-	lua_pushcfunction(L, lua_pa_set_mute_source);
-	lua_settable(L, -3);
+static int source_matches(const list_query_t* q, const pa_source_info* info) {
+	if (q->state >= 0 && (int)info->state != q->state) return 0;
+	if (q->monitor >= 0 && (info->monitor_of_sink != PA_INVALID_INDEX) != q->monitor) return 0;
+	if (q->mute >= 0 && !info->mute != !q->mute) return 0;
+	return 1;
+}
 
-	lua_pushstring(L, "set_default");
-	lua_pushcfunction(L, lua_pa_set_default_source);
-	lua_settable(L, -3);
+static int dispatch_fd = -1;
+static pthread_mutex_t pending_mutex = PTHREAD_MUTEX_INITIALIZER;
+static lua_pa_pending_t* completed_ops = NULL;
 
+static int lua_pa_can_yield(lua_State* L) {
+#if LUA_VERSION_NUM >= 503
+	return lua_isyieldable(L);
+#elif LUA_VERSION_NUM == 502
+	int is_main = lua_pushthread(L);
+	lua_pop(L, 1);
+	return !is_main;
+#else
+	(void)L;
 	return 0;
+#endif
+}
+
+// Returns NULL when the call has to block, either the host never asked for the
+// dispatch fd (nobody would resume us) or L cannot yield
+static lua_pa_pending_t* pending_begin(lua_State* L, int kind) {
+	if (dispatch_fd < 0 || backend != &pulse_backend || !lua_pa_can_yield(L)) return NULL;
+	if (pa_context_get_state(pa_state->ctx) != PA_CONTEXT_READY) return NULL;
+
+	lua_pa_pending_t* p = calloc(1, sizeof(lua_pa_pending_t));
+	if (!p) return NULL;
+
+	p->co = L;
+	p->kind = kind;
+	list_query_defaults(&p->query);
+	lua_pushthread(L);
+	p->ref = luaL_ref(L, LUA_REGISTRYINDEX);
+
+	return p;
+}
+
+// Called on the mainloop thread, hands p over to the next dispatch()
+static void pending_complete(lua_pa_pending_t* p, int success) {
+	p->success = success;
+
+	if (p->deadline) {
+		pa_mainloop_api* api = pa_threaded_mainloop_get_api(pa_state->mainloop);
+		api->time_free(p->deadline);
+		p->deadline = NULL;
+	}
+	if (p->op) {
+		pa_operation_unref(p->op);
+		p->op = NULL;
+	}
+
+	pthread_mutex_lock(&pending_mutex);
+	p->next = completed_ops;
+	completed_ops = p;
+	pthread_mutex_unlock(&pending_mutex);
+
+	uint64_t one = 1;
+	ssize_t r __attribute__((unused)) = write(dispatch_fd, &one, sizeof(one));
+}
+
+static void pending_append(lua_pa_pending_t* p, void* item) {
+	if (!item) return;
+	void** grown = realloc(p->items, (p->count + 1) * sizeof(void*));
+	if (!grown) {
+		free(item);
+		return;
+	}
+	p->items = grown;
+	p->items[p->count++] = item;
+}
+
+static void pending_free(lua_pa_pending_t* p) {
+	for (size_t i = 0; i < p->count; i++) {
+		if (p->kind == PENDING_SINK || p->kind == PENDING_SINK_LIST)
+			free_sink_info_copy((pa_sink_info*)p->items[i]);
+		else
+			free_source_info_copy((pa_source_info*)p->items[i]);
+	}
+	free(p->items);
+	free(p);
+}
+
+static void pending_success_cb(pa_context* c __attribute__((unused)), int success, void* userdata) {
+	pending_complete((lua_pa_pending_t*)userdata, success);
+}
+
+static void pending_sink_info_cb(pa_context* c __attribute__((unused)), const pa_sink_info* info, int eol, void* userdata) {
+	lua_pa_pending_t* p = (lua_pa_pending_t*)userdata;
+
+	if (eol) {
+		pending_complete(p, eol > 0);
+		return;
+	}
+
+	if (info && sink_matches(&p->query, info))
+		pending_append(p, deep_copy_sink_info(info));
+}
+
+static void pending_source_info_cb(pa_context* c __attribute__((unused)), const pa_source_info* info, int eol, void* userdata) {
+	lua_pa_pending_t* p = (lua_pa_pending_t*)userdata;
+
+	if (eol) {
+		pending_complete(p, eol > 0);
+		return;
+	}
+
+	if (info && source_matches(&p->query, info))
+		pending_append(p, deep_copy_source_info(info));
+}
+
+static void pending_server_info_cb(pa_context* c, const pa_server_info* info, void* userdata) {
+	lua_pa_pending_t* p = (lua_pa_pending_t*)userdata;
+
+	pa_operation* op = NULL;
+	if (info && p->kind == PENDING_SINK)
+		op = pa_context_get_sink_info_by_name(c, info->default_sink_name, pending_sink_info_cb, p);
+	else if (info)
+		op = pa_context_get_source_info_by_name(c, info->default_source_name, pending_source_info_cb, p);
+
+	if (op) {
+		// The server info query is done, the deadline now has to cancel this one
+		pa_operation_unref(p->op);
+		p->op = op;
+	} else {
+		pending_complete(p, 0);
+	}
+}
+
+#if LUA_VERSION_NUM >= 503
+static int pending_k(lua_State* L, int status __attribute__((unused)), lua_KContext ctx) {
+	return lua_gettop(L) - (int)ctx;
+}
+#elif LUA_VERSION_NUM == 502
+static int pending_k(lua_State* L) {
+	int ctx = 0;
+	lua_getctx(L, &ctx);
+	return lua_gettop(L) - ctx;
+}
+#endif
+
+static void pending_deadline_cb(pa_mainloop_api* api, pa_time_event* e, const struct timeval* tv __attribute__((unused)), void* userdata) {
+	lua_pa_pending_t* p = (lua_pa_pending_t*)userdata;
+
+	api->time_free(e);
+	p->deadline = NULL;
+
+	if (p->op)
+		pa_operation_cancel(p->op);
+	p->timed_out = 1;
+	stats.timeouts++;
+	pending_complete(p, 0);
+}
+
+// Releases the mainloop lock taken by the caller and suspends the coroutine,
+// dispatch() pushes the results and the continuation returns them
+static int pending_await(lua_State* L, pa_operation* op, lua_pa_pending_t* p) {
+	if (op) {
+		p->op = op;
+		stats.operations++;
+		if (call_timeout > 0) {
+			struct timeval tv;
+			pa_mainloop_api* api = pa_threaded_mainloop_get_api(pa_state->mainloop);
+			p->deadline = api->time_new(api, timeval_after(&tv, call_timeout), pending_deadline_cb, p);
+		}
+	} else {
+		pending_complete(p, 0);
+	}
+
+	pa_threaded_mainloop_unlock(pa_state->mainloop);
+
+#if LUA_VERSION_NUM >= 502
+	return lua_yieldk(L, 0, lua_gettop(L), pending_k);
+#else
+	return lua_yield(L, 0);
+#endif
+}
+
+static int pending_push_results(lua_State* co, lua_pa_pending_t* p) {
+	luaL_checkstack(co, 3, NULL);
+
+	if (p->timed_out)
+		return lua_pa_push_timeout(co);
+
+	switch (p->kind) {
+	case PENDING_SINK_LIST:
+	case PENDING_SOURCE_LIST:
+		lua_createtable(co, (int)p->count, 0);
+		for (size_t i = 0; i < p->count; i++) {
+			int r = p->kind == PENDING_SINK_LIST
+				? lua_sink_factory_fields(co, (pa_sink_info*)p->items[i], p->query.fields)
+				: lua_source_factory_fields(co, (pa_source_info*)p->items[i], p->query.fields);
+			if (r == 0)
+				lua_rawseti(co, -2, (lua_Integer)i + 1);
+		}
+		return 1;
+	case PENDING_SINK:
+		if (p->count == 0 || lua_sink_factory(co, (pa_sink_info*)p->items[0]) != 0)
+			lua_pushnil(co);
+		return 1;
+	case PENDING_SOURCE:
+		if (p->count == 0 || lua_source_factory(co, (pa_source_info*)p->items[0]) != 0)
+			lua_pushnil(co);
+		return 1;
+	default:
+		lua_pushboolean(co, p->success);
+		return 1;
+	}
+}
+
+// Opts into coroutine mode, calls made from a yieldable coroutine suspend it
+// instead of blocking and are resumed by dispatch() once this fd is readable.
+// Only the pulse backend can suspend a call, the others return nil and an error
+static int lua_pa_dispatch_fd(lua_State* L) {
+	if (backend != &pulse_backend) {
+		lua_pushnil(L);
+		lua_pushfstring(L, "coroutine mode needs the pulse backend, not %s", backend->name);
+		return 2;
+	}
+
+	if (dispatch_fd < 0)
+		dispatch_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+
+	if (dispatch_fd < 0) {
+		lua_pushnil(L);
+		lua_pushstring(L, strerror(errno));
+		return 2;
+	}
+
+	lua_pushinteger(L, dispatch_fd);
+	return 1;
+}
+
+static int lua_pa_dispatch(lua_State* L) {
+	if (dispatch_fd >= 0) {
+		uint64_t count;
+		ssize_t r __attribute__((unused)) = read(dispatch_fd, &count, sizeof(count));
+	}
+
+	pthread_mutex_lock(&pending_mutex);
+	lua_pa_pending_t* list = completed_ops;
+	completed_ops = NULL;
+	pthread_mutex_unlock(&pending_mutex);
+
+	// Completed in LIFO order, resume in the order the operations finished
+	lua_pa_pending_t* ordered = NULL;
+	while (list) {
+		lua_pa_pending_t* next = list->next;
+		list->next = ordered;
+		ordered = list;
+		list = next;
+	}
+
+	lua_Integer resumed = 0;
+	while (ordered) {
+		lua_pa_pending_t* p = ordered;
+		ordered = p->next;
+
+		lua_State* co = p->co;
+		int nargs = pending_push_results(co, p);
+		int ref = p->ref;
+		pending_free(p);
+
+#if LUA_VERSION_NUM >= 504
+		int nres = 0;
+		int status = lua_resume(co, L, nargs, &nres);
+#elif LUA_VERSION_NUM >= 502
+		int status = lua_resume(co, L, nargs);
+#else
+		int status = lua_resume(co, nargs);
+#endif
+		if (status != LUA_OK && status != LUA_YIELD)
+			fprintf(stderr, "ERROR: lua_pa coroutine failed: %s\n", lua_tostring(co, -1));
+#if LUA_VERSION_NUM >= 504
+		// A coroutine suspended in its next lua_pa call keeps that call's frame on its stack,
+		// only the values it yielded are ours to drop
+		lua_pop(co, status == LUA_YIELD ? nres : lua_gettop(co));
+#else
+		// Older versions hide the frame of a yielding C function below the yielded values
+		lua_settop(co, 0);
+#endif
+
+		luaL_unref(L, LUA_REGISTRYINDEX, ref);
+		resumed++;
+	}
+
+	lua_pushinteger(L, resumed);
+	return 1;
+}
+
+// Sets the timeout used by calls without a timeout_ms option, 0 waits forever
+static int lua_pa_set_timeout(lua_State* L) {
+	lua_Integer ms = luaL_checkinteger(L, 1);
+	luaL_argcheck(L, ms >= 0, 1, "timeout must not be negative");
+
+	default_timeout = (pa_usec_t)ms * PA_USEC_PER_MSEC;
+
+	lua_pushboolean(L, 1);
+	return 1;
+}
+
+static int lua_pa_stats(lua_State* L) {
+	if (!pa_state) {
+		lua_pushstring(L, "PulseAudio not initialized.");
+		lua_error(L);
+	}
+
+	pa_threaded_mainloop_lock(pa_state->mainloop);
+	lua_Integer operations = stats.operations;
+	lua_Integer timeouts = stats.timeouts;
+	pa_threaded_mainloop_unlock(pa_state->mainloop);
+
+	lua_createtable(L, 0, 3);
+	lua_pushinteger(L, operations);
+	lua_setfield(L, -2, "operations");
+	lua_pushinteger(L, timeouts);
+	lua_setfield(L, -2, "timeouts");
+	lua_pushinteger(L, (lua_Integer)(default_timeout / PA_USEC_PER_MSEC));
+	lua_setfield(L, -2, "timeout_ms");
+	return 1;
 }
 
 static int lua_pa_set_volume_sink(lua_State* L) {
@@ -143,37 +841,43 @@ static int lua_pa_set_volume_sink(lua_State* L) {
 	const char* sink_name = NULL;
 	int volume = 0;
 
-	if (nargs == 2 && lua_istable(L, 1)) {
+	if ((nargs == 2 || nargs == 3) && lua_istable(L, 1)) {
 		lua_getfield(L, 1, "name");
 		sink_name = luaL_checkstring(L, -1);
 		lua_pop(L, 1);
 
 		volume = luaL_checkinteger(L, 2);
-	} else if (nargs == 2) {
+	} else if (nargs == 2 || nargs == 3) {
 		sink_name = luaL_checkstring(L, 1);
 		volume = luaL_checkinteger(L, 2);
 	} else {
-		lua_pushstring(L, "Invalid arguments. Usage: set_volume(device, volume) or object.set_volume(volume)");
+		lua_pushstring(L, "Invalid arguments. Usage: set_volume(device, volume[, {timeout_ms = n}]) or object.set_volume(volume)");
 		lua_error(L);
 	}
 
+	lua_pa_check_timeout(L, 3);
+
 	if (volume < 0) volume = 0;
 	if (volume > 100) volume = 100;
 
+	lua_pa_pending_t* p = pending_begin(L, PENDING_SUCCESS);
+
 	pa_threaded_mainloop_lock(pa_state->mainloop);
 
 	pa_volume_t pa_volume = pa_sw_volume_from_dB(60 * log10(volume / 100.0));
 	pa_cvolume cvolume;
 	pa_cvolume_set(&cvolume, 1, pa_volume);
 
-	pa_operation* op = pa_context_set_sink_volume_by_name(pa_state->ctx, sink_name, &cvolume, lua_pa_successful_callback, NULL);
+	if (p)
+		return pending_await(L, pa_context_set_sink_volume_by_name(pa_state->ctx, sink_name, &cvolume, pending_success_cb, p), p);
 
-	while (pa_operation_get_state(op) == PA_OPERATION_RUNNING)
-		pa_threaded_mainloop_wait(pa_state->mainloop);
-	pa_operation_unref(op);
+	int r = backend->set_volume(0, sink_name, &cvolume);
 
 	pa_threaded_mainloop_unlock(pa_state->mainloop);
 
+	if (r < 0)
+		return lua_pa_push_timeout(L);
+
 	lua_pushboolean(L, 1);
 	return 1;
 }
@@ -184,37 +888,43 @@ static int lua_pa_set_volume_source(lua_State* L) {
 	const char* source_name = NULL;
 	int volume = 0;
 
-	if (nargs == 2 && lua_istable(L, 1)) {
+	if ((nargs == 2 || nargs == 3) && lua_istable(L, 1)) {
 		lua_getfield(L, 1, "name");
 		source_name = luaL_checkstring(L, -1);
 		lua_pop(L, 1);
 
 		volume = luaL_checkinteger(L, 2);
-	} else if (nargs == 2) {
+	} else if (nargs == 2 || nargs == 3) {
 		source_name = luaL_checkstring(L, 1);
 		volume = luaL_checkinteger(L, 2);
 	} else {
-		lua_pushstring(L, "Invalid arguments. Usage: set_volume(device, volume) or object.set_volume(volume)");
+		lua_pushstring(L, "Invalid arguments. Usage: set_volume(device, volume[, {timeout_ms = n}]) or object.set_volume(volume)");
 		lua_error(L);
 	}
 
+	lua_pa_check_timeout(L, 3);
+
 	if (volume < 0) volume = 0;
 	else if (volume > 100) volume = 100;
 
+	lua_pa_pending_t* p = pending_begin(L, PENDING_SUCCESS);
+
 	pa_threaded_mainloop_lock(pa_state->mainloop);
 
 	pa_volume_t pa_volume = pa_sw_volume_from_dB(60 * log10(volume / 100.0));
 	pa_cvolume cvolume;
 	pa_cvolume_set(&cvolume, 1, pa_volume);
 
-	pa_operation* op = pa_context_set_source_volume_by_name(pa_state->ctx, source_name, &cvolume, lua_pa_successful_callback, NULL);
+	if (p)
+		return pending_await(L, pa_context_set_source_volume_by_name(pa_state->ctx, source_name, &cvolume, pending_success_cb, p), p);
 
-	while (pa_operation_get_state(op) == PA_OPERATION_RUNNING)
-		pa_threaded_mainloop_wait(pa_state->mainloop);
-	pa_operation_unref(op);
+	int r = backend->set_volume(1, source_name, &cvolume);
 
 	pa_threaded_mainloop_unlock(pa_state->mainloop);
 
+	if (r < 0)
+		return lua_pa_push_timeout(L);
+
 	lua_pushboolean(L, 1);
 	return 1;
 }
@@ -225,30 +935,36 @@ static int lua_pa_set_mute_sink(lua_State* L) {
 	const char* sink_name = NULL;
 	int mute = 0;
 
-	if (nargs == 2 && lua_istable(L, 1)) {
+	if ((nargs == 2 || nargs == 3) && lua_istable(L, 1)) {
 		lua_getfield(L, 1, "name");
 		sink_name = luaL_checkstring(L, -1);
 		lua_pop(L, 1);
 
 		mute = lua_toboolean(L, 2);
-	} else if (nargs == 2) {
+	} else if (nargs == 2 || nargs == 3) {
 		sink_name = luaL_checkstring(L, 1);
 		mute = lua_toboolean(L, 2);
 	} else {
-		lua_pushstring(L, "Invalid arguments. Usage: set_volume(device, volume) or object.set_volume(volume)");
+		lua_pushstring(L, "Invalid arguments. Usage: set_volume(device, volume[, {timeout_ms = n}]) or object.set_volume(volume)");
 		lua_error(L);
 	}
 
+	lua_pa_check_timeout(L, 3);
+
+	lua_pa_pending_t* p = pending_begin(L, PENDING_SUCCESS);
+
 	pa_threaded_mainloop_lock(pa_state->mainloop);
 
-	pa_operation* op = pa_context_set_sink_mute_by_name(pa_state->ctx, sink_name, mute, lua_pa_successful_callback, NULL);
+	if (p)
+		return pending_await(L, pa_context_set_sink_mute_by_name(pa_state->ctx, sink_name, mute, pending_success_cb, p), p);
 
-	while (pa_operation_get_state(op) == PA_OPERATION_RUNNING)
-		pa_threaded_mainloop_wait(pa_state->mainloop);
-	pa_operation_unref(op);
+	int r = backend->set_mute(0, sink_name, mute);
 
 	pa_threaded_mainloop_unlock(pa_state->mainloop);
 
+	if (r < 0)
+		return lua_pa_push_timeout(L);
+
 	lua_pushboolean(L, 1);
 	return 1;
 }
@@ -259,60 +975,195 @@ static int lua_pa_set_mute_source(lua_State* L) {
 	const char* sink_name = NULL;
 	int mute = 0;
 
-	if (nargs == 2 && lua_istable(L, 1)) {
+	if ((nargs == 2 || nargs == 3) && lua_istable(L, 1)) {
 		lua_getfield(L, 1, "name");
 		sink_name = luaL_checkstring(L, -1);
 		lua_pop(L, 1);
 
 		mute = lua_toboolean(L, 2);
-	} else if (nargs == 2) {
+	} else if (nargs == 2 || nargs == 3) {
 		sink_name = luaL_checkstring(L, 1);
 		mute = lua_toboolean(L, 2);
 	} else {
-		lua_pushstring(L, "Invalid arguments. Usage: set_volume(device, volume) or object.set_volume(volume)");
+		lua_pushstring(L, "Invalid arguments. Usage: set_volume(device, volume[, {timeout_ms = n}]) or object.set_volume(volume)");
 		lua_error(L);
 	}
 
+	lua_pa_check_timeout(L, 3);
+
+	lua_pa_pending_t* p = pending_begin(L, PENDING_SUCCESS);
+
 	pa_threaded_mainloop_lock(pa_state->mainloop);
 
-	pa_operation* op = pa_context_set_sink_mute_by_name(pa_state->ctx, sink_name, mute, lua_pa_successful_callback, NULL);
+	if (p)
+		return pending_await(L, pa_context_set_source_mute_by_name(pa_state->ctx, sink_name, mute, pending_success_cb, p), p);
 
-	while (pa_operation_get_state(op) == PA_OPERATION_RUNNING)
-		pa_threaded_mainloop_wait(pa_state->mainloop);
-	pa_operation_unref(op);
+	int r = backend->set_mute(1, sink_name, mute);
 
 	pa_threaded_mainloop_unlock(pa_state->mainloop);
 
+	if (r < 0)
+		return lua_pa_push_timeout(L);
+
 	lua_pushboolean(L, 1);
 	return 1;
 }
 
-static int lua_pa_set_default_sink(lua_State* L) {
-	int nargs = lua_gettop(L);
+static void stream_move_add(stream_move_t* m, uint32_t index) {
+	uint32_t* grown = realloc(m->indexes, (m->count + 1) * sizeof(uint32_t));
+	if (!grown) return;
+	m->indexes = grown;
+	m->indexes[m->count++] = index;
+}
 
-	const char* sink_name = NULL;
+static const active_sink_sources_t* registry_find_name(const active_sink_sources_t* devices, size_t count, const char* name) {
+	for (size_t i = 0; i < count; i++)
+		if (strcmp(devices[i].name, name) == 0)
+			return &devices[i];
+	return NULL;
+}
 
-	if (nargs == 1 && lua_istable(L, 1)) {
-		lua_getfield(L, 1, "name");
-		sink_name = luaL_checkstring(L, -1);
-		lua_pop(L, 1);
-	} else if (nargs == 1) {
-		sink_name = luaL_checkstring(L, 1);
-	} else {
-		lua_pushstring(L, "Invalid arguments. Usage: set_default_sink(device) or object.set_default_sink()");
-		lua_error(L);
-	}
+static const active_sink_sources_t* registry_find_index(const active_sink_sources_t* devices, size_t count, uint32_t index) {
+	for (size_t i = 0; i < count; i++)
+		if (devices[i].index == index)
+			return &devices[i];
+	return NULL;
+}
 
-	pa_threaded_mainloop_lock(pa_state->mainloop);
+static void move_sink_input_list_cb(pa_context* c __attribute__((unused)), const pa_sink_input_info* info, int eol, void* userdata) {
+	stream_move_t* m = (stream_move_t*)userdata;
 
-	pa_operation* op = pa_context_set_default_sink(pa_state->ctx, sink_name, lua_pa_successful_callback, NULL);
+	if (!eol && info && info->sink != m->target)
+		stream_move_add(m, info->index);
 
-	while (pa_operation_get_state(op) == PA_OPERATION_RUNNING)
-		pa_threaded_mainloop_wait(pa_state->mainloop);
-	pa_operation_unref(op);
+	pa_threaded_mainloop_signal(pa_state->mainloop, 0);
+}
+
+// Streams recording a monitor follow their sink, not the default source
+static void move_source_output_list_cb(pa_context* c __attribute__((unused)), const pa_source_output_info* info, int eol, void* userdata) {
+	stream_move_t* m = (stream_move_t*)userdata;
+
+	if (!eol && info && info->source != m->target) {
+		// A source the registry has not seen yet is left where it is rather than guessed at
+		const active_sink_sources_t* source = registry_find_index(active_sources, num_sources, info->source);
+		if (source && source->monitor_of_sink == PA_INVALID_INDEX)
+			stream_move_add(m, info->index);
+	}
+
+	pa_threaded_mainloop_signal(pa_state->mainloop, 0);
+}
+
+static void stream_moved_cb(pa_context* c __attribute__((unused)), int success, void* userdata) {
+	stream_move_t* m = (stream_move_t*)userdata;
+	if (success) m->moved++;
+	pa_threaded_mainloop_signal(pa_state->mainloop, 0);
+}
+
+// Sets the default and lists the streams in one round trip, then moves them all with a single wait.
+// The mainloop must be locked, returns the number of streams moved or -1 on timeout
+static int set_default_moving_streams(int source, const char* name) {
+	stream_move_t m = { NULL, 0, PA_INVALID_INDEX, 0 };
+
+	if (pulse_ready( ) < 0) return -1;
+
+	const active_sink_sources_t* device = source
+		? registry_find_name(active_sources, num_sources, name)
+		: registry_find_name(active_sinks, num_sinks, name);
+	if (device) m.target = device->index;
+
+	pa_operation* ops[2];
+	if (source) {
+		ops[0] = pa_context_set_default_source(pa_state->ctx, name, lua_pa_successful_callback, NULL);
+		ops[1] = pa_context_get_source_output_info_list(pa_state->ctx, move_source_output_list_cb, &m);
+	} else {
+		ops[0] = pa_context_set_default_sink(pa_state->ctx, name, lua_pa_successful_callback, NULL);
+		ops[1] = pa_context_get_sink_input_info_list(pa_state->ctx, move_sink_input_list_cb, &m);
+	}
+	if (wait_all_operations(ops, 2) < 0) {
+		free(m.indexes);
+		return -1;
+	}
+
+	if (m.count == 0) return 0;
+
+	pa_operation** moves = calloc(m.count, sizeof(pa_operation*));
+	if (!moves) {
+		free(m.indexes);
+		return 0;
+	}
+
+	for (size_t i = 0; i < m.count; i++) {
+		if (source)
+			moves[i] = m.target != PA_INVALID_INDEX
+				? pa_context_move_source_output_by_index(pa_state->ctx, m.indexes[i], m.target, stream_moved_cb, &m)
+				: pa_context_move_source_output_by_name(pa_state->ctx, m.indexes[i], name, stream_moved_cb, &m);
+		else
+			moves[i] = m.target != PA_INVALID_INDEX
+				? pa_context_move_sink_input_by_index(pa_state->ctx, m.indexes[i], m.target, stream_moved_cb, &m)
+				: pa_context_move_sink_input_by_name(pa_state->ctx, m.indexes[i], name, stream_moved_cb, &m);
+	}
+	int r = wait_all_operations(moves, m.count);
+
+	free(moves);
+	free(m.indexes);
+	return r < 0 ? -1 : m.moved;
+}
+
+static int lua_pa_set_default_sink(lua_State* L) {
+	int nargs = lua_gettop(L);
+
+	const char* sink_name = NULL;
+	int move_streams = 0;
+
+	if ((nargs == 1 || nargs == 2) && lua_istable(L, 1)) {
+		lua_getfield(L, 1, "name");
+		sink_name = luaL_checkstring(L, -1);
+		lua_pop(L, 1);
+	} else if (nargs == 1 || nargs == 2) {
+		sink_name = luaL_checkstring(L, 1);
+	} else {
+		lua_pushstring(L, "Invalid arguments. Usage: set_default_sink(device[, {move_streams = true, timeout_ms = n}]) or object.set_default_sink()");
+		lua_error(L);
+	}
+
+	if (nargs == 2) {
+		luaL_checktype(L, 2, LUA_TTABLE);
+		lua_getfield(L, 2, "move_streams");
+		move_streams = lua_toboolean(L, -1);
+		lua_pop(L, 1);
+	}
+	lua_pa_check_timeout(L, 2);
+
+	if (move_streams) {
+		if (backend != &pulse_backend)
+			return luaL_error(L, "move_streams needs the pulse backend");
+
+		pa_threaded_mainloop_lock(pa_state->mainloop);
+		int moved = set_default_moving_streams(0, sink_name);
+		pa_threaded_mainloop_unlock(pa_state->mainloop);
+
+		if (moved < 0)
+			return lua_pa_push_timeout(L);
+
+		lua_pushboolean(L, 1);
+		lua_pushinteger(L, moved);
+		return 2;
+	}
+
+	lua_pa_pending_t* p = pending_begin(L, PENDING_SUCCESS);
+
+	pa_threaded_mainloop_lock(pa_state->mainloop);
+
+	if (p)
+		return pending_await(L, pa_context_set_default_sink(pa_state->ctx, sink_name, pending_success_cb, p), p);
+
+	int r = backend->set_default(0, sink_name);
 
 	pa_threaded_mainloop_unlock(pa_state->mainloop);
 
+	if (r < 0)
+		return lua_pa_push_timeout(L);
+
 	lua_pushboolean(L, 1);
 
 	return 1;
@@ -322,28 +1173,57 @@ static int lua_pa_set_default_source(lua_State* L) {
 	int nargs = lua_gettop(L);
 
 	const char* source_name = NULL;
+	int move_streams = 0;
 
-	if (nargs == 1 && lua_istable(L, 1)) {
+	if ((nargs == 1 || nargs == 2) && lua_istable(L, 1)) {
 		lua_getfield(L, 1, "name");
 		source_name = luaL_checkstring(L, -1);
 		lua_pop(L, 1);
-	} else if (nargs == 1) {
+	} else if (nargs == 1 || nargs == 2) {
 		source_name = luaL_checkstring(L, 1);
 	} else {
-		lua_pushstring(L, "Invalid arguments. Usage: set_default_source(device) or object.set_default_source()");
+		lua_pushstring(L, "Invalid arguments. Usage: set_default_source(device[, {move_streams = true, timeout_ms = n}]) or object.set_default_source()");
 		lua_error(L);
 	}
 
+	if (nargs == 2) {
+		luaL_checktype(L, 2, LUA_TTABLE);
+		lua_getfield(L, 2, "move_streams");
+		move_streams = lua_toboolean(L, -1);
+		lua_pop(L, 1);
+	}
+	lua_pa_check_timeout(L, 2);
+
+	if (move_streams) {
+		if (backend != &pulse_backend)
+			return luaL_error(L, "move_streams needs the pulse backend");
+
+		pa_threaded_mainloop_lock(pa_state->mainloop);
+		int moved = set_default_moving_streams(1, source_name);
+		pa_threaded_mainloop_unlock(pa_state->mainloop);
+
+		if (moved < 0)
+			return lua_pa_push_timeout(L);
+
+		lua_pushboolean(L, 1);
+		lua_pushinteger(L, moved);
+		return 2;
+	}
+
+	lua_pa_pending_t* p = pending_begin(L, PENDING_SUCCESS);
+
 	pa_threaded_mainloop_lock(pa_state->mainloop);
 
-	pa_operation* op = pa_context_set_default_source(pa_state->ctx, source_name, lua_pa_successful_callback, NULL);
+	if (p)
+		return pending_await(L, pa_context_set_default_source(pa_state->ctx, source_name, pending_success_cb, p), p);
 
-	while (pa_operation_get_state(op) == PA_OPERATION_RUNNING)
-		pa_threaded_mainloop_wait(pa_state->mainloop);
-	pa_operation_unref(op);
+	int r = backend->set_default(1, source_name);
 
 	pa_threaded_mainloop_unlock(pa_state->mainloop);
 
+	if (r < 0)
+		return lua_pa_push_timeout(L);
+
 	lua_pushboolean(L, 1);
 
 	return 1;
@@ -355,17 +1235,33 @@ static int lua_pa_get_all_sinks(lua_State* L) {
 		lua_error(L);
 	}
 
+	list_query_t query;
+	lua_pa_check_list_query(L, 1, &query);
+	lua_pa_check_timeout(L, 1);
+
+	if (warm_push_devices(L, 0, &query))
+		return 1;
+
+	lua_pa_pending_t* p = pending_begin(L, PENDING_SINK_LIST);
+	if (p) {
+		p->query = query;
+		pa_threaded_mainloop_lock(pa_state->mainloop);
+		return pending_await(L, pa_context_get_sink_info_list(pa_state->ctx, pending_sink_info_cb, p), p);
+	}
+
 	lua_newtable(L);
 
 	pa_threaded_mainloop_lock(pa_state->mainloop);
 
-	pa_operation* op = pa_context_get_sink_info_list(pa_state->ctx, sink_info_cb, L);
+	int r = backend->list_sinks(sink_info_cb, &query);
 
-	while (pa_operation_get_state(op) == PA_OPERATION_RUNNING)
-		pa_threaded_mainloop_wait(pa_state->mainloop);
-	pa_operation_unref(op);
 	pa_threaded_mainloop_unlock(pa_state->mainloop);
 
+	if (r < 0) {
+		lua_pop(L, 1);
+		return lua_pa_push_timeout(L);
+	}
+
 	return 1;
 }
 
@@ -375,17 +1271,33 @@ static int lua_pa_get_all_sources(lua_State* L) {
 		lua_error(L);
 	}
 
+	list_query_t query;
+	lua_pa_check_list_query(L, 1, &query);
+	lua_pa_check_timeout(L, 1);
+
+	if (warm_push_devices(L, 1, &query))
+		return 1;
+
+	lua_pa_pending_t* p = pending_begin(L, PENDING_SOURCE_LIST);
+	if (p) {
+		p->query = query;
+		pa_threaded_mainloop_lock(pa_state->mainloop);
+		return pending_await(L, pa_context_get_source_info_list(pa_state->ctx, pending_source_info_cb, p), p);
+	}
+
 	lua_newtable(L);
 
 	pa_threaded_mainloop_lock(pa_state->mainloop);
 
-	pa_operation* op = pa_context_get_source_info_list(pa_state->ctx, source_info_cb, L);
+	int r = backend->list_sources(source_info_cb, &query);
 
-	while (pa_operation_get_state(op) == PA_OPERATION_RUNNING)
-		pa_threaded_mainloop_wait(pa_state->mainloop);
-	pa_operation_unref(op);
 	pa_threaded_mainloop_unlock(pa_state->mainloop);
 
+	if (r < 0) {
+		lua_pop(L, 1);
+		return lua_pa_push_timeout(L);
+	}
+
 	return 1;
 }
 
@@ -395,27 +1307,44 @@ static int lua_pa_get_default_sink(lua_State* L) {
 		lua_error(L);
 	}
 
+	lua_pa_check_timeout(L, 1);
+
+	if (warm_push_device(L, 0, NULL))
+		return 1;
+
+	lua_pa_pending_t* p = pending_begin(L, PENDING_SINK);
+	if (p) {
+		pa_threaded_mainloop_lock(pa_state->mainloop);
+		return pending_await(L, pa_context_get_server_info(pa_state->ctx, pending_server_info_cb, p), p);
+	}
+
+	int top = lua_gettop(L);
+
 	pa_threaded_mainloop_lock(pa_state->mainloop);
 
-	pa_operation* op = pa_context_get_server_info(pa_state->ctx, sink_server_info_cb, L);
+	int r = backend->get_server(sink_server_info_cb, L);
 
-	while (pa_operation_get_state(op) == PA_OPERATION_RUNNING)
-		pa_threaded_mainloop_wait(pa_state->mainloop);
-	pa_operation_unref(op);
 	pa_threaded_mainloop_unlock(pa_state->mainloop);
 
+	if (r < 0) {
+		lua_settop(L, top);
+		return lua_pa_push_timeout(L);
+	}
+
 	const char* default_sink_name = lua_tostring(L, -1);
 	lua_pop(L, 1);
 
 	pa_threaded_mainloop_lock(pa_state->mainloop);
 
-	op = pa_context_get_sink_info_by_name(pa_state->ctx, default_sink_name, default_sink_info_cb, L);
+	r = backend->get_sink(default_sink_name, default_sink_info_cb, L);
 
-	while (pa_operation_get_state(op) == PA_OPERATION_RUNNING)
-		pa_threaded_mainloop_wait(pa_state->mainloop);
-	pa_operation_unref(op);
 	pa_threaded_mainloop_unlock(pa_state->mainloop);
 
+	if (r < 0) {
+		lua_settop(L, top);
+		return lua_pa_push_timeout(L);
+	}
+
 	return 1;
 }
 
@@ -425,27 +1354,44 @@ static int lua_pa_get_default_source(lua_State* L) {
 		lua_error(L);
 	}
 
+	lua_pa_check_timeout(L, 1);
+
+	if (warm_push_device(L, 1, NULL))
+		return 1;
+
+	lua_pa_pending_t* p = pending_begin(L, PENDING_SOURCE);
+	if (p) {
+		pa_threaded_mainloop_lock(pa_state->mainloop);
+		return pending_await(L, pa_context_get_server_info(pa_state->ctx, pending_server_info_cb, p), p);
+	}
+
+	int top = lua_gettop(L);
+
 	pa_threaded_mainloop_lock(pa_state->mainloop);
 
-	pa_operation* op = pa_context_get_server_info(pa_state->ctx, source_server_info_cb, L);
+	int r = backend->get_server(source_server_info_cb, L);
 
-	while (pa_operation_get_state(op) == PA_OPERATION_RUNNING)
-		pa_threaded_mainloop_wait(pa_state->mainloop);
-	pa_operation_unref(op);
 	pa_threaded_mainloop_unlock(pa_state->mainloop);
 
+	if (r < 0) {
+		lua_settop(L, top);
+		return lua_pa_push_timeout(L);
+	}
+
 	const char* default_sink_name = lua_tostring(L, -1);
 	lua_pop(L, 1);
 
 	pa_threaded_mainloop_lock(pa_state->mainloop);
 
-	op = pa_context_get_source_info_by_name(pa_state->ctx, default_sink_name, default_source_info_cb, L);
+	r = backend->get_source(default_sink_name, default_source_info_cb, L);
 
-	while (pa_operation_get_state(op) == PA_OPERATION_RUNNING)
-		pa_threaded_mainloop_wait(pa_state->mainloop);
-	pa_operation_unref(op);
 	pa_threaded_mainloop_unlock(pa_state->mainloop);
 
+	if (r < 0) {
+		lua_settop(L, top);
+		return lua_pa_push_timeout(L);
+	}
+
 	return 1;
 }
 
@@ -460,15 +1406,33 @@ static int lua_pa_get_sink_by_name(lua_State* L) {
 	if (name == NULL)
 		return 0;
 
+	lua_pa_check_timeout(L, 2);
+
+	if (warm_push_device(L, 0, name))
+		return 1;
+
+	lua_pa_pending_t* p = pending_begin(L, PENDING_SINK);
+	if (p) {
+		pa_threaded_mainloop_lock(pa_state->mainloop);
+		return pending_await(L, pa_context_get_sink_info_by_name(pa_state->ctx, name, pending_sink_info_cb, p), p);
+	}
+
+	int top = lua_gettop(L);
+
 	pa_threaded_mainloop_lock(pa_state->mainloop);
 
-	pa_operation* op = pa_context_get_sink_info_by_name(pa_state->ctx, name, sink_info_cb, L);
+	int r = backend->get_sink(name, default_sink_info_cb, L);
 
-	while (pa_operation_get_state(op) == PA_OPERATION_RUNNING)
-		pa_threaded_mainloop_wait(pa_state->mainloop);
-	pa_operation_unref(op);
 	pa_threaded_mainloop_unlock(pa_state->mainloop);
 
+	if (r < 0) {
+		lua_settop(L, top);
+		return lua_pa_push_timeout(L);
+	}
+
+	if (lua_gettop(L) == top)
+		lua_pushnil(L);
+
 	return 1;
 }
 
@@ -483,466 +1447,4999 @@ static int lua_pa_get_source_by_name(lua_State* L) {
 	if (name == NULL)
 		return 0;
 
+	lua_pa_check_timeout(L, 2);
+
+	if (warm_push_device(L, 1, name))
+		return 1;
+
+	lua_pa_pending_t* p = pending_begin(L, PENDING_SOURCE);
+	if (p) {
+		pa_threaded_mainloop_lock(pa_state->mainloop);
+		return pending_await(L, pa_context_get_source_info_by_name(pa_state->ctx, name, pending_source_info_cb, p), p);
+	}
+
+	int top = lua_gettop(L);
+
 	pa_threaded_mainloop_lock(pa_state->mainloop);
 
-	pa_operation* op = pa_context_get_source_info_by_name(pa_state->ctx, name, source_info_cb, L);
+	int r = backend->get_source(name, default_source_info_cb, L);
 
-	while (pa_operation_get_state(op) == PA_OPERATION_RUNNING)
-		pa_threaded_mainloop_wait(pa_state->mainloop);
-	pa_operation_unref(op);
 	pa_threaded_mainloop_unlock(pa_state->mainloop);
 
-	return 1;
-}
+	if (r < 0) {
+		lua_settop(L, top);
+		return lua_pa_push_timeout(L);
+	}
 
-static void context_state_cb(pa_context* c, void* userdata __attribute__((unused))) {
-	if (!pa_state || !pa_state->mainloop) return;
+	if (lua_gettop(L) == top)
+		lua_pushnil(L);
 
-	pa_context_state_t state = pa_context_get_state(c);
+	return 1;
+}
 
-	switch (state) {
-	case PA_CONTEXT_READY:
-		pa_threaded_mainloop_signal(pa_state->mainloop, 0);
-		break;
-	case PA_CONTEXT_FAILED:
-	case PA_CONTEXT_TERMINATED:
-		pa_threaded_mainloop_signal(pa_state->mainloop, 0);
-		pa_init( );
-		break;
-	default:
-		break;
+// Returns a free record at the end of the buffer, NULL when it cannot grow. The mainloop must be locked.
+// libpulse runs the callback for every device of a list reply in one dispatch and the mainloop
+// thread cannot wait for the reader, so the buffer is unbounded and can hold the whole list
+static device_record_t* device_iter_reserve(device_iter_t* it) {
+	if (it->count == it->capacity) {
+		size_t capacity = it->capacity ? it->capacity * 2 : 16;
+		device_record_t* grown = realloc(it->records, capacity * sizeof(device_record_t));
+		if (!grown) return NULL;
+		it->records = grown;
+		it->capacity = capacity;
 	}
+	return &it->records[it->count++];
 }
 
-static void lua_pa_successful_callback(pa_context* c __attribute__((unused)), int success __attribute__((unused)), void* userdata __attribute__((unused))) {
-	pa_threaded_mainloop_signal(pa_state->mainloop, 0);
+static void device_record_fill(device_record_t* r, uint32_t index, const char* name, const char* description, const pa_cvolume* volume, int mute, int state) {
+	r->index = index;
+	r->volume = *volume;
+	r->mute = mute;
+	r->state = state;
+	snprintf(r->name, sizeof(r->name), "%s", name);
+	snprintf(r->description, sizeof(r->description), "%s", description ? description : "");
 }
 
-static void sink_info_cb(pa_context* c __attribute__((unused)), const pa_sink_info* info, int eol, void* userdata) {
-	if (eol < 0 || !info || !pa_state || !pa_state->mainloop) return;
+static void iter_sink_cb(pa_context* c __attribute__((unused)), const pa_sink_info* info, int eol, void* userdata) {
+	device_iter_t* it = (device_iter_t*)userdata;
+
+	if (eol || !info) {
+		it->done = 1;
+	} else if (info->name && sink_matches(&it->query, info)) {
+		device_record_t* r = device_iter_reserve(it);
+		if (r) {
+			device_record_fill(r, info->index, info->name, info->description, &info->volume, info->mute, info->state);
+			r->latency = info->latency;
+			r->configured_latency = info->configured_latency;
+			r->sample_spec = info->sample_spec;
+			r->channel_map = info->channel_map;
+		}
+	}
 
-	lua_State* L = (lua_State*)userdata;
+	pa_threaded_mainloop_signal(pa_state->mainloop, 0);
+}
 
-	if (!eol)
-		if (lua_sink_factory(L, info) == 0)
-			lua_rawseti(L, -2, luaL_len(L, -2) + 1);
+static void iter_source_cb(pa_context* c __attribute__((unused)), const pa_source_info* info, int eol, void* userdata) {
+	device_iter_t* it = (device_iter_t*)userdata;
+
+	if (eol || !info) {
+		it->done = 1;
+	} else if (info->name && source_matches(&it->query, info)) {
+		device_record_t* r = device_iter_reserve(it);
+		if (r) {
+			device_record_fill(r, info->index, info->name, info->description, &info->volume, info->mute, info->state);
+			r->latency = info->latency;
+			r->configured_latency = info->configured_latency;
+			r->sample_spec = info->sample_spec;
+			r->channel_map = info->channel_map;
+		}
+	}
 
 	pa_threaded_mainloop_signal(pa_state->mainloop, 0);
 }
 
-static void* trigger_signal_7_sink(void* userdata) {
-	arg_list* al = (arg_list*)userdata;
-	pa_sink_info* info = (pa_sink_info*)al->info;
-	lua_pa_trigger_signal(
-		al->signal_name,
-		al->types,
-		info->description,
-		info->name,
-		info->index,
-		(int)round(100 * pow(10, pa_sw_volume_to_dB(pa_cvolume_avg(&info->volume)) / 60)),
-		info->mute
-	);
+static void device_record_push(lua_State* L, const device_record_t* r, int source, unsigned int fields) {
+	if (source) {
+		pa_source_info info;
+		memset(&info, 0, sizeof(info));
+		info.index = r->index;
+		info.name = r->name;
+		info.description = r->description;
+		info.volume = r->volume;
+		info.mute = r->mute;
+		info.state = (pa_source_state_t)r->state;
+		info.latency = r->latency;
+		info.configured_latency = r->configured_latency;
+		info.sample_spec = r->sample_spec;
+		info.channel_map = r->channel_map;
+		info.monitor_of_sink = PA_INVALID_INDEX;
+		lua_source_factory_fields(L, &info, fields);
+	} else {
+		pa_sink_info info;
+		memset(&info, 0, sizeof(info));
+		info.index = r->index;
+		info.name = r->name;
+		info.description = r->description;
+		info.volume = r->volume;
+		info.mute = r->mute;
+		info.state = (pa_sink_state_t)r->state;
+		info.latency = r->latency;
+		info.configured_latency = r->configured_latency;
+		info.sample_spec = r->sample_spec;
+		info.channel_map = r->channel_map;
+		info.monitor_source = PA_INVALID_INDEX;
+		lua_sink_factory_fields(L, &info, fields);
+	}
+}
 
-	free(info);
-	free(al);
+// Stops the list query so no callback runs against it any more, the mainloop must be locked
+static void device_iter_cancel(device_iter_t* it) {
+	if (it->op) {
+		if (pa_operation_get_state(it->op) == PA_OPERATION_RUNNING)
+			pa_operation_cancel(it->op);
+		pa_operation_unref(it->op);
+		it->op = NULL;
+	}
+	it->done = 1;
+}
 
-	pthread_mutex_unlock(&pa_state->mutex);
+// Waits for the next record only when the buffer ran dry, so devices are handed out as they arrive
+static int lua_pa_device_iter_next(lua_State* L) {
+	device_iter_t* it = (device_iter_t*)luaL_checkudata(L, 1, "lua_pa_device_iter");
 
-	return NULL;
-}
+	if (!pa_state) {
+		lua_pushstring(L, "PulseAudio not initialized.");
+		lua_error(L);
+	}
 
-static void* trigger_signal_7_source(void* userdata) {
-	arg_list* al = (arg_list*)userdata;
-	pa_source_info* info = (pa_source_info*)al->info;
-	lua_pa_trigger_signal(
-		al->signal_name,
-		al->types,
-		info->description,
-		info->name,
-		info->index,
-		(int)round(100 * pow(10, pa_sw_volume_to_dB(pa_cvolume_avg(&info->volume)) / 60)),
-		info->mute
-	);
+	device_record_t r;
+	int expired = 0;
+	pa_time_event* deadline = NULL;
 
-	free(info);
-	free(al);
+	pa_threaded_mainloop_lock(pa_state->mainloop);
 
-	pthread_mutex_unlock(&pa_state->mutex);
+	if (it->next == it->count && !it->done) {
+		call_timeout = it->timeout;
+		deadline = deadline_start(&expired);
+		while (it->next == it->count && !it->done && !expired)
+			pa_threaded_mainloop_wait(pa_state->mainloop);
+	}
+	int timed_out = deadline_stop(deadline, expired) < 0;
+
+	int found = it->next < it->count;
+	if (found) {
+		r = it->records[it->next++];
+		if (it->next == it->count)
+			it->next = it->count = 0;
+	} else if (timed_out) {
+		device_iter_cancel(it);
+	}
 
-	return NULL;
-}
+	pa_threaded_mainloop_unlock(pa_state->mainloop);
 
-static void* trigger_signal_3(void* userdata) {
-	arg_list* al = (arg_list*)userdata;
+	if (!found) {
+		if (timed_out)
+			return luaL_error(L, "timeout");
+		lua_pushnil(L);
+		return 1;
+	}
 
-	lua_pa_trigger_signal(
-		al->signal_name,
-		al->types,
-		al->info
-	);
+	device_record_push(L, &r, it->source, it->query.fields);
+	return 1;
+}
 
-	free(al);
+static int lua_pa_device_iter_close(lua_State* L) {
+	device_iter_t* it = (device_iter_t*)luaL_checkudata(L, 1, "lua_pa_device_iter");
 
-	pthread_mutex_unlock(&pa_state->mutex);
+	if (pa_state && pa_state->mainloop) {
+		pa_threaded_mainloop_lock(pa_state->mainloop);
+		device_iter_cancel(it);
+		pa_threaded_mainloop_unlock(pa_state->mainloop);
+	}
 
-	return NULL;
+	free(it->records);
+	it->records = NULL;
+	it->count = it->capacity = it->next = 0;
+	return 0;
 }
 
-static void* trigger_signal_3_source(void* userdata) {
-	arg_list* al = (arg_list*)userdata;
-	pa_source_info* info = (pa_source_info*)al->info;
+// Returns the iterator, its state and, for Lua 5.4, the same state as closing value so an early
+// break cancels the query right away instead of at the next collection
+static int device_iter_new(lua_State* L, int source) {
+	if (!pa_state) {
+		lua_pushstring(L, "PulseAudio not initialized.");
+		lua_error(L);
+	}
 
-	lua_pa_trigger_signal(
-		al->signal_name,
-		al->types,
-		al->info
-	);
+	list_query_t query;
+	lua_pa_check_list_query(L, 1, &query);
+	lua_pa_check_timeout(L, 1);
 
-	free(info);
-	free(al);
+	lua_pushcfunction(L, lua_pa_device_iter_next);
 
-	pthread_mutex_unlock(&pa_state->mutex);
+	device_iter_t* it = (device_iter_t*)lua_newuserdata(L, sizeof(device_iter_t));
+	memset(it, 0, sizeof(*it));
+	it->source = source;
+	it->query = query;
+	it->query.L = NULL;
+	it->timeout = call_timeout;
+	luaL_setmetatable(L, "lua_pa_device_iter");
 
-	return NULL;
-}
+	pa_threaded_mainloop_lock(pa_state->mainloop);
 
-static void* trigger_signal_3_sink(void* userdata) {
-	arg_list* al = (arg_list*)userdata;
-	pa_sink_info* info = (pa_sink_info*)al->info;
+	if (backend == &pulse_backend && pulse_ready( ) < 0) {
+		pa_threaded_mainloop_unlock(pa_state->mainloop);
+		return luaL_error(L, "timeout");
+	}
 
-	lua_pa_trigger_signal(
-		al->signal_name,
-		al->types,
-		al->info
-	);
+	if (backend == &pulse_backend) {
+		it->op = source
+			? pa_context_get_source_info_list(pa_state->ctx, iter_source_cb, it)
+			: pa_context_get_sink_info_list(pa_state->ctx, iter_sink_cb, it);
+		if (it->op)
+			stats.operations++;
+		else
+			it->done = 1;
+	} else if (source) {
+		backend->list_sources(iter_source_cb, it);
+	} else {
+		backend->list_sinks(iter_sink_cb, it);
+	}
 
-	free(info);
-	free(al);
+	pa_threaded_mainloop_unlock(pa_state->mainloop);
 
-	pthread_mutex_unlock(&pa_state->mutex);
+	lua_pushnil(L);
+	lua_pushvalue(L, -2);
+	return 4;
+}
 
-	return NULL;
+static int lua_pa_sinks(lua_State* L) {
+	return device_iter_new(L, 0);
 }
 
-static void signal_sink_info_cb(pa_context* c __attribute__((unused)), const pa_sink_info* info, int eol, void* userdata __attribute__((unused))) {
-	if (eol < 0 || !info || !pa_state || !pa_state->mainloop) return;
+static int lua_pa_sources(lua_State* L) {
+	return device_iter_new(L, 1);
+}
 
-	if (!eol) {
-		arg_list* al = malloc(sizeof(arg_list));
+// Reads rate, channels and format from the table at idx, defaulting to 44100Hz stereo s16le
+static void lua_pa_check_sample_spec(lua_State* L, int idx, pa_sample_spec* ss) {
+	ss->rate = 44100;
+	ss->channels = 2;
+	ss->format = PA_SAMPLE_S16LE;
 
-		al->signal_name = "pulseaudio::sink_change";
-		al->types = "ssiib";
-		al->info = deep_copy_sink_info(info);
-		pthread_mutex_lock(&pa_state->mutex);
-		pthread_create(&pa_state->thread, NULL, trigger_signal_7_sink, al);
-		pthread_detach(pa_state->thread);
-	}
+	if (!lua_istable(L, idx)) return;
 
-	pa_threaded_mainloop_signal(pa_state->mainloop, 0);
-}
+	lua_getfield(L, idx, "rate");
+	if (!lua_isnil(L, -1))
+		ss->rate = (uint32_t)luaL_checkinteger(L, -1);
+	lua_pop(L, 1);
 
-static void signal_sink_new_cb(pa_context* c __attribute__((unused)), const pa_sink_info* info, int eol, void* userdata __attribute__((unused))) {
-	if (eol < 0 || !info || !pa_state || !pa_state->mainloop) return;
+	lua_getfield(L, idx, "channels");
+	if (!lua_isnil(L, -1))
+		ss->channels = (uint8_t)luaL_checkinteger(L, -1);
+	lua_pop(L, 1);
 
-	if (!eol) {
-		active_sinks = realloc(active_sinks, (num_sinks + 1) * sizeof(active_sink_sources_t));
+	lua_getfield(L, idx, "format");
+	if (!lua_isnil(L, -1))
+		ss->format = pa_parse_sample_format(luaL_checkstring(L, -1));
+	lua_pop(L, 1);
 
-		active_sinks[num_sinks].index = info->index;
-		active_sinks[num_sinks].name = strdup(info->name);
-		num_sinks++;
+	if (!pa_sample_spec_valid(ss))
+		luaL_error(L, "Invalid sample spec (rate, channels or format)");
+}
 
-		arg_list* al = malloc(sizeof(arg_list));
+static uint32_t read_le32(const unsigned char* p) {
+	return (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
 
-		al->signal_name = "pulseaudio::sink_new";
-		al->types = "u";
-		al->info = deep_copy_sink_info(info);
+static uint16_t read_le16(const unsigned char* p) {
+	return (uint16_t)(p[0] | (p[1] << 8));
+}
 
-		pthread_mutex_lock(&pa_state->mutex);
-		pthread_create(&pa_state->thread, NULL, trigger_signal_3_sink, al);
-		pthread_detach(pa_state->thread);
+// Minimal RIFF/WAVE reader, only uncompressed PCM and IEEE float are supported
+static const char* read_wav_file(const char* path, pa_sample_spec* ss, char** data, size_t* length) {
+	FILE* f = fopen(path, "rb");
+	if (!f) return "Could not open file";
 
+	unsigned char hdr[12];
+	if (fread(hdr, 1, 12, f) != 12 || memcmp(hdr, "RIFF", 4) != 0 || memcmp(hdr + 8, "WAVE", 4) != 0) {
+		fclose(f);
+		return "Not a RIFF/WAVE file";
 	}
+
+	int have_fmt = 0;
+	unsigned char chunk[8];
+	while (fread(chunk, 1, 8, f) == 8) {
+		uint32_t size = read_le32(chunk + 4);
+
+		if (memcmp(chunk, "fmt ", 4) == 0) {
+			unsigned char fmt[16];
+			if (size < 16 || fread(fmt, 1, 16, f) != 16) break;
+			fseek(f, (long)(size - 16 + (size & 1)), SEEK_CUR);
+
+			uint16_t tag = read_le16(fmt);
+			uint16_t bits = read_le16(fmt + 14);
+			ss->channels = (uint8_t)read_le16(fmt + 2);
+			ss->rate = read_le32(fmt + 4);
+
+			if (tag == 3 && bits == 32) ss->format = PA_SAMPLE_FLOAT32LE;
+			else if (tag == 1 && bits == 8) ss->format = PA_SAMPLE_U8;
+			else if (tag == 1 && bits == 16) ss->format = PA_SAMPLE_S16LE;
+			else if (tag == 1 && bits == 24) ss->format = PA_SAMPLE_S24LE;
+			else if (tag == 1 && bits == 32) ss->format = PA_SAMPLE_S32LE;
+			else {
+				fclose(f);
+				return "Unsupported WAVE encoding";
+			}
+			have_fmt = 1;
+		} else if (memcmp(chunk, "data", 4) == 0 && have_fmt) {
+			*data = malloc(size ? size : 1);
+			if (!*data) {
+				fclose(f);
+				return "Memory allocation failed";
+			}
+			*length = fread(*data, 1, size, f);
+			fclose(f);
+			return NULL;
+		} else {
+			fseek(f, (long)(size + (size & 1)), SEEK_CUR);
+		}
+	}
+
+	fclose(f);
+	return "Missing fmt or data chunk";
+}
+
+static void stream_state_cb(pa_stream* s __attribute__((unused)), void* userdata __attribute__((unused))) {
 	pa_threaded_mainloop_signal(pa_state->mainloop, 0);
 }
 
-static void signal_source_info_cb(pa_context* c __attribute__((unused)), const pa_source_info* info, int eol, void* userdata __attribute__((unused))) {
+// Must be called with the mainloop locked
+static void release_stream(pa_stream* s) {
+	pa_stream_set_state_callback(s, NULL, NULL);
+	pa_stream_set_write_callback(s, NULL, NULL);
+	pa_stream_set_read_callback(s, NULL, NULL);
+	pa_stream_set_underflow_callback(s, NULL, NULL);
+	pa_stream_set_overflow_callback(s, NULL, NULL);
+
+	pa_stream_state_t state = pa_stream_get_state(s);
+	if (state == PA_STREAM_READY || state == PA_STREAM_CREATING)
+		pa_stream_disconnect(s);
+	pa_stream_unref(s);
+}
+
+static int lua_pa_upload_sample(lua_State* L) {
+	if (!pa_state) {
+		lua_pushstring(L, "PulseAudio not initialized.");
+		lua_error(L);
+	}
+
+	if (backend != &pulse_backend)
+		return luaL_error(L, "upload_sample needs the pulse backend");
+
+	const char* name = luaL_checkstring(L, 1);
+
+	pa_sample_spec ss;
+	const char* data = NULL;
+	char* file_data = NULL;
+	size_t length = 0;
+
+	if (lua_istable(L, 2)) {
+		lua_pa_check_sample_spec(L, 2, &ss);
+		lua_getfield(L, 2, "data");
+		data = luaL_checklstring(L, -1, &length);
+	} else {
+		const char* err = read_wav_file(luaL_checkstring(L, 2), &ss, &file_data, &length);
+		if (err || !pa_sample_spec_valid(&ss)) {
+			free(file_data);
+			lua_pushnil(L);
+			lua_pushstring(L, err ? err : "Invalid sample spec in file");
+			return 2;
+		}
+		data = file_data;
+	}
+
+	lua_pa_check_timeout(L, 2);
+
+	length -= length % pa_frame_size(&ss);
+	if (length == 0) {
+		free(file_data);
+		lua_pushnil(L);
+		lua_pushstring(L, "Sample contains no audio frames");
+		return 2;
+	}
+
+	pa_threaded_mainloop_lock(pa_state->mainloop);
+
+	if (pulse_ready( ) < 0) {
+		pa_threaded_mainloop_unlock(pa_state->mainloop);
+		free(file_data);
+		return lua_pa_push_timeout(L);
+	}
+
+	pa_stream* s = pa_stream_new(pa_state->ctx, name, &ss, NULL);
+	if (!s) {
+		pa_threaded_mainloop_unlock(pa_state->mainloop);
+		free(file_data);
+		lua_pushnil(L);
+		lua_pushstring(L, pa_strerror(pa_context_errno(pa_state->ctx)));
+		return 2;
+	}
+
+	int expired;
+	pa_time_event* deadline = deadline_start(&expired);
+
+	pa_stream_set_state_callback(s, stream_state_cb, NULL);
+	if (pa_stream_connect_upload(s, length) == 0)
+		while (!expired && pa_stream_get_state(s) == PA_STREAM_CREATING)
+			pa_threaded_mainloop_wait(pa_state->mainloop);
+
+	if (!expired && pa_stream_get_state(s) == PA_STREAM_READY) {
+		size_t offset = 0;
+		while (offset < length) {
+			void* dst = NULL;
+			size_t n = length - offset;
+
+			if (pa_stream_begin_write(s, &dst, &n) < 0 || n == 0) break;
+			if (n > length - offset) n = length - offset;
+
+			memcpy(dst, data + offset, n);
+			pa_stream_write(s, dst, n, NULL, 0, PA_SEEK_RELATIVE);
+			offset += n;
+		}
+
+		pa_stream_finish_upload(s);
+		while (!expired && pa_stream_get_state(s) == PA_STREAM_READY)
+			pa_threaded_mainloop_wait(pa_state->mainloop);
+	}
+
+	int timed_out = deadline_stop(deadline, expired) < 0;
+	int ok = !timed_out && pa_stream_get_state(s) == PA_STREAM_TERMINATED;
+	const char* err = ok ? NULL : timed_out ? "timeout" : pa_strerror(pa_context_errno(pa_state->ctx));
+
+	release_stream(s);
+	pa_threaded_mainloop_unlock(pa_state->mainloop);
+
+	free(file_data);
+
+	if (!ok) {
+		lua_pushnil(L);
+		lua_pushstring(L, err);
+		return 2;
+	}
+
+	lua_pushboolean(L, 1);
+	return 1;
+}
+
+static int lua_pa_play_sample(lua_State* L) {
+	if (!pa_state) {
+		lua_pushstring(L, "PulseAudio not initialized.");
+		lua_error(L);
+	}
+
+	if (backend != &pulse_backend)
+		return luaL_error(L, "play_sample needs the pulse backend");
+
+	const char* name = luaL_checkstring(L, 1);
+	const char* device = NULL;
+	pa_volume_t pa_volume = PA_VOLUME_INVALID;
+
+	if (lua_istable(L, 2)) {
+		lua_getfield(L, 2, "name");
+		device = luaL_checkstring(L, -1);
+		lua_pop(L, 1);
+	} else if (!lua_isnoneornil(L, 2)) {
+		device = luaL_checkstring(L, 2);
+	}
+
+	if (!lua_isnoneornil(L, 3)) {
+		int volume = luaL_checkinteger(L, 3);
+		if (volume < 0) volume = 0;
+		if (volume > 100) volume = 100;
+		pa_volume = pa_sw_volume_from_dB(60 * log10(volume / 100.0));
+	}
+
+	lua_pa_check_timeout(L, 0);
+
+	pa_threaded_mainloop_lock(pa_state->mainloop);
+
+	// Only a connection still being set up is waited for, with a warm cache that is the first call
+	if (pulse_ready( ) < 0) {
+		pa_threaded_mainloop_unlock(pa_state->mainloop);
+		return lua_pa_push_timeout(L);
+	}
+
+	// Fire and forget, the click should never wait on the server
+	pa_operation* op = pa_context_play_sample(pa_state->ctx, name, device, pa_volume, NULL, NULL);
+	if (op)
+		pa_operation_unref(op);
+
+	pa_threaded_mainloop_unlock(pa_state->mainloop);
+
+	lua_pushboolean(L, op != NULL);
+	return 1;
+}
+
+static void context_state_cb(pa_context* c, void* userdata __attribute__((unused))) {
+	if (!pa_state || !pa_state->mainloop) return;
+
+	pa_context_state_t state = pa_context_get_state(c);
+
+	switch (state) {
+	case PA_CONTEXT_READY:
+		if (warm.map)
+			warm_sync( );
+		pa_threaded_mainloop_signal(pa_state->mainloop, 0);
+		break;
+	case PA_CONTEXT_FAILED:
+	case PA_CONTEXT_TERMINATED:
+		pa_threaded_mainloop_signal(pa_state->mainloop, 0);
+		if (pa_init( ) == 0)
+			pulse_subscribe( );
+		break;
+	default:
+		break;
+	}
+}
+
+static void lua_pa_successful_callback(pa_context* c __attribute__((unused)), int success __attribute__((unused)), void* userdata __attribute__((unused))) {
+	pa_threaded_mainloop_signal(pa_state->mainloop, 0);
+}
+
+static void sink_info_cb(pa_context* c __attribute__((unused)), const pa_sink_info* info, int eol, void* userdata) {
 	if (eol < 0 || !info || !pa_state || !pa_state->mainloop) return;
 
-	if (!eol) {
-		arg_list* al = malloc(sizeof(arg_list));
+	list_query_t* q = (list_query_t*)userdata;
+
+	if (!eol && sink_matches(q, info))
+		if (lua_sink_factory_fields(q->L, info, q->fields) == 0)
+			lua_rawseti(q->L, -2, ++q->count);
+
+	pa_threaded_mainloop_signal(pa_state->mainloop, 0);
+}
+
+static void* trigger_signal_7_sink(void* userdata) {
+	arg_list* al = (arg_list*)userdata;
+	pa_sink_info* info = (pa_sink_info*)al->info;
+	lua_pa_trigger_signal_device(
+		al->registry,
+		al->signal_name,
+		(unsigned int)al->value,
+		info->name,
+		info->index,
+		al->types,
+		info->description,
+		info->name,
+		info->index,
+		(int)round(100 * pow(10, pa_sw_volume_to_dB(pa_cvolume_avg(&info->volume)) / 60)),
+		info->mute,
+		al->value
+	);
+
+	free_sink_info_copy(info);
+	free(al);
+
+	pthread_mutex_unlock(&pa_state->mutex);
+
+	return NULL;
+}
+
+static void* trigger_signal_7_source(void* userdata) {
+	arg_list* al = (arg_list*)userdata;
+	pa_source_info* info = (pa_source_info*)al->info;
+	lua_pa_trigger_signal_device(
+		al->registry,
+		al->signal_name,
+		(unsigned int)al->value,
+		info->name,
+		info->index,
+		al->types,
+		info->description,
+		info->name,
+		info->index,
+		(int)round(100 * pow(10, pa_sw_volume_to_dB(pa_cvolume_avg(&info->volume)) / 60)),
+		info->mute,
+		al->value
+	);
+
+	free_source_info_copy(info);
+	free(al);
+
+	pthread_mutex_unlock(&pa_state->mutex);
+
+	return NULL;
+}
+
+static void* trigger_signal_3(void* userdata) {
+	arg_list* al = (arg_list*)userdata;
+
+	lua_pa_trigger_signal_device(
+		al->registry,
+		al->signal_name,
+		LUA_PA_FIELD_ALL,
+		(const char*)al->info,
+		al->index,
+		al->types,
+		al->info
+	);
+
+	free((char*)al->info);
+	free(al);
+
+	pthread_mutex_unlock(&pa_state->mutex);
+
+	return NULL;
+}
+
+static void* trigger_signal_3_source(void* userdata) {
+	arg_list* al = (arg_list*)userdata;
+	pa_source_info* info = (pa_source_info*)al->info;
+
+	lua_pa_trigger_signal_device(
+		al->registry,
+		al->signal_name,
+		LUA_PA_FIELD_ALL,
+		info ? info->name : NULL,
+		info ? info->index : PA_INVALID_INDEX,
+		al->types,
+		al->info
+	);
+
+	free_source_info_copy(info);
+	free(al);
+
+	pthread_mutex_unlock(&pa_state->mutex);
+
+	return NULL;
+}
+
+static void* trigger_signal_3_sink(void* userdata) {
+	arg_list* al = (arg_list*)userdata;
+	pa_sink_info* info = (pa_sink_info*)al->info;
+
+	lua_pa_trigger_signal_device(
+		al->registry,
+		al->signal_name,
+		LUA_PA_FIELD_ALL,
+		info ? info->name : NULL,
+		info ? info->index : PA_INVALID_INDEX,
+		al->types,
+		al->info
+	);
+
+	free_sink_info_copy(info);
+	free(al);
+
+	pthread_mutex_unlock(&pa_state->mutex);
+
+	return NULL;
+}
+
+static void* trigger_signal_stream(void* userdata) {
+	arg_list* al = (arg_list*)userdata;
+
+	lua_pa_trigger_signal_device(
+		&live_registry,
+		al->signal_name,
+		LUA_PA_FIELD_ALL,
+		NULL,
+		al->index,
+		al->types,
+		al->index,
+		al->value
+	);
+
+	free(al);
+
+	pthread_mutex_unlock(&pa_state->mutex);
+
+	return NULL;
+}
+
+// Stream callbacks fire often, only pay for a dispatch thread when someone listens
+static void emit_stream_signal(const char* signal_name, const char* types, uint32_t index, int value) {
+	if (!has_signal_handler(signal_name)) return;
+
+	arg_list* al = malloc(sizeof(arg_list));
+	if (!al) return;
+
+	al->signal_name = signal_name;
+	al->types = types;
+	al->index = index;
+	al->value = value;
+
+	pthread_mutex_lock(&pa_state->mutex);
+	pthread_create(&pa_state->thread, NULL, trigger_signal_stream, al);
+	pthread_detach(pa_state->thread);
+}
+
+// Segment published by export_shm(), rewritten from the mainloop thread whenever the registry changes
+static lua_pa_shm_t* shm = NULL;
+static char* shm_path = NULL;
+
+static void shm_copy_devices(lua_pa_shm_device_t* out, uint32_t* count, uint32_t* default_slot, const active_sink_sources_t* devices, size_t num, const char* default_name) {
+	*count = 0;
+	*default_slot = LUA_PA_SHM_NONE;
+
+	for (size_t i = 0; i < num && i < LUA_PA_SHM_MAX_DEVICES; i++) {
+		lua_pa_shm_device_t* d = &out[i];
+		d->index = devices[i].index;
+		d->volume = (uint32_t)devices[i].volume;
+		d->mute = (uint32_t)devices[i].mute;
+		d->reserved = 0;
+		snprintf(d->name, sizeof(d->name), "%s", devices[i].name ? devices[i].name : "");
+		snprintf(d->description, sizeof(d->description), "%s", devices[i].description ? devices[i].description : "");
+
+		if (default_name && devices[i].name && strcmp(devices[i].name, default_name) == 0)
+			*default_slot = (uint32_t)i;
+		(*count)++;
+	}
+}
+
+// Starts from an odd seq whatever an earlier, maybe crashed, writer left behind
+static void shm_publish( ) {
+	if (!shm) return;
+
+	uint32_t seq = __atomic_load_n(&shm->seq, __ATOMIC_RELAXED) | 1;
+	__atomic_store_n(&shm->seq, seq, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+
+	pthread_mutex_lock(&defaults_mutex);
+	shm_copy_devices(shm->sinks, &shm->num_sinks, &shm->default_sink, active_sinks, num_sinks, default_sink_name);
+	shm_copy_devices(shm->sources, &shm->num_sources, &shm->default_source, active_sources, num_sources, default_source_name);
+	pthread_mutex_unlock(&defaults_mutex);
+
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	shm->updated_usec = (uint64_t)tv.tv_sec * 1000000 + (uint64_t)tv.tv_usec;
+
+	__atomic_store_n(&shm->seq, seq + 1, __ATOMIC_RELEASE);
+}
+
+// Everything that mirrors the registry follows it from here
+static void registry_changed( ) {
+	shm_publish( );
+	cache_schedule( );
+}
+
+// Unmaps and removes the segment, readers keep their mapping of the last state
+static void shm_unexport( ) {
+	if (!shm) return;
+
+	munmap(shm, sizeof(lua_pa_shm_t));
+	shm_unlink(shm_path);
+	free(shm_path);
+	shm = NULL;
+	shm_path = NULL;
+}
+
+// export_shm(name) publishes the registry as /dev/shm/<name>, export_shm(false) stops it
+static int lua_pa_export_shm(lua_State* L) {
+	if (!pa_state) {
+		lua_pushstring(L, "PulseAudio not initialized.");
+		lua_error(L);
+	}
+
+	if (!lua_toboolean(L, 1)) {
+		pa_threaded_mainloop_lock(pa_state->mainloop);
+		shm_unexport( );
+		pa_threaded_mainloop_unlock(pa_state->mainloop);
+
+		lua_pushboolean(L, 1);
+		return 1;
+	}
+
+	const char* name = luaL_checkstring(L, 1);
+	luaL_argcheck(L, name[0] != '\0' && !strchr(name, '/') && strlen(name) < 250, 1, "name must be a file name without slashes");
+
+	char path[256];
+	snprintf(path, sizeof(path), "/%s", name);
+
+	int fd = shm_open(path, O_CREAT | O_RDWR | O_CLOEXEC, 0644);
+	if (fd < 0) {
+		lua_pushnil(L);
+		lua_pushstring(L, strerror(errno));
+		return 2;
+	}
+
+	void* map = MAP_FAILED;
+	if (ftruncate(fd, sizeof(lua_pa_shm_t)) == 0)
+		map = mmap(NULL, sizeof(lua_pa_shm_t), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	int err = errno;
+	close(fd);
+
+	if (map == MAP_FAILED) {
+		shm_unlink(path);
+		lua_pushnil(L);
+		lua_pushstring(L, strerror(err));
+		return 2;
+	}
+
+	lua_pa_shm_t* segment = (lua_pa_shm_t*)map;
+	segment->version = LUA_PA_SHM_VERSION;
+
+	pa_threaded_mainloop_lock(pa_state->mainloop);
+
+	if (shm_path && strcmp(shm_path, path) == 0) {
+		// Same segment again, drop the old mapping without unlinking the file just opened
+		munmap(shm, sizeof(lua_pa_shm_t));
+		free(shm_path);
+		shm = NULL;
+		shm_path = NULL;
+	}
+	shm_unexport( );
+
+	shm = segment;
+	shm_path = strdup(path);
+	shm_publish( );
+	__atomic_store_n(&shm->magic, LUA_PA_SHM_MAGIC, __ATOMIC_RELEASE);
+
+	pa_threaded_mainloop_unlock(pa_state->mainloop);
+
+	lua_pushboolean(L, 1);
+	return 1;
+}
+
+// Journal of raw events and info snapshots, written from the mainloop thread. journal_errno keeps
+// the first failed write for journal_stop() to report
+static FILE* journal = NULL;
+static int journal_errno = 0;
+
+// Devices and defaults as a replayed journal saw them, kept apart from the live registry so a
+// replay never touches what the server reported. Only the thread running replay() changes the
+// devices, the defaults are read by dispatch threads under defaults_mutex like the live ones
+static struct {
+	active_sink_sources_t* sinks;
+	size_t num_sinks;
+	active_sink_sources_t* sources;
+	size_t num_sources;
+	char* default_sink;
+	char* default_source;
+} replay;
+
+static const signal_registry_t replay_registry = {
+	&replay.sinks, &replay.num_sinks, &replay.sources, &replay.num_sources, &replay.default_sink, &replay.default_source, 0
+};
+
+static uint64_t journal_now( ) {
+	struct timespec ts;
+	clock_gettime(CLOCK_REALTIME, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + (uint64_t)ts.tv_nsec / 1000;
+}
+
+static void journal_write(uint32_t tag, const void* payload, size_t size, const char* first, size_t first_len, const char* second, size_t second_len) {
+	if (!journal) return;
+
+	static const char padding[8] = { 0 };
+	size_t total = size + (first ? first_len + 1 : 0) + (second ? second_len + 1 : 0);
+	journal_record_t record = { htole32(tag), htole32((uint32_t)total), htole64(journal_now( )) };
+
+	int ok = fwrite(&record, sizeof(record), 1, journal) == 1
+		&& fwrite(payload, size, 1, journal) == 1
+		&& (!first || fwrite(first, first_len + 1, 1, journal) == 1)
+		&& (!second || fwrite(second, second_len + 1, 1, journal) == 1)
+		&& (total % 8 == 0 || fwrite(padding, 8 - total % 8, 1, journal) == 1);
+	if (!ok && !journal_errno)
+		journal_errno = errno ? errno : EIO;
+}
+
+static void journal_write_event(pa_subscription_event_type_t type, uint32_t index) {
+	journal_event_t event = { htole32((uint32_t)type), htole32(index) };
+	journal_write(JOURNAL_EVENT, &event, sizeof(event), NULL, 0, NULL, 0);
+}
+
+static void journal_write_device(uint32_t tag, uint32_t index, const char* name, const char* description, const pa_cvolume* volume, int mute, int state, pa_usec_t latency, pa_usec_t configured_latency, const pa_sample_spec* ss) {
+	if (!journal) return;
+
+	name = name ? name : "";
+	description = description ? description : "";
+	size_t name_len = strnlen(name, UINT16_MAX - 1);
+	size_t description_len = strnlen(description, UINT16_MAX - 1);
+
+	journal_device_t device = {
+		.index = htole32(index),
+		.volume = htole32(pa_cvolume_avg(volume)),
+		.mute = htole32((uint32_t)mute),
+		.state = htole32((uint32_t)state),
+		.latency = htole64(latency),
+		.configured_latency = htole64(configured_latency),
+		.rate = htole32(ss->rate),
+		.format = (uint8_t)ss->format,
+		.channels = ss->channels,
+		.name_len = htole16((uint16_t)name_len),
+		.description_len = htole16((uint16_t)description_len),
+		.reserved = 0,
+		.reserved2 = 0,
+	};
+	journal_write(tag, &device, sizeof(device), name, name_len, description, description_len);
+}
+
+static void journal_write_server(const pa_server_info* info) {
+	if (!journal) return;
+
+	const char* sink = info->default_sink_name ? info->default_sink_name : "";
+	const char* source = info->default_source_name ? info->default_source_name : "";
+	uint16_t sink_len = (uint16_t)strnlen(sink, UINT16_MAX - 1);
+	uint16_t source_len = (uint16_t)strnlen(source, UINT16_MAX - 1);
+	journal_server_t server = { htole16(sink_len), htole16(source_len), 0 };
+	journal_write(JOURNAL_SERVER, &server, sizeof(server), sink, sink_len, source, source_len);
+}
+
+// Devices present before the journal started, so a replay can name them when they go away
+static void journal_write_registry(uint32_t tag, const active_sink_sources_t* devices, size_t count) {
+	pa_sample_spec ss;
+	memset(&ss, 0, sizeof(ss));
+
+	for (size_t i = 0; i < count; i++) {
+		pa_cvolume volume;
+		percent_to_cvolume(devices[i].volume, &volume);
+		journal_write_device(tag, devices[i].index, devices[i].name, devices[i].description, &volume, devices[i].mute, 0, 0, 0, &ss);
+	}
+}
+
+// The registry and signal side of a sink snapshot, shared by the live info callbacks and replay().
+// A new sink always signals, a known one only when a field a handler can see changed
+static int emit_sink_info(const signal_registry_t* reg, const pa_sink_info* info, int is_new) {
+	unsigned int changed = device_registry_update(reg->sinks, reg->num_sinks, info->index, info->name, info->description, &info->volume, info->mute, PA_INVALID_INDEX);
+	if (reg->live && (changed || is_new))
+		registry_changed( );
+
+	// Latency and state flips land here too, nothing a handler can see changed
+	if (!is_new && (!changed || !has_signal_handler("pulseaudio::sink_change")))
+		return 0;
+
+	arg_list* al = malloc(sizeof(arg_list));
+	if (!al) return 0;
+
+	al->registry = reg;
+	al->signal_name = is_new ? "pulseaudio::sink_new" : "pulseaudio::sink_change";
+	al->types = is_new ? "u" : "ssiibi";
+	al->value = (int)changed;
+	al->info = deep_copy_sink_info(info);
+
+	pthread_mutex_lock(&pa_state->mutex);
+	pthread_create(&pa_state->thread, NULL, is_new ? trigger_signal_3_sink : trigger_signal_7_sink, al);
+	pthread_detach(pa_state->thread);
+	return 1;
+}
+
+static int emit_source_info(const signal_registry_t* reg, const pa_source_info* info, int is_new) {
+	unsigned int changed = device_registry_update(reg->sources, reg->num_sources, info->index, info->name, info->description, &info->volume, info->mute, info->monitor_of_sink);
+	if (reg->live && (changed || is_new))
+		registry_changed( );
+
+	if (!is_new && (!changed || !has_signal_handler("pulseaudio::source_change")))
+		return 0;
+
+	arg_list* al = malloc(sizeof(arg_list));
+	if (!al) return 0;
+
+	al->registry = reg;
+	al->signal_name = is_new ? "pulseaudio::source_new" : "pulseaudio::source_change";
+	al->types = is_new ? "o" : "ssiibi";
+	al->value = (int)changed;
+	al->info = deep_copy_source_info(info);
+
+	pthread_mutex_lock(&pa_state->mutex);
+	pthread_create(&pa_state->thread, NULL, is_new ? trigger_signal_3_source : trigger_signal_7_source, al);
+	pthread_detach(pa_state->thread);
+	return 1;
+}
+
+// Drops a device and signals its removal by the name it had, when the registry knew it
+static int emit_device_remove(const signal_registry_t* reg, int source, uint32_t index) {
+	char* name = source
+		? device_registry_remove(reg->sources, reg->num_sources, index)
+		: device_registry_remove(reg->sinks, reg->num_sinks, index);
+	if (!name) return 0;
+
+	if (reg->live)
+		registry_changed( );
+
+	arg_list* al = malloc(sizeof(arg_list));
+	if (!al) {
+		free(name);
+		return 0;
+	}
+
+	al->registry = reg;
+	al->signal_name = source ? "pulseaudio::source_remove" : "pulseaudio::sink_remove";
+	al->types = "s";
+	al->info = name;
+	al->index = index;
+
+	pthread_mutex_lock(&pa_state->mutex);
+	pthread_create(&pa_state->thread, NULL, trigger_signal_3, al);
+	pthread_detach(pa_state->thread);
+	return 1;
+}
+
+// Defaults default = true handlers follow, the live ones also go to the mirrors
+static void registry_set_defaults(const signal_registry_t* reg, const char* sink, const char* source) {
+	pthread_mutex_lock(&defaults_mutex);
+	free(*reg->default_sink);
+	free(*reg->default_source);
+	*reg->default_sink = sink ? strdup(sink) : NULL;
+	*reg->default_source = source ? strdup(source) : NULL;
+	pthread_mutex_unlock(&defaults_mutex);
+
+	if (reg->live)
+		registry_changed( );
+}
+
+static void signal_sink_info_cb(pa_context* c __attribute__((unused)), const pa_sink_info* info, int eol, void* userdata __attribute__((unused))) {
+	if (eol < 0 || !info || !pa_state || !pa_state->mainloop) return;
+
+	if (!eol) {
+		journal_write_device(JOURNAL_SINK_CHANGE, info->index, info->name, info->description, &info->volume, info->mute, info->state, info->latency, info->configured_latency, &info->sample_spec);
+		emit_sink_info(&live_registry, info, 0);
+	}
+
+	pa_threaded_mainloop_signal(pa_state->mainloop, 0);
+}
+
+static void signal_sink_new_cb(pa_context* c __attribute__((unused)), const pa_sink_info* info, int eol, void* userdata __attribute__((unused))) {
+	if (eol < 0 || !info || !pa_state || !pa_state->mainloop) return;
+
+	if (!eol) {
+		journal_write_device(JOURNAL_SINK_NEW, info->index, info->name, info->description, &info->volume, info->mute, info->state, info->latency, info->configured_latency, &info->sample_spec);
+		emit_sink_info(&live_registry, info, 1);
+	}
+	pa_threaded_mainloop_signal(pa_state->mainloop, 0);
+}
+
+static void signal_source_info_cb(pa_context* c __attribute__((unused)), const pa_source_info* info, int eol, void* userdata __attribute__((unused))) {
+	if (eol < 0 || !info || !pa_state || !pa_state->mainloop) return;
+
+	if (!eol) {
+		journal_write_device(JOURNAL_SOURCE_CHANGE, info->index, info->name, info->description, &info->volume, info->mute, info->state, info->latency, info->configured_latency, &info->sample_spec);
+		emit_source_info(&live_registry, info, 0);
+	}
+
+	pa_threaded_mainloop_signal(pa_state->mainloop, 0);
+}
+
+static void signal_source_new_cb(pa_context* c __attribute__((unused)), const pa_source_info* info, int eol, void* userdata __attribute__((unused))) {
+	if (eol < 0 || !info || !pa_state || !pa_state->mainloop) return;
+
+	if (!eol) {
+		journal_write_device(JOURNAL_SOURCE_NEW, info->index, info->name, info->description, &info->volume, info->mute, info->state, info->latency, info->configured_latency, &info->sample_spec);
+		emit_source_info(&live_registry, info, 1);
+	}
+	pa_threaded_mainloop_signal(pa_state->mainloop, 0);
+}
+
+static void source_info_cb(pa_context* c __attribute__((unused)), const pa_source_info* info, int eol, void* userdata) {
+	if (eol < 0 || !info || !pa_state || !pa_state->mainloop) return;
+
+	list_query_t* q = (list_query_t*)userdata;
+
+	if (!eol && source_matches(q, info))
+		if (lua_source_factory_fields(q->L, info, q->fields) == 0)
+			lua_rawseti(q->L, -2, ++q->count);
+
+	pa_threaded_mainloop_signal(pa_state->mainloop, 0);
+}
+
+static void sink_server_info_cb(pa_context* c __attribute__((unused)), const pa_server_info* info, void* userdata) {
+	if (!pa_state || !info || !pa_state->mainloop) return;
+
+	lua_State* L = (lua_State*)userdata;
+
+	lua_pushstring(L, info->default_sink_name);
+
+	pa_threaded_mainloop_signal(pa_state->mainloop, 0);
+}
+
+static void source_server_info_cb(pa_context* c __attribute__((unused)), const pa_server_info* info, void* userdata) {
+	if (!pa_state || !info || !pa_state->mainloop) return;
+
+	lua_State* L = (lua_State*)userdata;
+
+	lua_pushstring(L, info->default_source_name);
+
+	pa_threaded_mainloop_signal(pa_state->mainloop, 0);
+}
+
+static void default_sink_info_cb(pa_context* c __attribute__((unused)), const pa_sink_info* info, int eol, void* userdata) {
+	if (eol < 0 || !info || !pa_state || !pa_state->mainloop) return;
+
+	lua_State* L = (lua_State*)userdata;
+
+	if (!eol)
+		lua_sink_factory(L, info);
+
+	pa_threaded_mainloop_signal(pa_state->mainloop, 0);
+}
+
+static void default_source_info_cb(pa_context* c __attribute__((unused)), const pa_source_info* info, int eol, void* userdata) {
+	if (eol < 0 || !info || !pa_state || !pa_state->mainloop) return;
+
+	lua_State* L = (lua_State*)userdata;
+
+	if (!eol)
+		lua_source_factory(L, info);
+
+	pa_threaded_mainloop_signal(pa_state->mainloop, 0);
+}
+
+static int lua_pa_connect_signal(lua_State* L) {
+	const char* signal_name = luaL_checkstring(L, 1);
+	if (!lua_isfunction(L, 2)) {
+		lua_pushstring(L, "Signal handler must be a function.");
+		lua_error(L);
+	}
+
+	// Optional {fields = {...}}, change handlers then only run when one of those fields changed,
+	// and one of device = name, index = n or default = true to scope the handler to a device
+	unsigned int fields = LUA_PA_FIELD_ALL;
+	char* device = NULL;
+	uint32_t index = PA_INVALID_INDEX;
+	int follow_default = 0;
+	if (lua_istable(L, 3)) {
+		lua_getfield(L, 3, "index");
+		if (!lua_isnil(L, -1))
+			index = (uint32_t)luaL_checkinteger(L, -1);
+		lua_pop(L, 1);
+
+		lua_getfield(L, 3, "default");
+		follow_default = lua_toboolean(L, -1);
+		lua_pop(L, 1);
+
+		lua_getfield(L, 3, "device");
+		if (!lua_isnil(L, -1))
+			device = strdup(luaL_checkstring(L, -1));
+		lua_pop(L, 1);
+
+		lua_getfield(L, 3, "fields");
+		if (lua_istable(L, -1)) {
+			fields = 0;
+			size_t n = lua_rawlen(L, -1);
+			for (size_t i = 1; i <= n; i++) {
+				lua_rawgeti(L, -1, i);
+				fields |= 1u << luaL_checkoption(L, -1, NULL, device_change_field_names);
+				lua_pop(L, 1);
+			}
+		}
+		lua_pop(L, 1);
+	}
+	lua_settop(L, 2);
+
+	signal_handler_t h;
+	h.signal_name = strdup(signal_name);
+	h.L = L;
+	h.fields = fields;
+	h.device = device;
+	h.index = index;
+	h.follow_default = follow_default;
+	h.source_scope = strncmp(signal_name, "pulseaudio::source", 18) == 0;
+	h.ref = luaL_ref(L, LUA_REGISTRYINDEX);
+
+	pthread_mutex_lock(&handlers_mutex);
+	signal_handler_t* grown = h.signal_name ? realloc(signal_handlers, sizeof(signal_handler_t) * (num_signal_handlers + 1)) : NULL;
+	if (grown) {
+		signal_handlers = grown;
+		signal_handlers[num_signal_handlers++] = h;
+	}
+	pthread_mutex_unlock(&handlers_mutex);
+
+	if (!grown) {
+		luaL_unref(L, LUA_REGISTRYINDEX, h.ref);
+		free((char*)h.signal_name);
+		free(device);
+		return luaL_error(L, "out of memory");
+	}
+
+	return 0;
+}
+
+static int has_signal_handler(const char* signal_name) {
+	int found = 0;
+	pthread_mutex_lock(&handlers_mutex);
+	for (size_t i = 0; i < num_signal_handlers && !found; i++)
+		found = strcmp(signal_handlers[i].signal_name, signal_name) == 0;
+	pthread_mutex_unlock(&handlers_mutex);
+	return found;
+}
+
+// Copies handler i into h, returns 0 past the end. A handler may connect another one while it
+// runs, so the lock is never held across a call into Lua
+static int signal_handler_at(size_t i, signal_handler_t* h) {
+	pthread_mutex_lock(&handlers_mutex);
+	int present = i < num_signal_handlers;
+	if (present)
+		*h = signal_handlers[i];
+	pthread_mutex_unlock(&handlers_mutex);
+	return present;
+}
+
+// Device scope of a handler, checked before anything is pushed onto the Lua stack. Default scoped
+// handlers follow the defaults of the registry the event came from
+static int handler_matches_device(const signal_handler_t* h, const signal_registry_t* registry, const char* device_name, uint32_t device_index) {
+	if (h->index != PA_INVALID_INDEX && device_index != PA_INVALID_INDEX && h->index != device_index)
+		return 0;
+
+	if (h->device && device_name && strcmp(h->device, device_name) != 0)
+		return 0;
+
+	if (h->follow_default && device_name) {
+		pthread_mutex_lock(&defaults_mutex);
+		const char* current = h->source_scope ? *registry->default_source : *registry->default_sink;
+		int match = current && strcmp(current, device_name) == 0;
+		pthread_mutex_unlock(&defaults_mutex);
+		if (!match) return 0;
+	}
+
+	return 1;
+}
+
+// Calls every handler of signal_name that subscribed to at least one of the changed fields
+// and whose device filter accepts the device the event is about
+static void lua_pa_vtrigger_signal(const signal_registry_t* registry, const char* signal_name, unsigned int changed, const char* device_name, uint32_t device_index, const char* types, va_list handler_args) {
+	signal_handler_t h;
+	for (size_t i = 0; signal_handler_at(i, &h); i++) {
+		if (strcmp(h.signal_name, signal_name) == 0 && (h.fields & changed)
+			&& handler_matches_device(&h, registry, device_name, device_index)) {
+			lua_State* L = h.L;
+			lua_rawgeti(L, LUA_REGISTRYINDEX, h.ref);
+
+			va_list args;
+			va_copy(args, handler_args);
+			int argc = 0;
+
+			for (size_t j = 0; types[j] != '\0'; j++) {
+				switch (types[j]) {
+				case 's':
+					const char* str = va_arg(args, const char*);
+					lua_pushstring(L, str);
+					break;
+				case 'i':
+					int i_val = va_arg(args, int);
+					lua_pushinteger(L, i_val);
+					break;
+				case 'b':
+					int b = va_arg(args, int);
+					lua_pushboolean(L, b);
+					break;
+				case 'u': {
+					const pa_sink_info* info = va_arg(args, const pa_sink_info*);
+					if (info)
+						lua_sink_factory(L, info);
+					else
+						lua_pushnil(L);
+					break;
+				}
+				case 'o': {
+					const pa_source_info* info = va_arg(args, const pa_source_info*);
+					if (info)
+						lua_source_factory(L, info);
+					else
+						lua_pushnil(L);
+					break;
+				}
+				default:
+					break;
+				}
+				argc++;
+			}
+			va_end(args);
+
+			if (lua_pcall(L, argc, 0, 0) != 0) {
+				lua_pushstring(L, "Error in signal handler \n");
+				lua_error(L);
+			}
+		}
+	}
+}
+
+static void lua_pa_trigger_signal(const char* signal_name, const char* types, ...) {
+	va_list args;
+	va_start(args, types);
+	lua_pa_vtrigger_signal(&live_registry, signal_name, LUA_PA_FIELD_ALL, NULL, PA_INVALID_INDEX, types, args);
+	va_end(args);
+}
+
+static void lua_pa_trigger_signal_device(const signal_registry_t* registry, const char* signal_name, unsigned int changed, const char* device_name, uint32_t device_index, const char* types, ...) {
+	va_list args;
+	va_start(args, types);
+	lua_pa_vtrigger_signal(registry, signal_name, changed, device_name, device_index, types, args);
+	va_end(args);
+}
+
+// Auto-ducking, pulse backend only. Rules and the sink inputs they look at are touched from the
+// mainloop thread or with its lock held, nothing here goes through the Lua thread
+static struct {
+	duck_rule_t* rules;
+	size_t num_rules;
+	lua_Integer next_id;
+	duck_stream_t* streams;
+	size_t num_streams;
+	int tracking;
+	pa_time_event* timer;
+} duck;
+
+static int duck_matches(const duck_match_t* m, const duck_stream_t* s) {
+	if (m->role && (!s->role || strcmp(m->role, s->role) != 0)) return 0;
+	if (m->application && (!s->application || strcmp(m->application, s->application) != 0)) return 0;
+	return 1;
+}
+
+static duck_stream_t* duck_find(uint32_t index) {
+	for (size_t i = 0; i < duck.num_streams; i++)
+		if (duck.streams[i].index == index)
+			return &duck.streams[i];
+	return NULL;
+}
+
+static pa_usec_t duck_now( ) {
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return (pa_usec_t)tv.tv_sec * PA_USEC_PER_SEC + (pa_usec_t)tv.tv_usec;
+}
+
+// level percent of base, on the same scale the volume getters report
+static void duck_target(const duck_stream_t* s, pa_cvolume* out) {
+	*out = s->base;
+	if (s->level >= 100) return;
+
+	for (uint8_t c = 0; c < out->channels; c++)
+		out->values[c] = (pa_volume_t)((uint64_t)out->values[c] * (uint64_t)s->level / 100);
+}
+
+// Sends the next step of every running ramp and rearms itself while one is left
+static void duck_tick_cb(pa_mainloop_api* api, pa_time_event* e, const struct timeval* tv __attribute__((unused)), void* userdata __attribute__((unused))) {
+	pa_usec_t now = duck_now( );
+	int ramping = 0;
+
+	for (size_t i = 0; i < duck.num_streams; i++) {
+		duck_stream_t* s = &duck.streams[i];
+		if (!s->ramping) continue;
+
+		pa_cvolume to;
+		duck_target(s, &to);
+
+		pa_usec_t elapsed = now > s->start ? now - s->start : 0;
+		if (elapsed >= s->fade || s->from.channels != to.channels) {
+			s->current = to;
+			s->ramping = 0;
+		} else {
+			double t = (double)elapsed / (double)s->fade;
+			s->current = to;
+			for (uint8_t c = 0; c < to.channels; c++)
+				s->current.values[c] = (pa_volume_t)(s->from.values[c] + t * ((double)to.values[c] - (double)s->from.values[c]));
+			ramping = 1;
+		}
+
+		pa_operation* op = pa_context_set_sink_input_volume(pa_state->ctx, s->index, &s->current, NULL, NULL);
+		if (op)
+			pa_operation_unref(op);
+	}
+
+	if (ramping) {
+		struct timeval next;
+		api->time_restart(e, timeval_after(&next, LUA_PA_DUCK_STEP));
+	}
+}
+
+static void duck_schedule( ) {
+	pa_mainloop_api* api = pa_threaded_mainloop_get_api(pa_state->mainloop);
+	struct timeval tv;
+	if (duck.timer)
+		api->time_restart(duck.timer, timeval_after(&tv, 0));
+	else
+		duck.timer = api->time_new(api, timeval_after(&tv, 0), duck_tick_cb, NULL);
+}
+
+// The volume of a stream about to be ducked from rest, which is what it gets back afterwards
+static void duck_base_cb(pa_context* c __attribute__((unused)), const pa_sink_input_info* info, int eol, void* userdata __attribute__((unused))) {
+	if (eol || !info) return;
+
+	duck_stream_t* s = duck_find(info->index);
+	if (!s || s->level >= 100 || s->ramping) return;
+
+	s->base = info->volume;
+	s->from = info->volume;
+	s->current = info->volume;
+	s->start = duck_now( );
+	s->ramping = 1;
+	s->epoch++;
+	duck_schedule( );
+}
+
+// A ducked stream whose volume is not the one last sent was changed by someone else. Its base
+// follows, so the restore brings back what they chose. At level 0 there is nothing to scale from,
+// the new volume is kept as it is for the rest of the duck and afterwards
+static void duck_changed_cb(pa_context* c __attribute__((unused)), const pa_sink_input_info* info, int eol, void* userdata) {
+	if (eol || !info) return;
+
+	// A ramp started since the query was sent makes its answer out of date
+	duck_stream_t* s = duck_find(info->index);
+	if (!s || s->ramping || s->level >= 100 || s->epoch != (unsigned int)(uintptr_t)userdata) return;
+	if (info->volume.channels != s->current.channels || pa_cvolume_equal(&info->volume, &s->current)) return;
+
+	s->current = info->volume;
+	s->from = info->volume;
+	s->base = info->volume;
+	if (s->level > 0) {
+		for (uint8_t ch = 0; ch < s->base.channels; ch++) {
+			uint64_t v = (uint64_t)info->volume.values[ch] * 100 / (uint64_t)s->level;
+			s->base.values[ch] = v > PA_VOLUME_MAX ? PA_VOLUME_MAX : (pa_volume_t)v;
+		}
+	}
+}
+
+// Our own ramp steps come back as changes too, only a ducked stream at rest is looked at. Queries
+// are answered in order, one sent after the last step sees that step's volume
+static void duck_stream_changed(uint32_t index) {
+	duck_stream_t* s = duck_find(index);
+	if (!s || s->ramping || s->level >= 100) return;
+
+	pa_operation* op = pa_context_get_sink_input_info(pa_state->ctx, index, duck_changed_cb, (void*)(uintptr_t)s->epoch);
+	if (op)
+		pa_operation_unref(op);
+}
+
+// Recomputes the level of every stream, the lowest level of the rules it is a target of while
+// another stream triggers them, and starts a ramp for the streams whose level changed
+static void duck_evaluate( ) {
+	int changed = 0;
+
+	for (size_t i = 0; i < duck.num_streams; i++) {
+		duck_stream_t* s = &duck.streams[i];
+		int level = 100;
+		pa_usec_t fade = s->fade;
+
+		for (size_t r = 0; r < duck.num_rules; r++) {
+			const duck_rule_t* rule = &duck.rules[r];
+			if (rule->level >= level || !duck_matches(&rule->target, s)) continue;
+
+			for (size_t j = 0; j < duck.num_streams; j++) {
+				if (j != i && duck_matches(&rule->trigger, &duck.streams[j])) {
+					level = rule->level;
+					fade = rule->fade;
+					break;
+				}
+			}
+		}
+
+		if (level == s->level) continue;
+
+		if (s->level >= 100 && !s->ramping) {
+			// The stream may have been changed since we saw it, ramp from what it has now
+			s->level = level;
+			s->fade = fade;
+			pa_operation* op = pa_context_get_sink_input_info(pa_state->ctx, s->index, duck_base_cb, NULL);
+			if (op)
+				pa_operation_unref(op);
+			continue;
+		}
+
+		s->from = s->current;
+		s->level = level;
+		s->fade = fade;
+		s->start = duck_now( );
+		s->ramping = 1;
+		s->epoch++;
+		changed = 1;
+	}
+
+	if (changed)
+		duck_schedule( );
+}
+
+// Sink inputs present when the first rule was added and the ones created since
+static void duck_sink_input_cb(pa_context* c __attribute__((unused)), const pa_sink_input_info* info, int eol, void* userdata __attribute__((unused))) {
+	if (eol || !info || duck_find(info->index)) return;
+
+	duck_stream_t* grown = realloc(duck.streams, (duck.num_streams + 1) * sizeof(duck_stream_t));
+	if (!grown) return;
+	duck.streams = grown;
+
+	const char* role = info->proplist ? pa_proplist_gets(info->proplist, PA_PROP_MEDIA_ROLE) : NULL;
+	const char* application = info->proplist ? pa_proplist_gets(info->proplist, PA_PROP_APPLICATION_NAME) : NULL;
+
+	duck_stream_t* s = &grown[duck.num_streams++];
+	memset(s, 0, sizeof(*s));
+	s->index = info->index;
+	s->role = role ? strdup(role) : NULL;
+	s->application = application ? strdup(application) : NULL;
+	s->base = info->volume;
+	s->from = info->volume;
+	s->current = info->volume;
+	s->level = 100;
+
+	duck_evaluate( );
+}
+
+static void duck_stream_removed(uint32_t index) {
+	duck_stream_t* s = duck_find(index);
+	if (!s) return;
+
+	free(s->role);
+	free(s->application);
+	size_t i = (size_t)(s - duck.streams);
+	memmove(s, s + 1, (duck.num_streams - i - 1) * sizeof(duck_stream_t));
+	duck.num_streams--;
+
+	duck_evaluate( );
+}
+
+static void duck_match_free(duck_match_t* m) {
+	free(m->role);
+	free(m->application);
+}
+
+// Runs after the mainloop stopped
+static void duck_free( ) {
+	for (size_t i = 0; i < duck.num_rules; i++) {
+		duck_match_free(&duck.rules[i].trigger);
+		duck_match_free(&duck.rules[i].target);
+	}
+	for (size_t i = 0; i < duck.num_streams; i++) {
+		free(duck.streams[i].role);
+		free(duck.streams[i].application);
+	}
+	free(duck.rules);
+	free(duck.streams);
+	memset(&duck, 0, sizeof(duck));
+}
+
+// Reads { role = ..., application = ... } from field of the rule table at idx, checked to be a table
+static void duck_check_match(lua_State* L, int idx, const char* field, duck_match_t* m) {
+	lua_getfield(L, idx, field);
+
+	lua_getfield(L, -1, "role");
+	m->role = lua_isstring(L, -1) ? strdup(lua_tostring(L, -1)) : NULL;
+	lua_pop(L, 1);
+
+	lua_getfield(L, -1, "application");
+	m->application = lua_isstring(L, -1) ? strdup(lua_tostring(L, -1)) : NULL;
+	lua_pop(L, 2);
+}
+
+// add_duck_rule{ trigger = { role = 'phone' }, target = { role = 'music' }, level = 20, fade_ms = 200 }
+// returns an id for remove_duck_rule(). A trigger stream never ducks itself
+static int lua_pa_add_duck_rule(lua_State* L) {
+	if (!pa_state) {
+		lua_pushstring(L, "PulseAudio not initialized.");
+		lua_error(L);
+	}
+
+	luaL_checktype(L, 1, LUA_TTABLE);
+	if (backend != &pulse_backend)
+		return luaL_error(L, "add_duck_rule needs the pulse backend");
+
+	lua_getfield(L, 1, "level");
+	lua_Integer level = luaL_optinteger(L, -1, 20);
+	lua_getfield(L, 1, "fade_ms");
+	lua_Integer fade_ms = luaL_optinteger(L, -1, 200);
+	lua_pop(L, 2);
+	luaL_argcheck(L, level >= 0 && level <= 100, 1, "level must be between 0 and 100");
+	luaL_argcheck(L, fade_ms >= 0, 1, "fade_ms must not be negative");
+
+	lua_getfield(L, 1, "trigger");
+	lua_getfield(L, 1, "target");
+	luaL_argcheck(L, lua_istable(L, -2) && lua_istable(L, -1), 1, "trigger and target must be tables");
+	lua_pop(L, 2);
+
+	duck_rule_t rule;
+	memset(&rule, 0, sizeof(rule));
+	duck_check_match(L, 1, "trigger", &rule.trigger);
+	duck_check_match(L, 1, "target", &rule.target);
+	rule.level = (int)level;
+	rule.fade = (pa_usec_t)fade_ms * PA_USEC_PER_MSEC;
+	lua_pa_check_timeout(L, 0);
+
+	pa_threaded_mainloop_lock(pa_state->mainloop);
+
+	duck_rule_t* grown = pulse_ready( ) == 0 ? realloc(duck.rules, (duck.num_rules + 1) * sizeof(duck_rule_t)) : NULL;
+	if (!grown) {
+		int timed_out = pa_context_get_state(pa_state->ctx) != PA_CONTEXT_READY;
+		pa_threaded_mainloop_unlock(pa_state->mainloop);
+		duck_match_free(&rule.trigger);
+		duck_match_free(&rule.target);
+		if (timed_out)
+			return lua_pa_push_timeout(L);
+		lua_pushnil(L);
+		lua_pushstring(L, "out of memory");
+		return 2;
+	}
+
+	rule.id = ++duck.next_id;
+	duck.rules = grown;
+	duck.rules[duck.num_rules++] = rule;
+
+	if (!duck.tracking) {
+		duck.tracking = 1;
+		pa_operation* op = pa_context_get_sink_input_info_list(pa_state->ctx, duck_sink_input_cb, NULL);
+		if (op)
+			pa_operation_unref(op);
+	} else {
+		duck_evaluate( );
+	}
+
+	pa_threaded_mainloop_unlock(pa_state->mainloop);
+
+	lua_pushinteger(L, rule.id);
+	return 1;
+}
+
+// Streams the rule ducked ramp back unless another rule still holds them down
+static int lua_pa_remove_duck_rule(lua_State* L) {
+	if (!pa_state) {
+		lua_pushstring(L, "PulseAudio not initialized.");
+		lua_error(L);
+	}
+
+	lua_Integer id = luaL_checkinteger(L, 1);
+	int found = 0;
+
+	pa_threaded_mainloop_lock(pa_state->mainloop);
+
+	for (size_t i = 0; i < duck.num_rules; i++) {
+		if (duck.rules[i].id != id) continue;
+
+		duck_match_free(&duck.rules[i].trigger);
+		duck_match_free(&duck.rules[i].target);
+		memmove(&duck.rules[i], &duck.rules[i + 1], (duck.num_rules - i - 1) * sizeof(duck_rule_t));
+		duck.num_rules--;
+		found = 1;
+		duck_evaluate( );
+		break;
+	}
+
+	pa_threaded_mainloop_unlock(pa_state->mainloop);
+
+	lua_pushboolean(L, found);
+	return 1;
+}
+
+// Keeps the default sink/source names current for handlers connected with default = true
+static void track_defaults_cb(pa_context* c __attribute__((unused)), const pa_server_info* info, void* userdata __attribute__((unused))) {
+	if (info) {
+		journal_write_server(info);
+		registry_set_defaults(&live_registry, info->default_sink_name, info->default_source_name);
+	}
+
+	pa_threaded_mainloop_signal(pa_state->mainloop, 0);
+}
+
+static void lua_pa_subscribe_cb(pa_context* c __attribute__((unused)), pa_subscription_event_type_t type, uint32_t index, void* userdata __attribute__((unused))) {
+	journal_write_event(type, index);
+
+	if ((type & PA_SUBSCRIPTION_EVENT_FACILITY_MASK) == PA_SUBSCRIPTION_EVENT_SINK) {
+		if ((type & PA_SUBSCRIPTION_EVENT_TYPE_MASK) == PA_SUBSCRIPTION_EVENT_CHANGE) {
+			backend->request_sink(index, signal_sink_info_cb);
+		}
+		if ((type & PA_SUBSCRIPTION_EVENT_TYPE_MASK) == PA_SUBSCRIPTION_EVENT_NEW) {
+			backend->request_sink(index, signal_sink_new_cb);
+		}
+		if ((type & PA_SUBSCRIPTION_EVENT_TYPE_MASK) == PA_SUBSCRIPTION_EVENT_REMOVE) {
+			emit_device_remove(&live_registry, 0, index);
+		}
+	}
+	if ((type & PA_SUBSCRIPTION_EVENT_FACILITY_MASK) == PA_SUBSCRIPTION_EVENT_SOURCE) {
+		if ((type & PA_SUBSCRIPTION_EVENT_TYPE_MASK) == PA_SUBSCRIPTION_EVENT_CHANGE) {
+			backend->request_source(index, signal_source_info_cb);
+		}
+		if ((type & PA_SUBSCRIPTION_EVENT_TYPE_MASK) == PA_SUBSCRIPTION_EVENT_NEW) {
+			backend->request_source(index, signal_source_new_cb);
+		}
+		if ((type & PA_SUBSCRIPTION_EVENT_TYPE_MASK) == PA_SUBSCRIPTION_EVENT_REMOVE) {
+			emit_device_remove(&live_registry, 1, index);
+		}
+	} else if ((type & PA_SUBSCRIPTION_EVENT_FACILITY_MASK) == PA_SUBSCRIPTION_EVENT_SINK_INPUT) {
+		if (duck.tracking && (type & PA_SUBSCRIPTION_EVENT_TYPE_MASK) == PA_SUBSCRIPTION_EVENT_NEW) {
+			pa_operation* op = pa_context_get_sink_input_info(pa_state->ctx, index, duck_sink_input_cb, NULL);
+			if (op)
+				pa_operation_unref(op);
+		}
+		if ((type & PA_SUBSCRIPTION_EVENT_TYPE_MASK) == PA_SUBSCRIPTION_EVENT_CHANGE) {
+			duck_stream_changed(index);
+		}
+		if ((type & PA_SUBSCRIPTION_EVENT_TYPE_MASK) == PA_SUBSCRIPTION_EVENT_REMOVE) {
+			duck_stream_removed(index);
+		}
+	} else if ((type & PA_SUBSCRIPTION_EVENT_FACILITY_MASK) == PA_SUBSCRIPTION_EVENT_SERVER) {
+		backend->request_server(track_defaults_cb);
+	} else if ((type & PA_SUBSCRIPTION_EVENT_FACILITY_MASK) == PA_SUBSCRIPTION_EVENT_CLIENT) {
+		printf("CLIENT\n");
+	}
+}
+
+static int lua_pa_journal_start(lua_State* L) {
+	const char* path = luaL_checkstring(L, 1);
+
+	if (!pa_state) {
+		lua_pushstring(L, "PulseAudio not initialized.");
+		lua_error(L);
+	}
+
+	FILE* f = fopen(path, "ab");
+	if (!f) {
+		lua_pushnil(L);
+		lua_pushstring(L, strerror(errno));
+		return 2;
+	}
+
+	if (ftell(f) == 0) {
+		journal_header_t header = { htole32(LUA_PA_JOURNAL_MAGIC), htole32(LUA_PA_JOURNAL_VERSION) };
+		fwrite(&header, sizeof(header), 1, f);
+	}
+
+	lua_pa_check_timeout(L, 0);
+
+	pa_threaded_mainloop_lock(pa_state->mainloop);
+	if (journal)
+		fclose(journal);
+	journal = f;
+	journal_errno = 0;
+
+	journal_write_registry(JOURNAL_SINK_KNOWN, active_sinks, num_sinks);
+	journal_write_registry(JOURNAL_SOURCE_KNOWN, active_sources, num_sources);
+
+	// Start with the current defaults so a replay resolves default scoped handlers
+	backend->get_server(track_defaults_cb, NULL);
+	pa_threaded_mainloop_unlock(pa_state->mainloop);
+
+	lua_pushboolean(L, 1);
+	return 1;
+}
+
+static int lua_pa_journal_stop(lua_State* L) {
+	if (pa_state)
+		pa_threaded_mainloop_lock(pa_state->mainloop);
+
+	// A full disk shows up here rather than as a journal that silently ends early
+	int err = journal_errno;
+	if (journal) {
+		if (ferror(journal) && !err)
+			err = EIO;
+		if (fclose(journal) != 0 && !err)
+			err = errno;
+		journal = NULL;
+	}
+	journal_errno = 0;
+
+	if (pa_state)
+		pa_threaded_mainloop_unlock(pa_state->mainloop);
+
+	if (err) {
+		lua_pushnil(L);
+		lua_pushstring(L, strerror(err));
+		return 2;
+	}
+
+	lua_pushboolean(L, 1);
+	return 1;
+}
+
+static void replay_free( ) {
+	for (size_t i = 0; i < replay.num_sinks; i++) {
+		free((char*)replay.sinks[i].name);
+		free(replay.sinks[i].description);
+	}
+	for (size_t i = 0; i < replay.num_sources; i++) {
+		free((char*)replay.sources[i].name);
+		free(replay.sources[i].description);
+	}
+	free(replay.sinks);
+	free(replay.sources);
+	free(replay.default_sink);
+	free(replay.default_source);
+	memset(&replay, 0, sizeof(replay));
+}
+
+// Applies one record to the replay registry through the same code the live callbacks use, so
+// its handlers run on a dispatch thread like any event. Returns 1 when the record changed what
+// the replay registry holds or reached a handler. Nothing live is touched
+static int replay_record(uint32_t tag, uint32_t size, const unsigned char* payload) {
+	if (tag == JOURNAL_EVENT) {
+		if (size < sizeof(journal_event_t)) return 0;
+
+		const journal_event_t* event = (const journal_event_t*)payload;
+		uint32_t type = le32toh(event->type);
+		uint32_t index = le32toh(event->index);
+		uint32_t facility = type & PA_SUBSCRIPTION_EVENT_FACILITY_MASK;
+
+		// New and change events are replayed from the snapshot that follows them. Live sink input
+		// events only drive ducking, which acts on live streams and signals nothing
+		if ((type & PA_SUBSCRIPTION_EVENT_TYPE_MASK) != PA_SUBSCRIPTION_EVENT_REMOVE) return 0;
+		if (facility != PA_SUBSCRIPTION_EVENT_SINK && facility != PA_SUBSCRIPTION_EVENT_SOURCE) return 0;
+
+		return emit_device_remove(&replay_registry, facility == PA_SUBSCRIPTION_EVENT_SOURCE, index);
+	}
+
+	if (tag == JOURNAL_SERVER) {
+		if (size < sizeof(journal_server_t)) return 0;
+
+		const journal_server_t* server = (const journal_server_t*)payload;
+		size_t sink_len = le16toh(server->sink_len);
+		size_t source_len = le16toh(server->source_len);
+		if (sizeof(journal_server_t) + sink_len + source_len + 2 > size) return 0;
+
+		const char* sink = (const char*)(payload + sizeof(journal_server_t));
+		const char* source = sink + sink_len + 1;
+		char* sink_name = *sink ? strndup(sink, sink_len) : NULL;
+		char* source_name = *source ? strndup(source, source_len) : NULL;
+		registry_set_defaults(&replay_registry, sink_name, source_name);
+		free(sink_name);
+		free(source_name);
+		return 1;
+	}
+
+	int source = tag == JOURNAL_SOURCE_NEW || tag == JOURNAL_SOURCE_CHANGE || tag == JOURNAL_SOURCE_KNOWN;
+	int sink = tag == JOURNAL_SINK_NEW || tag == JOURNAL_SINK_CHANGE || tag == JOURNAL_SINK_KNOWN;
+	if ((!source && !sink) || size < sizeof(journal_device_t)) return 0;
+
+	const journal_device_t* device = (const journal_device_t*)payload;
+	size_t name_len = le16toh(device->name_len);
+	size_t description_len = le16toh(device->description_len);
+	if (sizeof(journal_device_t) + name_len + description_len + 2 > size) return 0;
+
+	char* name = strndup((const char*)(payload + sizeof(journal_device_t)), name_len);
+	char* description = strndup((const char*)(payload + sizeof(journal_device_t) + name_len + 1), description_len);
+	if (!name || !description) {
+		free(name);
+		free(description);
+		return 0;
+	}
+
+	pa_sample_spec ss = { (pa_sample_format_t)device->format, le32toh(device->rate), device->channels ? device->channels : 1 };
+	pa_cvolume volume;
+	pa_cvolume_set(&volume, ss.channels, le32toh(device->volume));
+	pa_channel_map map;
+	if (!pa_channel_map_init_auto(&map, ss.channels, PA_CHANNEL_MAP_DEFAULT))
+		pa_channel_map_init(&map);
+
+	int is_new = tag == JOURNAL_SINK_NEW || tag == JOURNAL_SOURCE_NEW;
+	int dispatched = 0;
+
+	if (tag == JOURNAL_SINK_KNOWN || tag == JOURNAL_SOURCE_KNOWN) {
+		// Known devices only seed the registry, they were there before the journal started
+		if (source)
+			device_registry_update(replay_registry.sources, replay_registry.num_sources, le32toh(device->index), name, description, &volume, (int)le32toh(device->mute), PA_INVALID_INDEX);
+		else
+			device_registry_update(replay_registry.sinks, replay_registry.num_sinks, le32toh(device->index), name, description, &volume, (int)le32toh(device->mute), PA_INVALID_INDEX);
+	} else if (sink) {
+		pa_sink_info info;
+		memset(&info, 0, sizeof(info));
+		info.index = le32toh(device->index);
+		info.name = name;
+		info.description = description;
+		info.volume = volume;
+		info.mute = (int)le32toh(device->mute);
+		info.state = (pa_sink_state_t)le32toh(device->state);
+		info.latency = le64toh(device->latency);
+		info.configured_latency = le64toh(device->configured_latency);
+		info.sample_spec = ss;
+		info.channel_map = map;
+		info.card = PA_INVALID_INDEX;
+		info.monitor_source = PA_INVALID_INDEX;
+		dispatched = emit_sink_info(&replay_registry, &info, is_new);
+	} else {
+		pa_source_info info;
+		memset(&info, 0, sizeof(info));
+		info.index = le32toh(device->index);
+		info.name = name;
+		info.description = description;
+		info.volume = volume;
+		info.mute = (int)le32toh(device->mute);
+		info.state = (pa_source_state_t)le32toh(device->state);
+		info.latency = le64toh(device->latency);
+		info.configured_latency = le64toh(device->configured_latency);
+		info.sample_spec = ss;
+		info.channel_map = map;
+		info.card = PA_INVALID_INDEX;
+		info.monitor_of_sink = PA_INVALID_INDEX;
+		dispatched = emit_source_info(&replay_registry, &info, is_new);
+	}
+
+	free(name);
+	free(description);
+	return dispatched;
+}
+
+// Runs a journal through the signal handlers the way live events reach them, speed scales the
+// recorded gaps and 0 drops them. The devices and defaults it replays live in a registry of their own
+static int lua_pa_replay(lua_State* L) {
+	const char* path = luaL_checkstring(L, 1);
+
+	if (!pa_state) {
+		lua_pushstring(L, "PulseAudio not initialized.");
+		lua_error(L);
+	}
+
+	double speed = 1.0;
+	if (lua_istable(L, 2)) {
+		lua_getfield(L, 2, "speed");
+		if (!lua_isnil(L, -1))
+			speed = luaL_checknumber(L, -1);
+		lua_pop(L, 1);
+	}
+
+	int fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		lua_pushnil(L);
+		lua_pushstring(L, strerror(errno));
+		return 2;
+	}
+
+	struct stat st;
+	if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(journal_header_t)) {
+		close(fd);
+		lua_pushnil(L);
+		lua_pushstring(L, "not a lua_pa journal");
+		return 2;
+	}
+
+	size_t length = (size_t)st.st_size;
+	const unsigned char* data = mmap(NULL, length, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (data == MAP_FAILED) {
+		lua_pushnil(L);
+		lua_pushstring(L, strerror(errno));
+		return 2;
+	}
+
+	const journal_header_t* header = (const journal_header_t*)data;
+	if (le32toh(header->magic) != LUA_PA_JOURNAL_MAGIC || le32toh(header->version) != LUA_PA_JOURNAL_VERSION) {
+		munmap((void*)data, length);
+		lua_pushnil(L);
+		lua_pushstring(L, "not a lua_pa journal");
+		return 2;
+	}
+
+	lua_Integer dispatched = 0;
+	uint64_t previous = 0;
+	size_t offset = sizeof(journal_header_t);
+
+	replay_free( );
+
+	while (offset + sizeof(journal_record_t) <= length) {
+		const journal_record_t* record = (const journal_record_t*)(data + offset);
+		uint32_t size = le32toh(record->size);
+		uint64_t usec = le64toh(record->usec);
+		size_t padded = (size + 7) & ~(size_t)7;
+		if (offset + sizeof(journal_record_t) + padded > length) break;
+
+		if (speed > 0 && previous && usec > previous) {
+			double delay = (usec - previous) / speed;
+			struct timespec ts = { (time_t)(delay / 1000000), (long)((uint64_t)delay % 1000000) * 1000 };
+			nanosleep(&ts, NULL);
+		}
+		previous = usec;
+
+		dispatched += replay_record(le32toh(record->tag), size, data + offset + sizeof(journal_record_t));
+
+		// The dispatch thread holds the mutex until its handlers returned, they run on this
+		// thread's Lua state and the next record must not overtake them
+		pthread_mutex_lock(&pa_state->mutex);
+		pthread_mutex_unlock(&pa_state->mutex);
+
+		offset += sizeof(journal_record_t) + padded;
+	}
+
+	replay_free( );
+	munmap((void*)data, length);
+
+	lua_pushinteger(L, dispatched);
+	return 1;
+}
+
+static void playback_write_cb(pa_stream* s __attribute__((unused)), size_t nbytes, void* userdata) {
+	lua_pa_playback_t* pb = (lua_pa_playback_t*)userdata;
+	emit_stream_signal("pulseaudio::playback_writable", "ii", pb->index, (int)nbytes);
+}
+
+static void playback_underflow_cb(pa_stream* s __attribute__((unused)), void* userdata) {
+	lua_pa_playback_t* pb = (lua_pa_playback_t*)userdata;
+	emit_stream_signal("pulseaudio::playback_underflow", "i", pb->index, 0);
+}
+
+// Gets the stream index rather than the playback, which may be collected before the drain completes
+static void playback_drain_cb(pa_stream* s __attribute__((unused)), int success, void* userdata) {
+	emit_stream_signal("pulseaudio::playback_drain", "ib", (uint32_t)(uintptr_t)userdata, success);
+}
+
+static lua_pa_playback_t* check_playback(lua_State* L) {
+	lua_pa_playback_t* pb = (lua_pa_playback_t*)luaL_checkudata(L, 1, "lua_pa_playback");
+	if (!pb->stream)
+		luaL_error(L, "Playback stream is closed");
+	return pb;
+}
+
+static int lua_pa_new_playback(lua_State* L) {
+	if (!pa_state) {
+		lua_pushstring(L, "PulseAudio not initialized.");
+		lua_error(L);
+	}
+
+	if (backend != &pulse_backend)
+		return luaL_error(L, "new_playback needs the pulse backend");
+
+	luaL_checktype(L, 1, LUA_TTABLE);
+
+	pa_sample_spec ss;
+	lua_pa_check_sample_spec(L, 1, &ss);
+
+	lua_getfield(L, 1, "latency_ms");
+	lua_Integer latency_ms = lua_isnil(L, -1) ? 0 : luaL_checkinteger(L, -1);
+	lua_pop(L, 1);
+	lua_pa_check_timeout(L, 1);
+
+	// Stays on the stack until the stream is connected, then removed below the playback
+	lua_getfield(L, 1, "device");
+	const char* device = lua_isnil(L, -1) ? NULL : luaL_checkstring(L, -1);
+	int device_idx = lua_gettop(L);
+
+	pa_buffer_attr attr;
+	attr.maxlength = (uint32_t)-1;
+	attr.tlength = (uint32_t)-1;
+	attr.prebuf = (uint32_t)-1;
+	attr.minreq = (uint32_t)-1;
+	attr.fragsize = (uint32_t)-1;
+
+	pa_stream_flags_t flags = PA_STREAM_NOFLAGS;
+	if (latency_ms > 0) {
+		attr.tlength = (uint32_t)pa_usec_to_bytes(latency_ms * PA_USEC_PER_MSEC, &ss);
+		flags = PA_STREAM_ADJUST_LATENCY;
+	}
+
+	lua_pa_playback_t* pb = (lua_pa_playback_t*)lua_newuserdata(L, sizeof(lua_pa_playback_t));
+	pb->stream = NULL;
+	pb->ss = ss;
+	pb->index = PA_INVALID_INDEX;
+	luaL_setmetatable(L, "lua_pa_playback");
+
+	pa_threaded_mainloop_lock(pa_state->mainloop);
+
+	if (pulse_ready( ) < 0) {
+		pa_threaded_mainloop_unlock(pa_state->mainloop);
+		return lua_pa_push_timeout(L);
+	}
+
+	pa_stream* s = pa_stream_new(pa_state->ctx, "Lua Pulseaudio playback", &ss, NULL);
+	if (!s) {
+		pa_threaded_mainloop_unlock(pa_state->mainloop);
+		lua_pushnil(L);
+		lua_pushstring(L, pa_strerror(pa_context_errno(pa_state->ctx)));
+		return 2;
+	}
+
+	pa_stream_set_state_callback(s, stream_state_cb, NULL);
+	pa_stream_set_write_callback(s, playback_write_cb, pb);
+	pa_stream_set_underflow_callback(s, playback_underflow_cb, pb);
+
+	int expired;
+	pa_time_event* deadline = deadline_start(&expired);
+	if (pa_stream_connect_playback(s, device, &attr, flags, NULL, NULL) == 0)
+		while (!expired && pa_stream_get_state(s) == PA_STREAM_CREATING)
+			pa_threaded_mainloop_wait(pa_state->mainloop);
+	int timed_out = deadline_stop(deadline, expired) < 0;
+
+	if (timed_out || pa_stream_get_state(s) != PA_STREAM_READY) {
+		const char* err = timed_out ? "timeout" : pa_strerror(pa_context_errno(pa_state->ctx));
+		release_stream(s);
+		pa_threaded_mainloop_unlock(pa_state->mainloop);
+		lua_pushnil(L);
+		lua_pushstring(L, err);
+		return 2;
+	}
+
+	pb->stream = s;
+	pb->index = pa_stream_get_index(s);
+
+	pa_threaded_mainloop_unlock(pa_state->mainloop);
+
+	lua_remove(L, device_idx);
+	return 1;
+}
+
+// Copies straight from the Lua string or userdata into the buffer handed out by the server
+static int lua_pa_playback_write(lua_State* L) {
+	lua_pa_playback_t* pb = check_playback(L);
+
+	const char* data = NULL;
+	size_t length = 0;
+
+	if (lua_type(L, 2) == LUA_TUSERDATA) {
+		data = (const char*)lua_touserdata(L, 2);
+		length = lua_rawlen(L, 2);
+	} else {
+		data = luaL_checklstring(L, 2, &length);
+	}
+
+	size_t frame_size = pa_frame_size(&pb->ss);
+	length -= length % frame_size;
+
+	pa_threaded_mainloop_lock(pa_state->mainloop);
+
+	size_t offset = 0;
+	while (offset < length) {
+		size_t writable = pa_stream_writable_size(pb->stream);
+		if (writable == 0 || writable == (size_t)-1) break;
+
+		void* dst = NULL;
+		size_t n = length - offset;
+		if (n > writable) n = writable;
+
+		if (pa_stream_begin_write(pb->stream, &dst, &n) < 0 || n == 0) break;
+		if (n > length - offset) n = length - offset;
+		n -= n % frame_size;
+
+		memcpy(dst, data + offset, n);
+		if (pa_stream_write(pb->stream, dst, n, NULL, 0, PA_SEEK_RELATIVE) < 0) break;
+		offset += n;
+	}
+
+	pa_threaded_mainloop_unlock(pa_state->mainloop);
+
+	lua_pushinteger(L, (lua_Integer)offset);
+	return 1;
+}
+
+static int lua_pa_playback_writable_size(lua_State* L) {
+	lua_pa_playback_t* pb = check_playback(L);
+
+	pa_threaded_mainloop_lock(pa_state->mainloop);
+	size_t writable = pa_stream_writable_size(pb->stream);
+	pa_threaded_mainloop_unlock(pa_state->mainloop);
+
+	lua_pushinteger(L, writable == (size_t)-1 ? 0 : (lua_Integer)writable);
+	return 1;
+}
+
+static int lua_pa_playback_drain(lua_State* L) {
+	lua_pa_playback_t* pb = check_playback(L);
+
+	pa_threaded_mainloop_lock(pa_state->mainloop);
+
+	pa_operation* op = pa_stream_drain(pb->stream, playback_drain_cb, (void*)(uintptr_t)pb->index);
+	if (op)
+		pa_operation_unref(op);
+
+	pa_threaded_mainloop_unlock(pa_state->mainloop);
+
+	lua_pushboolean(L, op != NULL);
+	return 1;
+}
+
+static int lua_pa_playback_index(lua_State* L) {
+	lua_pa_playback_t* pb = check_playback(L);
+	lua_pushinteger(L, pb->index);
+	return 1;
+}
+
+static int lua_pa_playback_close(lua_State* L) {
+	lua_pa_playback_t* pb = (lua_pa_playback_t*)luaL_checkudata(L, 1, "lua_pa_playback");
+
+	if (pb->stream && pa_state) {
+		pa_threaded_mainloop_lock(pa_state->mainloop);
+		release_stream(pb->stream);
+		pa_threaded_mainloop_unlock(pa_state->mainloop);
+	}
+	pb->stream = NULL;
+
+	return 0;
+}
+
+static const struct luaL_Reg lua_pa_playback_methods[] = {
+	{"write", lua_pa_playback_write},
+	{"writable_size", lua_pa_playback_writable_size},
+	{"drain", lua_pa_playback_drain},
+	{"index", lua_pa_playback_index},
+	{"close", lua_pa_playback_close},
+	{ NULL, NULL },
+};
+
+static void record_ring_push(lua_pa_record_t* rec, const char* data, size_t nbytes) {
+	size_t head = atomic_load_explicit(&rec->head, memory_order_relaxed);
+	size_t tail = atomic_load_explicit(&rec->tail, memory_order_acquire);
+
+	if (nbytes > rec->capacity - (head - tail)) {
+		atomic_fetch_add_explicit(&rec->overruns, 1, memory_order_relaxed);
+		return;
+	}
+
+	size_t pos = head & (rec->capacity - 1);
+	size_t first = rec->capacity - pos;
+	if (first > nbytes) first = nbytes;
+
+	memcpy(rec->ring + pos, data, first);
+	memcpy(rec->ring, data + first, nbytes - first);
+
+	atomic_store_explicit(&rec->head, head + nbytes, memory_order_release);
+}
+
+static void record_read_cb(pa_stream* s, size_t nbytes __attribute__((unused)), void* userdata) {
+	lua_pa_record_t* rec = (lua_pa_record_t*)userdata;
+
+	while (pa_stream_readable_size(s) > 0) {
+		const void* data = NULL;
+		size_t n = 0;
+
+		if (pa_stream_peek(s, &data, &n) < 0 || n == 0) break;
+
+		// data is NULL for holes in the stream, they are dropped
+		if (data)
+			record_ring_push(rec, (const char*)data, n);
+		pa_stream_drop(s);
+	}
+
+	if (rec->fd >= 0) {
+		uint64_t one = 1;
+		ssize_t r __attribute__((unused)) = write(rec->fd, &one, sizeof(one));
+	}
+
+	size_t readable = atomic_load_explicit(&rec->head, memory_order_relaxed) - atomic_load_explicit(&rec->tail, memory_order_relaxed);
+	emit_stream_signal("pulseaudio::record_readable", "ii", rec->index, (int)readable);
+}
+
+static void record_overflow_cb(pa_stream* s __attribute__((unused)), void* userdata) {
+	lua_pa_record_t* rec = (lua_pa_record_t*)userdata;
+	atomic_fetch_add_explicit(&rec->overruns, 1, memory_order_relaxed);
+}
+
+// Connects rec to source, returns NULL on success or an error message
+static const char* record_connect(lua_pa_record_t* rec, const char* stream_name, const char* source, const pa_buffer_attr* attr, pa_stream_flags_t flags, pa_stream_request_cb_t read_cb, void* userdata) {
+	pa_threaded_mainloop_lock(pa_state->mainloop);
+
+	if (pulse_ready( ) < 0) {
+		pa_threaded_mainloop_unlock(pa_state->mainloop);
+		return "timeout";
+	}
+
+	pa_stream* s = pa_stream_new(pa_state->ctx, stream_name, &rec->ss, NULL);
+	if (!s) {
+		pa_threaded_mainloop_unlock(pa_state->mainloop);
+		return pa_strerror(pa_context_errno(pa_state->ctx));
+	}
+
+	pa_stream_set_state_callback(s, stream_state_cb, NULL);
+	pa_stream_set_read_callback(s, read_cb, userdata);
+	pa_stream_set_overflow_callback(s, record_overflow_cb, rec);
+
+	int expired;
+	pa_time_event* deadline = deadline_start(&expired);
+	if (pa_stream_connect_record(s, source, attr, flags) == 0)
+		while (!expired && pa_stream_get_state(s) == PA_STREAM_CREATING)
+			pa_threaded_mainloop_wait(pa_state->mainloop);
+	int timed_out = deadline_stop(deadline, expired) < 0;
+
+	if (timed_out || pa_stream_get_state(s) != PA_STREAM_READY) {
+		const char* err = timed_out ? "timeout" : pa_strerror(pa_context_errno(pa_state->ctx));
+		release_stream(s);
+		pa_threaded_mainloop_unlock(pa_state->mainloop);
+		return err;
+	}
+
+	rec->stream = s;
+	rec->index = pa_stream_get_index(s);
+
+	pa_threaded_mainloop_unlock(pa_state->mainloop);
+
+	return NULL;
+}
+
+static lua_pa_record_t* check_record(lua_State* L) {
+	lua_pa_record_t* rec = (lua_pa_record_t*)luaL_checkudata(L, 1, "lua_pa_record");
+	if (!rec->stream)
+		luaL_error(L, "Record stream is closed");
+	return rec;
+}
+
+static int lua_pa_new_record(lua_State* L) {
+	if (!pa_state) {
+		lua_pushstring(L, "PulseAudio not initialized.");
+		lua_error(L);
+	}
+
+	if (backend != &pulse_backend)
+		return luaL_error(L, "new_record needs the pulse backend");
+
+	luaL_checktype(L, 1, LUA_TTABLE);
+
+	pa_sample_spec ss;
+	lua_pa_check_sample_spec(L, 1, &ss);
+
+	lua_getfield(L, 1, "source");
+	const char* source = lua_isnil(L, -1) ? NULL : luaL_checkstring(L, -1);
+
+	lua_getfield(L, 1, "fragsize");
+	lua_Integer fragsize = lua_isnil(L, -1) ? 0 : luaL_checkinteger(L, -1);
+	lua_pop(L, 1);
+
+	lua_getfield(L, 1, "buffer");
+	lua_Integer buffer = lua_isnil(L, -1) ? (lua_Integer)pa_bytes_per_second(&ss) : luaL_checkinteger(L, -1);
+	lua_pop(L, 1);
+	lua_pa_check_timeout(L, 1);
+
+	// Round up to a power of two so the ring can mask instead of divide
+	size_t capacity = 4096;
+	while (capacity < (size_t)buffer)
+		capacity <<= 1;
+
+	pa_buffer_attr attr;
+	attr.maxlength = (uint32_t)-1;
+	attr.tlength = (uint32_t)-1;
+	attr.prebuf = (uint32_t)-1;
+	attr.minreq = (uint32_t)-1;
+	attr.fragsize = fragsize > 0 ? (uint32_t)fragsize : (uint32_t)-1;
+
+	lua_pa_record_t* rec = (lua_pa_record_t*)lua_newuserdata(L, sizeof(lua_pa_record_t));
+	rec->stream = NULL;
+	rec->ss = ss;
+	rec->index = PA_INVALID_INDEX;
+	rec->capacity = capacity;
+	rec->ring = malloc(capacity);
+	atomic_init(&rec->head, 0);
+	atomic_init(&rec->tail, 0);
+	atomic_init(&rec->overruns, 0);
+	rec->fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	luaL_setmetatable(L, "lua_pa_record");
+
+	if (!rec->ring) {
+		lua_pushnil(L);
+		lua_pushstring(L, "Memory allocation failed for record buffer");
+		return 2;
+	}
+
+	const char* err = record_connect(rec, "Lua Pulseaudio record", source, &attr,
+		fragsize > 0 ? PA_STREAM_ADJUST_LATENCY : PA_STREAM_NOFLAGS, record_read_cb, rec);
+	if (err) {
+		lua_pushnil(L);
+		lua_pushstring(L, err);
+		return 2;
+	}
+
+	return 1;
+}
+
+// Consumer side of the ring, never takes the mainloop lock. The fd is cleared before head is read
+// and signalled again when bytes are left, so pollers wake for every byte still buffered
+static int lua_pa_record_read(lua_State* L) {
+	lua_pa_record_t* rec = check_record(L);
+
+	if (rec->fd >= 0) {
+		uint64_t count;
+		ssize_t r __attribute__((unused)) = read(rec->fd, &count, sizeof(count));
+	}
+
+	size_t tail = atomic_load_explicit(&rec->tail, memory_order_relaxed);
+	size_t head = atomic_load_explicit(&rec->head, memory_order_acquire);
+	size_t n = head - tail;
+
+	if (!lua_isnoneornil(L, 2)) {
+		lua_Integer max_bytes = luaL_checkinteger(L, 2);
+		if (max_bytes < 0) max_bytes = 0;
+		if ((size_t)max_bytes < n) n = (size_t)max_bytes;
+	}
+	n -= n % pa_frame_size(&rec->ss);
+
+	size_t pos = tail & (rec->capacity - 1);
+	size_t first = rec->capacity - pos;
+	if (first > n) first = n;
+
+	luaL_Buffer b;
+	luaL_buffinit(L, &b);
+	luaL_addlstring(&b, rec->ring + pos, first);
+	luaL_addlstring(&b, rec->ring, n - first);
+	luaL_pushresult(&b);
+
+	atomic_store_explicit(&rec->tail, tail + n, memory_order_release);
+
+	if (rec->fd >= 0 && head - (tail + n) > 0) {
+		uint64_t one = 1;
+		ssize_t r __attribute__((unused)) = write(rec->fd, &one, sizeof(one));
+	}
+
+	return 1;
+}
+
+static int lua_pa_record_readable_size(lua_State* L) {
+	lua_pa_record_t* rec = check_record(L);
+	size_t head = atomic_load_explicit(&rec->head, memory_order_acquire);
+	lua_pushinteger(L, (lua_Integer)(head - atomic_load_explicit(&rec->tail, memory_order_relaxed)));
+	return 1;
+}
+
+static int lua_pa_record_fd(lua_State* L) {
+	lua_pa_record_t* rec = check_record(L);
+	lua_pushinteger(L, rec->fd);
+	return 1;
+}
+
+static int lua_pa_record_overruns(lua_State* L) {
+	lua_pa_record_t* rec = check_record(L);
+	lua_pushinteger(L, (lua_Integer)atomic_load_explicit(&rec->overruns, memory_order_relaxed));
+	return 1;
+}
+
+static int lua_pa_record_index(lua_State* L) {
+	lua_pa_record_t* rec = check_record(L);
+	lua_pushinteger(L, rec->index);
+	return 1;
+}
+
+static int lua_pa_record_close(lua_State* L) {
+	lua_pa_record_t* rec = (lua_pa_record_t*)luaL_checkudata(L, 1, "lua_pa_record");
+
+	if (rec->stream && pa_state) {
+		pa_threaded_mainloop_lock(pa_state->mainloop);
+		release_stream(rec->stream);
+		pa_threaded_mainloop_unlock(pa_state->mainloop);
+	}
+	rec->stream = NULL;
+
+	free(rec->ring);
+	rec->ring = NULL;
+
+	if (rec->fd >= 0) {
+		close(rec->fd);
+		rec->fd = -1;
+	}
+
+	return 0;
+}
+
+static const struct luaL_Reg lua_pa_record_methods[] = {
+	{"read", lua_pa_record_read},
+	{"readable_size", lua_pa_record_readable_size},
+	{"fd", lua_pa_record_fd},
+	{"overruns", lua_pa_record_overruns},
+	{"index", lua_pa_record_index},
+	{"close", lua_pa_record_close},
+	{ NULL, NULL },
+};
+
+static void spectrum_read_cb(pa_stream* s, size_t nbytes __attribute__((unused)), void* userdata) {
+	lua_pa_spectrum_t* sp = (lua_pa_spectrum_t*)userdata;
+
+	while (pa_stream_readable_size(s) > 0) {
+		const void* data = NULL;
+		size_t n = 0;
+
+		if (pa_stream_peek(s, &data, &n) < 0 || n == 0) break;
+
+		if (data)
+			record_ring_push(&sp->capture, (const char*)data, n);
+		pa_stream_drop(s);
+	}
+}
+
+static void spectrum_free(lua_pa_spectrum_t* sp) {
+	free(sp->capture.ring);
+	free(sp->window);
+	free(sp->history);
+	free(sp->re);
+	free(sp->im);
+	free(sp->power);
+	free(sp->twiddle_re);
+	free(sp->twiddle_im);
+	free(sp->split_re);
+	free(sp->split_im);
+	free(sp->bitrev);
+	free(sp->band_lo);
+	free(sp->band_hi);
+	free(sp);
+}
+
+// Precomputes everything the worker needs so a frame does no allocation and no trig
+static int spectrum_setup(lua_pa_spectrum_t* sp, const char* window) {
+	unsigned int n = sp->fft_size;
+	unsigned int m = n / 2;
+
+	sp->window = malloc(n * sizeof(float));
+	sp->history = calloc(n, sizeof(float));
+	sp->re = malloc(m * sizeof(float));
+	sp->im = malloc(m * sizeof(float));
+	sp->power = malloc(m * sizeof(float));
+	sp->twiddle_re = malloc(m / 2 * sizeof(float));
+	sp->twiddle_im = malloc(m / 2 * sizeof(float));
+	sp->split_re = malloc(m * sizeof(float));
+	sp->split_im = malloc(m * sizeof(float));
+	sp->bitrev = malloc(m * sizeof(unsigned int));
+	sp->band_lo = malloc(sp->bands * sizeof(unsigned int));
+	sp->band_hi = malloc(sp->bands * sizeof(unsigned int));
+
+	if (!sp->window || !sp->history || !sp->re || !sp->im || !sp->power || !sp->twiddle_re || !sp->twiddle_im
+		|| !sp->split_re || !sp->split_im || !sp->bitrev || !sp->band_lo || !sp->band_hi)
+		return -1;
+
+	double sum = 0;
+	for (unsigned int i = 0; i < n; i++) {
+		double x = 2 * M_PI * i / (n - 1);
+		double w = 1.0;
+		if (strcmp(window, "hann") == 0) w = 0.5 - 0.5 * cos(x);
+		else if (strcmp(window, "hamming") == 0) w = 0.54 - 0.46 * cos(x);
+		else if (strcmp(window, "blackman") == 0) w = 0.42 - 0.5 * cos(x) + 0.08 * cos(2 * x);
+		sp->window[i] = (float)w;
+		sum += w * w;
+	}
+	// Parseval over the band, a full scale sine reads as 1.0 whatever the window
+	sp->scale = (float)(2.0 / sqrt(n * sum));
+
+	unsigned int bits = 0;
+	while ((1u << bits) < m) bits++;
+	for (unsigned int i = 0; i < m; i++) {
+		unsigned int r = 0;
+		for (unsigned int b = 0; b < bits; b++)
+			if (i & (1u << b)) r |= 1u << (bits - 1 - b);
+		sp->bitrev[i] = r;
+	}
+
+	for (unsigned int i = 0; i < m / 2; i++) {
+		sp->twiddle_re[i] = (float)cos(-2 * M_PI * i / m);
+		sp->twiddle_im[i] = (float)sin(-2 * M_PI * i / m);
+	}
+	for (unsigned int i = 0; i < m; i++) {
+		sp->split_re[i] = (float)cos(-2 * M_PI * i / n);
+		sp->split_im[i] = (float)sin(-2 * M_PI * i / n);
+	}
+
+	// Log spaced bands between 50Hz and 18kHz (or nyquist), each at least one bin wide
+	double f_lo = 50.0;
+	double f_hi = sp->capture.ss.rate / 2.0 < 18000.0 ? sp->capture.ss.rate / 2.0 : 18000.0;
+	unsigned int prev = 1;
+	for (unsigned int b = 0; b < sp->bands; b++) {
+		double f = f_lo * pow(f_hi / f_lo, (double)(b + 1) / sp->bands);
+		unsigned int hi = (unsigned int)(f * n / sp->capture.ss.rate);
+		if (hi <= prev) hi = prev + 1;
+		if (hi > m) hi = m;
+		sp->band_lo[b] = prev < m ? prev : m - 1;
+		sp->band_hi[b] = hi > sp->band_lo[b] ? hi : sp->band_lo[b] + 1;
+		prev = hi;
+	}
+
+	return 0;
+}
+
+// Slides the newest captured samples into the analysis window
+static size_t spectrum_pull(lua_pa_spectrum_t* sp) {
+	lua_pa_record_t* rec = &sp->capture;
+	size_t window_bytes = sp->fft_size * sizeof(float);
+
+	size_t tail = atomic_load_explicit(&rec->tail, memory_order_relaxed);
+	size_t head = atomic_load_explicit(&rec->head, memory_order_acquire);
+	if (head - tail > window_bytes)
+		tail = head - window_bytes;
+
+	size_t total = head - tail;
+	while (tail != head) {
+		size_t pos = tail & (rec->capacity - 1);
+		size_t chunk = rec->capacity - pos;
+		if (chunk > head - tail) chunk = head - tail;
+
+		size_t count = chunk / sizeof(float);
+		memmove(sp->history, sp->history + count, (sp->fft_size - count) * sizeof(float));
+		memcpy(sp->history + sp->fft_size - count, rec->ring + pos, chunk);
+
+		tail += chunk;
+	}
+
+	atomic_store_explicit(&rec->tail, tail, memory_order_release);
+	return total;
+}
+
+// The frame kernels are the only hot loops of the module, they get the vectorizer whatever the
+// module is built with. Check with -fopt-info-vec-optimized, the power and band loops report vectorized
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC push_options
+#pragma GCC optimize("O2", "tree-vectorize")
+#endif
+
+// Windowed real FFT through a half size complex FFT, leaves the power per bin in sp->power
+static void spectrum_fft(lua_pa_spectrum_t* sp) {
+	unsigned int m = sp->fft_size / 2;
+	const float* restrict x = sp->history;
+	const float* restrict w = sp->window;
+	float* restrict re = sp->re;
+	float* restrict im = sp->im;
+	float* restrict p = sp->power;
+
+	for (unsigned int i = 0; i < m; i++) {
+		unsigned int r = sp->bitrev[i];
+		re[r] = x[2 * i] * w[2 * i];
+		im[r] = x[2 * i + 1] * w[2 * i + 1];
+	}
+
+	for (unsigned int len = 2; len <= m; len <<= 1) {
+		unsigned int half = len >> 1;
+		unsigned int step = m / len;
+		for (unsigned int i = 0; i < m; i += len) {
+			for (unsigned int j = 0; j < half; j++) {
+				float wr = sp->twiddle_re[j * step];
+				float wi = sp->twiddle_im[j * step];
+				unsigned int a = i + j;
+				unsigned int b = a + half;
+				float tr = re[b] * wr - im[b] * wi;
+				float ti = re[b] * wi + im[b] * wr;
+				re[b] = re[a] - tr;
+				im[b] = im[a] - ti;
+				re[a] += tr;
+				im[a] += ti;
+			}
+		}
+	}
+
+	// Bin 0 pairs with itself, the others with m - k, which keeps the loop below free of the wrap
+	p[0] = (re[0] + im[0]) * (re[0] + im[0]);
+
+	const float* restrict sr = sp->split_re;
+	const float* restrict si = sp->split_im;
+	for (unsigned int k = 1; k < m; k++) {
+		unsigned int mk = m - k;
+		float er = 0.5f * (re[k] + re[mk]);
+		float ei = 0.5f * (im[k] - im[mk]);
+		float odd_r = 0.5f * (im[k] + im[mk]);
+		float odd_i = -0.5f * (re[k] - re[mk]);
+		float xr = er + sr[k] * odd_r - si[k] * odd_i;
+		float xi = ei + sr[k] * odd_i + si[k] * odd_r;
+		p[k] = xr * xr + xi * xi;
+	}
+}
+
+static void spectrum_publish(lua_pa_spectrum_t* sp) {
+	unsigned int seq = atomic_load_explicit(&sp->seq, memory_order_relaxed);
+	float* restrict out = sp->out[(seq + 1) & 1];
+	const float* restrict p = sp->power;
+
+	for (unsigned int b = 0; b < sp->bands; b++) {
+		unsigned int k = sp->band_lo[b];
+		unsigned int hi = sp->band_hi[b];
+
+		// Eight independent partial sums are a plain elementwise add, a single running sum would
+		// need -ffast-math before the vectorizer reorders it
+		float lanes[8] = { 0 };
+		for (; k + 8 <= hi; k += 8)
+			for (unsigned int l = 0; l < 8; l++)
+				lanes[l] += p[k + l];
+
+		float sum = 0.0f;
+		for (unsigned int l = 0; l < 8; l++)
+			sum += lanes[l];
+		for (; k < hi; k++)
+			sum += p[k];
+
+		out[b] = sqrtf(sum) * sp->scale;
+	}
+
+	atomic_store_explicit(&sp->seq, seq + 1, memory_order_release);
+}
+
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC pop_options
+#endif
+
+static void* spectrum_worker(void* userdata) {
+	lua_pa_spectrum_t* sp = (lua_pa_spectrum_t*)userdata;
+
+	long period = 1000000000L / sp->fps;
+	struct timespec next;
+	clock_gettime(CLOCK_MONOTONIC, &next);
+
+	while (atomic_load_explicit(&sp->running, memory_order_acquire)) {
+		next.tv_nsec += period;
+		while (next.tv_nsec >= 1000000000L) {
+			next.tv_nsec -= 1000000000L;
+			next.tv_sec++;
+		}
+		clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL);
+
+		// Nothing captured means nothing changed, skip the frame entirely
+		if (spectrum_pull(sp) == 0) continue;
+
+		spectrum_fft(sp);
+		spectrum_publish(sp);
+		emit_stream_signal("pulseaudio::spectrum", "ii", sp->capture.index, (int)atomic_load(&sp->seq));
+	}
+
+	return NULL;
+}
+
+static lua_pa_spectrum_t* check_spectrum(lua_State* L) {
+	lua_pa_spectrum_t** ud = (lua_pa_spectrum_t**)luaL_checkudata(L, 1, "lua_pa_spectrum");
+	if (!*ud)
+		luaL_error(L, "Spectrum analyzer is closed");
+	return *ud;
+}
+
+static int lua_pa_spectrum(lua_State* L) {
+	if (!pa_state) {
+		lua_pushstring(L, "PulseAudio not initialized.");
+		lua_error(L);
+	}
+
+	if (backend != &pulse_backend)
+		return luaL_error(L, "spectrum needs the pulse backend");
+
+	const char* device = NULL;
+	if (lua_istable(L, 1)) {
+		lua_getfield(L, 1, "name");
+		device = luaL_checkstring(L, -1);
+		lua_pop(L, 1);
+	} else if (!lua_isnoneornil(L, 1)) {
+		device = luaL_checkstring(L, 1);
+	}
+
+	lua_Integer bands = 32, fps = 60, size = 2048, rate = 44100;
+	const char* window = "hann";
+
+	if (lua_istable(L, 2)) {
+		lua_getfield(L, 2, "bands");
+		if (!lua_isnil(L, -1)) bands = luaL_checkinteger(L, -1);
+		lua_getfield(L, 2, "fps");
+		if (!lua_isnil(L, -1)) fps = luaL_checkinteger(L, -1);
+		lua_getfield(L, 2, "size");
+		if (!lua_isnil(L, -1)) size = luaL_checkinteger(L, -1);
+		lua_getfield(L, 2, "rate");
+		if (!lua_isnil(L, -1)) rate = luaL_checkinteger(L, -1);
+		lua_getfield(L, 2, "window");
+		if (!lua_isnil(L, -1)) window = luaL_checkstring(L, -1);
+	}
+
+	luaL_argcheck(L, bands > 0 && bands <= LUA_PA_SPECTRUM_MAX_BANDS, 2, "bands must be between 1 and 256");
+	luaL_argcheck(L, fps > 0 && fps <= 240, 2, "fps must be between 1 and 240");
+	luaL_argcheck(L, size >= 64 && size <= 16384 && (size & (size - 1)) == 0, 2, "size must be a power of two between 64 and 16384");
+	luaL_argcheck(L, strcmp(window, "hann") == 0 || strcmp(window, "hamming") == 0
+		|| strcmp(window, "blackman") == 0 || strcmp(window, "none") == 0, 2, "window must be hann, hamming, blackman or none");
+	lua_pa_check_timeout(L, 2);
+
+	// Sinks are analysed through their monitor source
+	char source[512];
+	if (!device)
+		snprintf(source, sizeof(source), "@DEFAULT_MONITOR@");
+	else if (strlen(device) > 8 && strcmp(device + strlen(device) - 8, ".monitor") == 0)
+		snprintf(source, sizeof(source), "%s", device);
+	else
+		snprintf(source, sizeof(source), "%s.monitor", device);
+
+	lua_pa_spectrum_t** ud = (lua_pa_spectrum_t**)lua_newuserdata(L, sizeof(lua_pa_spectrum_t*));
+	*ud = NULL;
+	luaL_setmetatable(L, "lua_pa_spectrum");
+
+	lua_pa_spectrum_t* sp = calloc(1, sizeof(lua_pa_spectrum_t));
+	if (!sp) {
+		lua_pushnil(L);
+		lua_pushstring(L, "Memory allocation failed for spectrum analyzer");
+		return 2;
+	}
+
+	sp->fft_size = (unsigned int)size;
+	sp->bands = (unsigned int)bands;
+	sp->fps = (unsigned int)fps;
+	sp->capture.ss.format = PA_SAMPLE_FLOAT32NE;
+	sp->capture.ss.rate = (uint32_t)rate;
+	sp->capture.ss.channels = 1;
+	sp->capture.index = PA_INVALID_INDEX;
+	sp->capture.fd = -1;
+	sp->capture.capacity = 4096;
+	while (sp->capture.capacity < 4 * size * sizeof(float))
+		sp->capture.capacity <<= 1;
+	sp->capture.ring = malloc(sp->capture.capacity);
+	atomic_init(&sp->capture.head, 0);
+	atomic_init(&sp->capture.tail, 0);
+	atomic_init(&sp->capture.overruns, 0);
+	atomic_init(&sp->seq, 0);
+	atomic_init(&sp->running, 1);
+
+	if (!pa_sample_spec_valid(&sp->capture.ss) || !sp->capture.ring || spectrum_setup(sp, window) != 0) {
+		spectrum_free(sp);
+		lua_pushnil(L);
+		lua_pushstring(L, "Could not set up spectrum analyzer");
+		return 2;
+	}
+
+	// Fragments of one frame period keep the capture latency at the frame rate
+	pa_buffer_attr attr;
+	attr.maxlength = (uint32_t)-1;
+	attr.tlength = (uint32_t)-1;
+	attr.prebuf = (uint32_t)-1;
+	attr.minreq = (uint32_t)-1;
+	attr.fragsize = (uint32_t)pa_usec_to_bytes(PA_USEC_PER_SEC / fps, &sp->capture.ss);
+
+	const char* err = record_connect(&sp->capture, "Lua Pulseaudio spectrum", source, &attr, PA_STREAM_ADJUST_LATENCY, spectrum_read_cb, sp);
+	if (err) {
+		spectrum_free(sp);
+		lua_pushnil(L);
+		lua_pushstring(L, err);
+		return 2;
+	}
+
+	if (pthread_create(&sp->worker, NULL, spectrum_worker, sp) != 0) {
+		pa_threaded_mainloop_lock(pa_state->mainloop);
+		release_stream(sp->capture.stream);
+		pa_threaded_mainloop_unlock(pa_state->mainloop);
+		spectrum_free(sp);
+		lua_pushnil(L);
+		lua_pushstring(L, "Could not start spectrum worker");
+		return 2;
+	}
+
+	*ud = sp;
+	return 1;
+}
+
+// Copies the last published bands and returns their seq. The fence keeps the copy's loads ahead
+// of the re-check, an acquire load alone only orders what comes after it
+static unsigned int spectrum_read(lua_pa_spectrum_t* sp, float* bands) {
+	unsigned int seq;
+	do {
+		seq = atomic_load_explicit(&sp->seq, memory_order_acquire);
+		memcpy(bands, sp->out[seq & 1], sp->bands * sizeof(float));
+		atomic_thread_fence(memory_order_acquire);
+	} while (seq != atomic_load_explicit(&sp->seq, memory_order_relaxed));
+	return seq;
+}
+
+// Latest band magnitudes, fills and returns t when given to avoid a new table per frame
+static int lua_pa_spectrum_bands(lua_State* L) {
+	lua_pa_spectrum_t* sp = check_spectrum(L);
+
+	float bands[LUA_PA_SPECTRUM_MAX_BANDS];
+	unsigned int seq = spectrum_read(sp, bands);
+
+	if (lua_istable(L, 2))
+		lua_pushvalue(L, 2);
+	else
+		lua_createtable(L, (int)sp->bands, 0);
+
+	for (unsigned int b = 0; b < sp->bands; b++) {
+		lua_pushnumber(L, bands[b]);
+		lua_rawseti(L, -2, b + 1);
+	}
+
+	lua_pushinteger(L, seq);
+	return 2;
+}
+
+// Same as bands() but packed as native float32 in a string
+static int lua_pa_spectrum_raw(lua_State* L) {
+	lua_pa_spectrum_t* sp = check_spectrum(L);
+
+	float bands[LUA_PA_SPECTRUM_MAX_BANDS];
+	unsigned int seq = spectrum_read(sp, bands);
+
+	lua_pushlstring(L, (const char*)bands, sp->bands * sizeof(float));
+	lua_pushinteger(L, seq);
+	return 2;
+}
+
+static int lua_pa_spectrum_index(lua_State* L) {
+	lua_pa_spectrum_t* sp = check_spectrum(L);
+	lua_pushinteger(L, sp->capture.index);
+	return 1;
+}
+
+static int lua_pa_spectrum_close(lua_State* L) {
+	lua_pa_spectrum_t** ud = (lua_pa_spectrum_t**)luaL_checkudata(L, 1, "lua_pa_spectrum");
+	lua_pa_spectrum_t* sp = *ud;
+	if (!sp) return 0;
+
+	atomic_store_explicit(&sp->running, 0, memory_order_release);
+	pthread_join(sp->worker, NULL);
+
+	if (sp->capture.stream && pa_state) {
+		pa_threaded_mainloop_lock(pa_state->mainloop);
+		release_stream(sp->capture.stream);
+		pa_threaded_mainloop_unlock(pa_state->mainloop);
+	}
+
+	spectrum_free(sp);
+	*ud = NULL;
+
+	return 0;
+}
+
+static const struct luaL_Reg lua_pa_spectrum_methods[] = {
+	{"bands", lua_pa_spectrum_bands},
+	{"raw", lua_pa_spectrum_raw},
+	{"index", lua_pa_spectrum_index},
+	{"close", lua_pa_spectrum_close},
+	{ NULL, NULL },
+};
+
+static void latency_probe_write_cb(pa_stream* s, size_t nbytes, void* userdata __attribute__((unused))) {
+	void* data = NULL;
+	if (pa_stream_begin_write(s, &data, &nbytes) < 0 || !data) return;
+	memset(data, 0, nbytes);
+	pa_stream_write(s, data, nbytes, NULL, 0, PA_SEEK_RELATIVE);
+}
+
+static void latency_probe_read_cb(pa_stream* s, size_t nbytes __attribute__((unused)), void* userdata __attribute__((unused))) {
+	const void* data = NULL;
+	size_t n = 0;
+	while (pa_stream_readable_size(s) > 0 && pa_stream_peek(s, &data, &n) == 0 && n > 0)
+		pa_stream_drop(s);
+}
+
+static void latency_probe_update_cb(pa_stream* s, void* userdata) {
+	latency_probe_t* probe = (latency_probe_t*)userdata;
+
+	// A negative latency only says the stream is ahead of its clock, it is no sample
+	pa_usec_t usec = 0;
+	int negative = 0;
+	if (pa_stream_get_latency(s, &usec, &negative) == 0 && !negative) {
+		probe->total += usec;
+		if (usec > probe->max) probe->max = usec;
+		probe->samples++;
+	}
+
+	pa_threaded_mainloop_signal(pa_state->mainloop, 0);
+}
+
+// Measures the latency a client actually sees with a short lived stream on device
+static int lua_pa_measure_latency(lua_State* L) {
+	if (!pa_state) {
+		lua_pushstring(L, "PulseAudio not initialized.");
+		lua_error(L);
+	}
+
+	if (backend != &pulse_backend)
+		return luaL_error(L, "measure_latency needs the pulse backend");
+
+	const char* device = NULL;
+	if (lua_istable(L, 1)) {
+		lua_getfield(L, 1, "name");
+		device = luaL_checkstring(L, -1);
+		lua_pop(L, 1);
+	} else if (!lua_isnoneornil(L, 1)) {
+		device = luaL_checkstring(L, 1);
+	}
+
+	int record = 0;
+	lua_Integer samples = 5;
+	lua_Integer latency_ms = 20;
+	if (lua_istable(L, 2)) {
+		lua_getfield(L, 2, "source");
+		record = lua_toboolean(L, -1);
+		lua_getfield(L, 2, "samples");
+		if (!lua_isnil(L, -1)) samples = luaL_checkinteger(L, -1);
+		lua_getfield(L, 2, "latency_ms");
+		if (!lua_isnil(L, -1)) latency_ms = luaL_checkinteger(L, -1);
+		lua_pop(L, 3);
+	}
+	luaL_argcheck(L, samples > 0, 2, "samples must be positive");
+	lua_pa_check_timeout(L, 2);
+
+	pa_sample_spec ss;
+	ss.format = PA_SAMPLE_S16LE;
+	ss.rate = 48000;
+	ss.channels = 2;
+
+	pa_buffer_attr attr;
+	attr.maxlength = (uint32_t)-1;
+	attr.tlength = (uint32_t)pa_usec_to_bytes(latency_ms * PA_USEC_PER_MSEC, &ss);
+	attr.prebuf = (uint32_t)-1;
+	attr.minreq = (uint32_t)-1;
+	attr.fragsize = attr.tlength;
+
+	latency_probe_t probe = { 0, 0, 0 };
+	pa_stream_flags_t flags = PA_STREAM_INTERPOLATE_TIMING | PA_STREAM_AUTO_TIMING_UPDATE | PA_STREAM_ADJUST_LATENCY;
+
+	pa_threaded_mainloop_lock(pa_state->mainloop);
+
+	if (pulse_ready( ) < 0) {
+		pa_threaded_mainloop_unlock(pa_state->mainloop);
+		return lua_pa_push_timeout(L);
+	}
+
+	pa_stream* s = pa_stream_new(pa_state->ctx, "Lua Pulseaudio latency probe", &ss, NULL);
+	if (!s) {
+		pa_threaded_mainloop_unlock(pa_state->mainloop);
+		lua_pushnil(L);
+		lua_pushstring(L, pa_strerror(pa_context_errno(pa_state->ctx)));
+		return 2;
+	}
+
+	pa_stream_set_state_callback(s, stream_state_cb, NULL);
+	pa_stream_set_latency_update_callback(s, latency_probe_update_cb, &probe);
+	if (record)
+		pa_stream_set_read_callback(s, latency_probe_read_cb, NULL);
+	else
+		pa_stream_set_write_callback(s, latency_probe_write_cb, NULL);
+
+	int r = record
+		? pa_stream_connect_record(s, device, &attr, flags)
+		: pa_stream_connect_playback(s, device, &attr, flags, NULL, NULL);
+
+	int expired;
+	pa_time_event* deadline = deadline_start(&expired);
+	if (r == 0) {
+		while (!expired && pa_stream_get_state(s) == PA_STREAM_CREATING)
+			pa_threaded_mainloop_wait(pa_state->mainloop);
+
+		while (!expired && pa_stream_get_state(s) == PA_STREAM_READY && probe.samples < samples)
+			pa_threaded_mainloop_wait(pa_state->mainloop);
+	}
+	int timed_out = deadline_stop(deadline, expired) < 0;
+
+	const char* err = probe.samples >= samples ? NULL : timed_out ? "timeout" : pa_strerror(pa_context_errno(pa_state->ctx));
+
+	pa_stream_set_latency_update_callback(s, NULL, NULL);
+	release_stream(s);
+	pa_threaded_mainloop_unlock(pa_state->mainloop);
+
+	if (err) {
+		lua_pushnil(L);
+		lua_pushstring(L, err);
+		return 2;
+	}
+
+	lua_pushinteger(L, (lua_Integer)(probe.total / probe.samples));
+	lua_pushinteger(L, (lua_Integer)probe.max);
+	return 2;
+}
+
+static void scene_free(lua_pa_scene_t* scene) {
+	free(scene->default_sink);
+	free(scene->default_source);
+	for (size_t i = 0; i < scene->num_sinks; i++)
+		free(scene->sinks[i].name);
+	for (size_t i = 0; i < scene->num_sources; i++)
+		free(scene->sources[i].name);
+	for (size_t i = 0; i < scene->num_cards; i++) {
+		free(scene->cards[i].name);
+		free(scene->cards[i].profile);
+	}
+	free(scene->sinks);
+	free(scene->sources);
+	free(scene->cards);
+	memset(scene, 0, sizeof(*scene));
+}
+
+static int scene_add_device(scene_device_t** devices, size_t* count, const char* name, int volume, int mute) {
+	scene_device_t* grown = realloc(*devices, (*count + 1) * sizeof(scene_device_t));
+	if (!grown) return -1;
+	*devices = grown;
+	grown[*count].name = strdup(name ? name : "");
+	grown[*count].volume = volume;
+	grown[*count].mute = mute;
+	(*count)++;
+	return 0;
+}
+
+static int scene_add_card(lua_pa_scene_t* scene, const char* name, const char* profile) {
+	scene_card_t* grown = realloc(scene->cards, (scene->num_cards + 1) * sizeof(scene_card_t));
+	if (!grown) return -1;
+	scene->cards = grown;
+	grown[scene->num_cards].name = strdup(name ? name : "");
+	grown[scene->num_cards].profile = strdup(profile ? profile : "");
+	scene->num_cards++;
+	return 0;
+}
+
+static scene_device_t* scene_find_device(scene_device_t* devices, size_t count, const char* name) {
+	for (size_t i = 0; i < count; i++)
+		if (strcmp(devices[i].name, name) == 0)
+			return &devices[i];
+	return NULL;
+}
+
+static scene_card_t* scene_find_card(lua_pa_scene_t* scene, const char* name) {
+	for (size_t i = 0; i < scene->num_cards; i++)
+		if (strcmp(scene->cards[i].name, name) == 0)
+			return &scene->cards[i];
+	return NULL;
+}
+
+static void scene_server_info_cb(pa_context* c __attribute__((unused)), const pa_server_info* info, void* userdata) {
+	lua_pa_scene_t* scene = (lua_pa_scene_t*)userdata;
+
+	if (info) {
+		scene->default_sink = info->default_sink_name ? strdup(info->default_sink_name) : NULL;
+		scene->default_source = info->default_source_name ? strdup(info->default_source_name) : NULL;
+	}
+
+	pa_threaded_mainloop_signal(pa_state->mainloop, 0);
+}
+
+static void scene_sink_cb(pa_context* c __attribute__((unused)), const pa_sink_info* info, int eol, void* userdata) {
+	lua_pa_scene_t* scene = (lua_pa_scene_t*)userdata;
+
+	if (!eol && info)
+		scene_add_device(&scene->sinks, &scene->num_sinks, info->name, cvolume_to_percent(&info->volume), info->mute);
+
+	pa_threaded_mainloop_signal(pa_state->mainloop, 0);
+}
+
+static void scene_source_cb(pa_context* c __attribute__((unused)), const pa_source_info* info, int eol, void* userdata) {
+	lua_pa_scene_t* scene = (lua_pa_scene_t*)userdata;
+
+	if (!eol && info)
+		scene_add_device(&scene->sources, &scene->num_sources, info->name, cvolume_to_percent(&info->volume), info->mute);
+
+	pa_threaded_mainloop_signal(pa_state->mainloop, 0);
+}
+
+static void scene_card_cb(pa_context* c __attribute__((unused)), const pa_card_info* info, int eol, void* userdata) {
+	lua_pa_scene_t* scene = (lua_pa_scene_t*)userdata;
+
+	if (!eol && info && info->active_profile2)
+		scene_add_card(scene, info->name, info->active_profile2->name);
+
+	pa_threaded_mainloop_signal(pa_state->mainloop, 0);
+}
+
+// Issues the server info, sink, source and card queries together and waits for all of them,
+// returns -1 on timeout with whatever arrived until then in scene
+static int scene_capture(lua_pa_scene_t* scene) {
+	memset(scene, 0, sizeof(*scene));
+
+	pa_threaded_mainloop_lock(pa_state->mainloop);
+
+	if (pulse_ready( ) < 0) {
+		pa_threaded_mainloop_unlock(pa_state->mainloop);
+		return -1;
+	}
+
+	pa_operation* ops[] = {
+		pa_context_get_server_info(pa_state->ctx, scene_server_info_cb, scene),
+		pa_context_get_sink_info_list(pa_state->ctx, scene_sink_cb, scene),
+		pa_context_get_source_info_list(pa_state->ctx, scene_source_cb, scene),
+		pa_context_get_card_info_list(pa_state->ctx, scene_card_cb, scene),
+	};
+	int r = wait_all_operations(ops, sizeof(ops) / sizeof(ops[0]));
+
+	pa_threaded_mainloop_unlock(pa_state->mainloop);
+
+	return r;
+}
+
+static void scene_push_devices(lua_State* L, const scene_device_t* devices, size_t count) {
+	lua_createtable(L, 0, count);
+	for (size_t i = 0; i < count; i++) {
+		lua_createtable(L, 0, 2);
+		lua_pushinteger(L, devices[i].volume);
+		lua_setfield(L, -2, "volume");
+		lua_pushboolean(L, devices[i].mute);
+		lua_setfield(L, -2, "mute");
+		lua_setfield(L, -2, devices[i].name);
+	}
+}
+
+// Reads {name = {volume = n, mute = b}}, either value may be left out and is then not touched
+// Returns -1 on a malformed entry, the caller owns what was added so far and raises
+static int scene_check_devices(lua_State* L, int idx, const char* key, scene_device_t** devices, size_t* count) {
+	lua_getfield(L, idx, key);
+	if (lua_istable(L, -1)) {
+		lua_pushnil(L);
+		while (lua_next(L, -2) != 0) {
+			if (lua_type(L, -2) != LUA_TSTRING || !lua_istable(L, -1)) {
+				lua_pop(L, 3);
+				return -1;
+			}
+
+			lua_getfield(L, -1, "volume");
+			int volume = -1;
+			if (!lua_isnil(L, -1)) {
+				if (!lua_isnumber(L, -1)) {
+					lua_pop(L, 4);
+					return -1;
+				}
+				lua_Integer v = lua_tointeger(L, -1);
+				volume = v < 0 ? 0 : v > 100 ? 100 : (int)v;
+			}
+			lua_pop(L, 1);
+
+			lua_getfield(L, -1, "mute");
+			int mute = lua_isnil(L, -1) ? -1 : lua_toboolean(L, -1);
+			lua_pop(L, 1);
+
+			scene_add_device(devices, count, lua_tostring(L, -2), volume, mute);
+			lua_pop(L, 1);
+		}
+	}
+	lua_pop(L, 1);
+	return 0;
+}
+
+// Returns NULL or the error to raise once the caller freed the partly built scene
+static const char* scene_check(lua_State* L, int idx, lua_pa_scene_t* scene) {
+	memset(scene, 0, sizeof(*scene));
+
+	lua_getfield(L, idx, "default_sink");
+	if (lua_isstring(L, -1))
+		scene->default_sink = strdup(lua_tostring(L, -1));
+	lua_pop(L, 1);
+
+	lua_getfield(L, idx, "default_source");
+	if (lua_isstring(L, -1))
+		scene->default_source = strdup(lua_tostring(L, -1));
+	lua_pop(L, 1);
+
+	if (scene_check_devices(L, idx, "sinks", &scene->sinks, &scene->num_sinks) < 0)
+		return "scene.sinks must map device names to {volume, mute} tables";
+	if (scene_check_devices(L, idx, "sources", &scene->sources, &scene->num_sources) < 0)
+		return "scene.sources must map device names to {volume, mute} tables";
+
+	lua_getfield(L, idx, "cards");
+	if (lua_istable(L, -1)) {
+		lua_pushnil(L);
+		while (lua_next(L, -2) != 0) {
+			if (lua_type(L, -2) != LUA_TSTRING || lua_type(L, -1) != LUA_TSTRING) {
+				lua_pop(L, 3);
+				return "scene.cards must map card names to profile names";
+			}
+			scene_add_card(scene, lua_tostring(L, -2), lua_tostring(L, -1));
+			lua_pop(L, 1);
+		}
+	}
+	lua_pop(L, 1);
+	return NULL;
+}
+
+static size_t scene_diff_cards(lua_pa_scene_t* target, lua_pa_scene_t* current, scene_item_t* items) {
+	size_t n = 0;
+
+	for (size_t i = 0; i < target->num_cards; i++) {
+		scene_card_t* want = &target->cards[i];
+		scene_card_t* have = scene_find_card(current, want->name);
+		if (have && strcmp(have->profile, want->profile) == 0) continue;
+
+		items[n++] = (scene_item_t){ .kind = SCENE_CARD_PROFILE, .name = want->name, .text = want->profile,
+			.old_text = have ? have->profile : NULL, .missing = !have };
+	}
+
+	return n;
+}
+
+static size_t scene_diff_devices(scene_device_t* want, size_t count, scene_device_t* devices, size_t num_devices, int volume_kind, int mute_kind, scene_item_t* items) {
+	size_t n = 0;
+
+	for (size_t i = 0; i < count; i++) {
+		scene_device_t* have = scene_find_device(devices, num_devices, want[i].name);
+
+		if (want[i].volume >= 0 && (!have || have->volume != want[i].volume))
+			items[n++] = (scene_item_t){ .kind = volume_kind, .name = want[i].name, .value = want[i].volume,
+				.old_value = have ? have->volume : 0, .missing = !have };
+
+		if (want[i].mute >= 0 && (!have || !have->mute != !want[i].mute))
+			items[n++] = (scene_item_t){ .kind = mute_kind, .name = want[i].name, .value = want[i].mute,
+				.old_value = have ? have->mute : 0, .missing = !have };
+	}
+
+	return n;
+}
+
+static size_t scene_diff_default(const char* want, const char* have, scene_device_t* devices, size_t num_devices, int kind, scene_item_t* items) {
+	if (!want || (have && strcmp(want, have) == 0)) return 0;
+
+	items[0] = (scene_item_t){ .kind = kind, .name = want, .text = want, .old_text = have,
+		.missing = !scene_find_device(devices, num_devices, want) };
+	return 1;
+}
+
+static void scene_success_cb(pa_context* c __attribute__((unused)), int success, void* userdata) {
+	*(int*)userdata = success;
+	pa_threaded_mainloop_signal(pa_state->mainloop, 0);
+}
+
+// Sends every item back-to-back and waits once, with undo set the successful items are reverted instead
+static int scene_issue(scene_item_t* items, size_t count, int undo) {
+	if (count == 0) return 0;
+
+	pa_operation** ops = calloc(count, sizeof(pa_operation*));
+	if (!ops) return 0;
+
+	pa_threaded_mainloop_lock(pa_state->mainloop);
+
+	for (size_t i = 0; i < count; i++) {
+		scene_item_t* item = &items[i];
+		if (undo ? !item->success : item->missing) continue;
+		if (undo && (item->kind == SCENE_CARD_PROFILE || item->kind >= SCENE_DEFAULT_SINK) && !item->old_text) continue;
+
+		int value = undo ? item->old_value : item->value;
+		const char* text = undo ? item->old_text : item->text;
+		int* result = undo ? &item->undone : &item->success;
+		pa_cvolume cvolume;
+
+		switch (item->kind) {
+		case SCENE_CARD_PROFILE:
+			ops[i] = pa_context_set_card_profile_by_name(pa_state->ctx, item->name, text, scene_success_cb, result);
+			break;
+		case SCENE_SINK_VOLUME:
+			percent_to_cvolume(value, &cvolume);
+			ops[i] = pa_context_set_sink_volume_by_name(pa_state->ctx, item->name, &cvolume, scene_success_cb, result);
+			break;
+		case SCENE_SINK_MUTE:
+			ops[i] = pa_context_set_sink_mute_by_name(pa_state->ctx, item->name, value, scene_success_cb, result);
+			break;
+		case SCENE_SOURCE_VOLUME:
+			percent_to_cvolume(value, &cvolume);
+			ops[i] = pa_context_set_source_volume_by_name(pa_state->ctx, item->name, &cvolume, scene_success_cb, result);
+			break;
+		case SCENE_SOURCE_MUTE:
+			ops[i] = pa_context_set_source_mute_by_name(pa_state->ctx, item->name, value, scene_success_cb, result);
+			break;
+		case SCENE_DEFAULT_SINK:
+			ops[i] = pa_context_set_default_sink(pa_state->ctx, text, scene_success_cb, result);
+			break;
+		case SCENE_DEFAULT_SOURCE:
+			ops[i] = pa_context_set_default_source(pa_state->ctx, text, scene_success_cb, result);
+			break;
+		}
+	}
+
+	int r = wait_all_operations(ops, count);
+
+	pa_threaded_mainloop_unlock(pa_state->mainloop);
+	free(ops);
+
+	return r;
+}
+
+static const char* const scene_item_kinds[] = {
+	"card_profile", "sink_volume", "sink_mute", "source_volume", "source_mute", "default_sink", "default_source",
+};
+
+static void scene_push_results(lua_State* L, const scene_item_t* items, size_t count) {
+	lua_createtable(L, count, 0);
+	for (size_t i = 0; i < count; i++) {
+		const scene_item_t* item = &items[i];
+
+		lua_createtable(L, 0, 5);
+		lua_pushstring(L, scene_item_kinds[item->kind]);
+		lua_setfield(L, -2, "kind");
+		lua_pushstring(L, item->name);
+		lua_setfield(L, -2, "name");
+
+		switch (item->kind) {
+		case SCENE_CARD_PROFILE:
+			lua_pushstring(L, item->text);
+			break;
+		case SCENE_SINK_MUTE:
+		case SCENE_SOURCE_MUTE:
+			lua_pushboolean(L, item->value);
+			break;
+		case SCENE_SINK_VOLUME:
+		case SCENE_SOURCE_VOLUME:
+			lua_pushinteger(L, item->value);
+			break;
+		default:
+			lua_pushstring(L, item->text);
+			break;
+		}
+		lua_setfield(L, -2, "value");
+
+		lua_pushboolean(L, item->success);
+		lua_setfield(L, -2, "ok");
+		if (item->missing) {
+			lua_pushstring(L, "no such device");
+			lua_setfield(L, -2, "error");
+		}
+		if (item->undone) {
+			lua_pushboolean(L, 1);
+			lua_setfield(L, -2, "rolled_back");
+		}
+
+		lua_rawseti(L, -2, i + 1);
+	}
+}
+
+static int scene_all_succeeded(const scene_item_t* items, size_t count) {
+	for (size_t i = 0; i < count; i++)
+		if (!items[i].success) return 0;
+	return 1;
+}
+
+static int lua_pa_capture_scene(lua_State* L) {
+	if (!pa_state) {
+		lua_pushstring(L, "PulseAudio not initialized.");
+		lua_error(L);
+	}
+
+	if (backend != &pulse_backend)
+		return luaL_error(L, "capture_scene needs the pulse backend");
+
+	lua_pa_check_timeout(L, 1);
+
+	lua_pa_scene_t scene;
+	if (scene_capture(&scene) < 0) {
+		scene_free(&scene);
+		return lua_pa_push_timeout(L);
+	}
+
+	lua_createtable(L, 0, 5);
+	if (scene.default_sink) {
+		lua_pushstring(L, scene.default_sink);
+		lua_setfield(L, -2, "default_sink");
+	}
+	if (scene.default_source) {
+		lua_pushstring(L, scene.default_source);
+		lua_setfield(L, -2, "default_source");
+	}
+
+	scene_push_devices(L, scene.sinks, scene.num_sinks);
+	lua_setfield(L, -2, "sinks");
+	scene_push_devices(L, scene.sources, scene.num_sources);
+	lua_setfield(L, -2, "sources");
+
+	lua_createtable(L, 0, scene.num_cards);
+	for (size_t i = 0; i < scene.num_cards; i++) {
+		lua_pushstring(L, scene.cards[i].profile);
+		lua_setfield(L, -2, scene.cards[i].name);
+	}
+	lua_setfield(L, -2, "cards");
+
+	scene_free(&scene);
+	return 1;
+}
+
+static int lua_pa_apply_scene(lua_State* L) {
+	if (!pa_state) {
+		lua_pushstring(L, "PulseAudio not initialized.");
+		lua_error(L);
+	}
+
+	if (backend != &pulse_backend)
+		return luaL_error(L, "apply_scene needs the pulse backend");
+
+	luaL_checktype(L, 1, LUA_TTABLE);
+
+	int rollback = 0;
+	if (lua_istable(L, 2)) {
+		lua_getfield(L, 2, "rollback");
+		rollback = lua_toboolean(L, -1);
+		lua_pop(L, 1);
+	}
+	lua_pa_check_timeout(L, 2);
+
+	lua_pa_scene_t target, before, after;
+	memset(&after, 0, sizeof(after));
+	const char* err = scene_check(L, 1, &target);
+	if (err) {
+		scene_free(&target);
+		return luaL_error(L, "%s", err);
+	}
+	if (scene_capture(&before) < 0) {
+		scene_free(&target);
+		scene_free(&before);
+		return lua_pa_push_timeout(L);
+	}
+
+	scene_item_t* items = calloc(2 + target.num_cards + 2 * (target.num_sinks + target.num_sources), sizeof(scene_item_t));
+	if (!items) {
+		scene_free(&target);
+		scene_free(&before);
+		lua_pushnil(L);
+		lua_pushstring(L, "out of memory");
+		return 2;
+	}
+
+	// Profile switches create and remove devices, so they go first and the rest is diffed against the result
+	lua_pa_scene_t* current = &before;
+	size_t num_cards = scene_diff_cards(&target, &before, items);
+	int timed_out = scene_issue(items, num_cards, 0) < 0;
+
+	size_t count = num_cards;
+	if (!timed_out && num_cards > 0 && (!rollback || scene_all_succeeded(items, num_cards))) {
+		timed_out = scene_capture(&after) < 0;
+		current = &after;
+	}
+
+	if (!timed_out && (!rollback || scene_all_succeeded(items, num_cards))) {
+		count += scene_diff_devices(target.sinks, target.num_sinks, current->sinks, current->num_sinks,
+			SCENE_SINK_VOLUME, SCENE_SINK_MUTE, items + count);
+		count += scene_diff_devices(target.sources, target.num_sources, current->sources, current->num_sources,
+			SCENE_SOURCE_VOLUME, SCENE_SOURCE_MUTE, items + count);
+		count += scene_diff_default(target.default_sink, current->default_sink, current->sinks, current->num_sinks,
+			SCENE_DEFAULT_SINK, items + count);
+		count += scene_diff_default(target.default_source, current->default_source, current->sources, current->num_sources,
+			SCENE_DEFAULT_SOURCE, items + count);
+
+		timed_out = scene_issue(items + num_cards, count - num_cards, 0) < 0;
+	}
+
+	int ok = !timed_out && scene_all_succeeded(items, count);
+	if (!ok && rollback) {
+		scene_issue(items + num_cards, count - num_cards, 1);
+		scene_issue(items, num_cards, 1);
+	}
+
+	// A timeout reports nil, "timeout" and the results of what got through before it
+	if (timed_out) {
+		lua_pushnil(L);
+		lua_pushstring(L, "timeout");
+	} else {
+		lua_pushboolean(L, ok);
+	}
+	scene_push_results(L, items, count);
+
+	free(items);
+	scene_free(&target);
+	scene_free(&before);
+	scene_free(&after);
+	return timed_out ? 3 : 2;
+}
+
+static void snapshot_free(lua_pa_snapshot_t* snap) {
+	free(snap->server_name);
+	free(snap->server_version);
+	free(snap->default_sink);
+	free(snap->default_source);
+	free(snap->sinks.records);
+	free(snap->sources.records);
+	for (size_t i = 0; i < snap->num_cards; i++) {
+		free(snap->cards[i].name);
+		free(snap->cards[i].driver);
+		free(snap->cards[i].active_profile);
+		for (size_t j = 0; j < snap->cards[i].num_profiles; j++)
+			free(snap->cards[i].profiles[j]);
+		free(snap->cards[i].profiles);
+	}
+	free(snap->cards);
+	for (size_t i = 0; i < snap->num_sink_inputs; i++) {
+		free(snap->sink_inputs[i].name);
+		free(snap->sink_inputs[i].application);
+		free(snap->sink_inputs[i].role);
+	}
+	free(snap->sink_inputs);
+	for (size_t i = 0; i < snap->num_source_outputs; i++) {
+		free(snap->source_outputs[i].name);
+		free(snap->source_outputs[i].application);
+		free(snap->source_outputs[i].role);
+	}
+	free(snap->source_outputs);
+	memset(snap, 0, sizeof(*snap));
+}
+
+static char* snapshot_strdup(const char* s) {
+	return s ? strdup(s) : NULL;
+}
+
+static void snapshot_server_info_cb(pa_context* c __attribute__((unused)), const pa_server_info* info, void* userdata) {
+	lua_pa_snapshot_t* snap = (lua_pa_snapshot_t*)userdata;
+
+	if (info) {
+		snap->server_name = snapshot_strdup(info->server_name);
+		snap->server_version = snapshot_strdup(info->server_version);
+		snap->default_sink = snapshot_strdup(info->default_sink_name);
+		snap->default_source = snapshot_strdup(info->default_source_name);
+	}
+
+	pa_threaded_mainloop_signal(pa_state->mainloop, 0);
+}
+
+static void snapshot_card_cb(pa_context* c __attribute__((unused)), const pa_card_info* info, int eol, void* userdata) {
+	lua_pa_snapshot_t* snap = (lua_pa_snapshot_t*)userdata;
+
+	if (!eol && info) {
+		snapshot_card_t* grown = realloc(snap->cards, (snap->num_cards + 1) * sizeof(snapshot_card_t));
+		if (grown) {
+			snap->cards = grown;
+			snapshot_card_t* card = &grown[snap->num_cards++];
+			card->index = info->index;
+			card->name = snapshot_strdup(info->name);
+			card->driver = snapshot_strdup(info->driver);
+			card->active_profile = info->active_profile2 ? snapshot_strdup(info->active_profile2->name) : NULL;
+			card->num_profiles = 0;
+			card->profiles = info->n_profiles && info->profiles2 ? calloc(info->n_profiles, sizeof(char*)) : NULL;
+			for (uint32_t i = 0; card->profiles && i < info->n_profiles; i++)
+				card->profiles[card->num_profiles++] = snapshot_strdup(info->profiles2[i]->name);
+		}
+	}
+
+	pa_threaded_mainloop_signal(pa_state->mainloop, 0);
+}
+
+static void snapshot_add_stream(snapshot_stream_t** streams, size_t* count, uint32_t index, uint32_t device, const char* name, pa_proplist* proplist, const pa_cvolume* volume, int mute) {
+	snapshot_stream_t* grown = realloc(*streams, (*count + 1) * sizeof(snapshot_stream_t));
+	if (!grown) return;
+	*streams = grown;
+
+	snapshot_stream_t* stream = &grown[(*count)++];
+	stream->index = index;
+	stream->device = device;
+	stream->name = snapshot_strdup(name);
+	stream->application = proplist ? snapshot_strdup(pa_proplist_gets(proplist, PA_PROP_APPLICATION_NAME)) : NULL;
+	stream->role = proplist ? snapshot_strdup(pa_proplist_gets(proplist, PA_PROP_MEDIA_ROLE)) : NULL;
+	stream->volume = *volume;
+	stream->mute = mute;
+}
+
+static void snapshot_sink_input_cb(pa_context* c __attribute__((unused)), const pa_sink_input_info* info, int eol, void* userdata) {
+	lua_pa_snapshot_t* snap = (lua_pa_snapshot_t*)userdata;
+
+	if (!eol && info)
+		snapshot_add_stream(&snap->sink_inputs, &snap->num_sink_inputs, info->index, info->sink, info->name, info->proplist, &info->volume, info->mute);
+
+	pa_threaded_mainloop_signal(pa_state->mainloop, 0);
+}
+
+static void snapshot_source_output_cb(pa_context* c __attribute__((unused)), const pa_source_output_info* info, int eol, void* userdata) {
+	lua_pa_snapshot_t* snap = (lua_pa_snapshot_t*)userdata;
+
+	if (!eol && info)
+		snapshot_add_stream(&snap->source_outputs, &snap->num_source_outputs, info->index, info->source, info->name, info->proplist, &info->volume, info->mute);
+
+	pa_threaded_mainloop_signal(pa_state->mainloop, 0);
+}
+
+// Issues every query before the first wait, so the whole state costs about one round trip.
+// Backends without cards or streams answer from their cache and leave those empty
+static int snapshot_collect(lua_pa_snapshot_t* snap) {
+	memset(snap, 0, sizeof(*snap));
+	list_query_defaults(&snap->sinks.query);
+	list_query_defaults(&snap->sources.query);
+	snap->sources.source = 1;
+
+	pa_threaded_mainloop_lock(pa_state->mainloop);
+
+	int r = 0;
+	if (backend == &pulse_backend && pulse_ready( ) < 0) {
+		r = -1;
+	} else if (backend == &pulse_backend) {
+		pa_operation* ops[] = {
+			pa_context_get_server_info(pa_state->ctx, snapshot_server_info_cb, snap),
+			pa_context_get_sink_info_list(pa_state->ctx, iter_sink_cb, &snap->sinks),
+			pa_context_get_source_info_list(pa_state->ctx, iter_source_cb, &snap->sources),
+			pa_context_get_card_info_list(pa_state->ctx, snapshot_card_cb, snap),
+			pa_context_get_sink_input_info_list(pa_state->ctx, snapshot_sink_input_cb, snap),
+			pa_context_get_source_output_info_list(pa_state->ctx, snapshot_source_output_cb, snap),
+		};
+		r = wait_all_operations(ops, sizeof(ops) / sizeof(ops[0]));
+	} else if (backend->get_server(snapshot_server_info_cb, snap) < 0
+		|| backend->list_sinks(iter_sink_cb, &snap->sinks) < 0
+		|| backend->list_sources(iter_source_cb, &snap->sources) < 0) {
+		r = -1;
+	}
+
+	pa_threaded_mainloop_unlock(pa_state->mainloop);
+
+	return r;
+}
+
+// Pushes the devices as an array and stores the one named default_name in the table at result
+static void snapshot_push_devices(lua_State* L, int result, const device_iter_t* devices, const char* default_name, const char* default_key) {
+	lua_createtable(L, (int)devices->count, 0);
+	for (size_t i = 0; i < devices->count; i++) {
+		device_record_push(L, &devices->records[i], devices->source, LUA_PA_FIELD_ALL);
+		if (default_name && strcmp(devices->records[i].name, default_name) == 0) {
+			lua_pushvalue(L, -1);
+			lua_setfield(L, result, default_key);
+		}
+		lua_rawseti(L, -2, (lua_Integer)i + 1);
+	}
+}
+
+static void snapshot_push_streams(lua_State* L, const snapshot_stream_t* streams, size_t count, const char* device_key) {
+	lua_createtable(L, (int)count, 0);
+	for (size_t i = 0; i < count; i++) {
+		const snapshot_stream_t* stream = &streams[i];
+
+		lua_createtable(L, 0, 7);
+		lua_pushinteger(L, stream->index);
+		lua_setfield(L, -2, "index");
+		lua_pushinteger(L, stream->device);
+		lua_setfield(L, -2, device_key);
+		if (stream->name) {
+			lua_pushstring(L, stream->name);
+			lua_setfield(L, -2, "name");
+		}
+		if (stream->application) {
+			lua_pushstring(L, stream->application);
+			lua_setfield(L, -2, "application");
+		}
+		if (stream->role) {
+			lua_pushstring(L, stream->role);
+			lua_setfield(L, -2, "role");
+		}
+		lua_pushinteger(L, cvolume_to_percent(&stream->volume));
+		lua_setfield(L, -2, "volume");
+		lua_pushboolean(L, stream->mute);
+		lua_setfield(L, -2, "mute");
+
+		lua_rawseti(L, -2, (lua_Integer)i + 1);
+	}
+}
+
+static int lua_pa_snapshot(lua_State* L) {
+	if (!pa_state) {
+		lua_pushstring(L, "PulseAudio not initialized.");
+		lua_error(L);
+	}
+
+	lua_pa_check_timeout(L, 1);
+
+	lua_pa_snapshot_t snap;
+	if (snapshot_collect(&snap) < 0) {
+		snapshot_free(&snap);
+		return lua_pa_push_timeout(L);
+	}
+
+	lua_createtable(L, 0, 8);
+	int result = lua_gettop(L);
+
+	lua_createtable(L, 0, 4);
+	if (snap.server_name) {
+		lua_pushstring(L, snap.server_name);
+		lua_setfield(L, -2, "name");
+	}
+	if (snap.server_version) {
+		lua_pushstring(L, snap.server_version);
+		lua_setfield(L, -2, "version");
+	}
+	if (snap.default_sink) {
+		lua_pushstring(L, snap.default_sink);
+		lua_setfield(L, -2, "default_sink");
+	}
+	if (snap.default_source) {
+		lua_pushstring(L, snap.default_source);
+		lua_setfield(L, -2, "default_source");
+	}
+	lua_setfield(L, result, "server");
+
+	snapshot_push_devices(L, result, &snap.sinks, snap.default_sink, "default_sink");
+	lua_setfield(L, result, "sinks");
+	snapshot_push_devices(L, result, &snap.sources, snap.default_source, "default_source");
+	lua_setfield(L, result, "sources");
+
+	lua_createtable(L, (int)snap.num_cards, 0);
+	for (size_t i = 0; i < snap.num_cards; i++) {
+		const snapshot_card_t* card = &snap.cards[i];
+
+		lua_createtable(L, 0, 5);
+		lua_pushinteger(L, card->index);
+		lua_setfield(L, -2, "index");
+		if (card->name) {
+			lua_pushstring(L, card->name);
+			lua_setfield(L, -2, "name");
+		}
+		if (card->driver) {
+			lua_pushstring(L, card->driver);
+			lua_setfield(L, -2, "driver");
+		}
+		if (card->active_profile) {
+			lua_pushstring(L, card->active_profile);
+			lua_setfield(L, -2, "active_profile");
+		}
+		lua_createtable(L, (int)card->num_profiles, 0);
+		for (size_t j = 0; j < card->num_profiles; j++) {
+			lua_pushstring(L, card->profiles[j]);
+			lua_rawseti(L, -2, (lua_Integer)j + 1);
+		}
+		lua_setfield(L, -2, "profiles");
+
+		lua_rawseti(L, -2, (lua_Integer)i + 1);
+	}
+	lua_setfield(L, result, "cards");
+
+	snapshot_push_streams(L, snap.sink_inputs, snap.num_sink_inputs, "sink");
+	lua_setfield(L, result, "sink_inputs");
+	snapshot_push_streams(L, snap.source_outputs, snap.num_source_outputs, "source");
+	lua_setfield(L, result, "source_outputs");
+
+	snapshot_free(&snap);
+	return 1;
+}
+
+static int pa_init( ) {
+	pa_state = (lua_pa_state*)malloc(sizeof(lua_pa_state));
+
+	pa_state->mainloop = pa_threaded_mainloop_new( );
+	if (!pa_state->mainloop) {
+		free(pa_state);
+		pa_state = NULL;
+		return -1;
+	}
+
+	pa_state->ctx = pa_context_new(pa_threaded_mainloop_get_api(pa_state->mainloop), "Lua Pulseaudio");
+	if (!pa_state->ctx) {
+		pa_threaded_mainloop_free(pa_state->mainloop);
+		free(pa_state);
+		pa_state = NULL;
+		return -1;
+	}
+
+	pthread_mutex_init(&pa_state->mutex, NULL);
+
+	pa_context_set_state_callback(pa_state->ctx, context_state_cb, NULL);
+
+	if (pa_context_connect(pa_state->ctx, NULL, PA_CONTEXT_NOFAIL, NULL) < 0) {
+		pa_context_unref(pa_state->ctx);
+		pa_threaded_mainloop_free(pa_state->mainloop);
+		free(pa_state);
+		pa_state = NULL;
+	}
+
+	pa_threaded_mainloop_lock(pa_state->mainloop);
+	pa_threaded_mainloop_start(pa_state->mainloop);
+
+	// Getters answer from the warm cache meanwhile, warm_sync() takes over once the context is ready
+	if (warm.map) {
+		pa_threaded_mainloop_unlock(pa_state->mainloop);
+		return 0;
+	}
+
+	pa_threaded_mainloop_wait(pa_state->mainloop);
+
+	if (pa_context_get_state(pa_state->ctx) != PA_CONTEXT_READY)	return 0;
+
+	pa_threaded_mainloop_unlock(pa_state->mainloop);
+
+	return 0;
+}
+
+static int pulse_subscribe( ) {
+	if (warm.map) return 0;
+
+	pa_threaded_mainloop_lock(pa_state->mainloop);
+	wait_operation(pa_context_subscribe(pa_state->ctx, PA_SUBSCRIPTION_MASK_ALL, lua_pa_successful_callback, NULL));
+
+	pa_context_set_subscribe_callback(pa_state->ctx, lua_pa_subscribe_cb, NULL);
+	pa_threaded_mainloop_unlock(pa_state->mainloop);
+
+	return 0;
+}
+
+static int pulse_list_sinks(pa_sink_info_cb_t cb, void* userdata) {
+	if (pulse_ready( ) < 0) return -1;
+
+	return wait_operation(pa_context_get_sink_info_list(pa_state->ctx, cb, userdata));
+}
+
+static int pulse_list_sources(pa_source_info_cb_t cb, void* userdata) {
+	if (pulse_ready( ) < 0) return -1;
+
+	return wait_operation(pa_context_get_source_info_list(pa_state->ctx, cb, userdata));
+}
+
+static int pulse_get_sink(const char* name, pa_sink_info_cb_t cb, void* userdata) {
+	if (pulse_ready( ) < 0) return -1;
+
+	return wait_operation(pa_context_get_sink_info_by_name(pa_state->ctx, name, cb, userdata));
+}
+
+static int pulse_get_source(const char* name, pa_source_info_cb_t cb, void* userdata) {
+	if (pulse_ready( ) < 0) return -1;
+
+	return wait_operation(pa_context_get_source_info_by_name(pa_state->ctx, name, cb, userdata));
+}
+
+static int pulse_get_server(pa_server_info_cb_t cb, void* userdata) {
+	if (pulse_ready( ) < 0) return -1;
+
+	return wait_operation(pa_context_get_server_info(pa_state->ctx, cb, userdata));
+}
+
+static int pulse_set_volume(int source, const char* name, const pa_cvolume* volume) {
+	if (pulse_ready( ) < 0) return -1;
+
+	return wait_operation(source
+		? pa_context_set_source_volume_by_name(pa_state->ctx, name, volume, lua_pa_successful_callback, NULL)
+		: pa_context_set_sink_volume_by_name(pa_state->ctx, name, volume, lua_pa_successful_callback, NULL));
+}
+
+static int pulse_set_mute(int source, const char* name, int mute) {
+	if (pulse_ready( ) < 0) return -1;
+
+	return wait_operation(source
+		? pa_context_set_source_mute_by_name(pa_state->ctx, name, mute, lua_pa_successful_callback, NULL)
+		: pa_context_set_sink_mute_by_name(pa_state->ctx, name, mute, lua_pa_successful_callback, NULL));
+}
+
+static int pulse_set_default(int source, const char* name) {
+	if (pulse_ready( ) < 0) return -1;
+
+	return wait_operation(source
+		? pa_context_set_default_source(pa_state->ctx, name, lua_pa_successful_callback, NULL)
+		: pa_context_set_default_sink(pa_state->ctx, name, lua_pa_successful_callback, NULL));
+}
+
+static void pulse_request_sink(uint32_t index, pa_sink_info_cb_t cb) {
+	pa_operation* op = pa_context_get_sink_info_by_index(pa_state->ctx, index, cb, NULL);
+	if (op)
+		pa_operation_unref(op);
+}
+
+static void pulse_request_source(uint32_t index, pa_source_info_cb_t cb) {
+	pa_operation* op = pa_context_get_source_info_by_index(pa_state->ctx, index, cb, NULL);
+	if (op)
+		pa_operation_unref(op);
+}
+
+static void pulse_request_server(pa_server_info_cb_t cb) {
+	pa_operation* op = pa_context_get_server_info(pa_state->ctx, cb, NULL);
+	if (op)
+		pa_operation_unref(op);
+}
+
+static const lua_pa_backend_t pulse_backend = {
+	.name = "pulse",
+	.init = pa_init,
+	.subscribe = pulse_subscribe,
+	.list_sinks = pulse_list_sinks,
+	.list_sources = pulse_list_sources,
+	.get_sink = pulse_get_sink,
+	.get_source = pulse_get_source,
+	.get_server = pulse_get_server,
+	.set_volume = pulse_set_volume,
+	.set_mute = pulse_set_mute,
+	.set_default = pulse_set_default,
+	.request_sink = pulse_request_sink,
+	.request_source = pulse_request_source,
+	.request_server = pulse_request_server,
+};
+
+// In-process server for benchmarks and tests, all of it is guarded by the mainloop lock
+static struct {
+	backend_device_t* devices[2];
+	size_t count[2];
+	char* defaults[2];
+	uint32_t next_index;
+	int subscribed;
+	journal_event_t* deferred;
+	size_t num_deferred;
+	pa_time_event* flush;
+	fake_step_t* steps;
+	size_t num_steps;
+	size_t next_step;
+	lua_Integer loops;
+	pa_usec_t interval;
+	pa_time_event* timer;
+} fake;
+
+static backend_device_t* fake_find(int source, const char* name) {
+	for (size_t i = 0; i < fake.count[source]; i++)
+		if (strcmp(fake.devices[source][i].name, name) == 0)
+			return &fake.devices[source][i];
+	return NULL;
+}
+
+static backend_device_t* fake_find_index(int source, uint32_t index) {
+	for (size_t i = 0; i < fake.count[source]; i++)
+		if (fake.devices[source][i].index == index)
+			return &fake.devices[source][i];
+	return NULL;
+}
+
+static uint32_t fake_add(int source, const char* name, const char* description) {
+	backend_device_t* grown = realloc(fake.devices[source], (fake.count[source] + 1) * sizeof(backend_device_t));
+	if (!grown) return PA_INVALID_INDEX;
+	fake.devices[source] = grown;
+
+	backend_device_t* d = &grown[fake.count[source]++];
+	d->index = fake.next_index++;
+	d->name = strdup(name);
+	d->description = strdup(description ? description : name);
+	pa_cvolume_set(&d->volume, 2, PA_VOLUME_NORM);
+	d->mute = 0;
+	return d->index;
+}
+
+static void fake_remove(int source, backend_device_t* d) {
+	free(d->name);
+	free(d->description);
+	size_t i = (size_t)(d - fake.devices[source]);
+	memmove(d, d + 1, (fake.count[source] - i - 1) * sizeof(backend_device_t));
+	fake.count[source]--;
+}
+
+static void backend_fill_sample_spec(pa_sample_spec* ss, pa_channel_map* map, uint8_t channels) {
+	ss->format = PA_SAMPLE_S16LE;
+	ss->rate = 48000;
+	ss->channels = channels ? channels : 2;
+	if (!pa_channel_map_init_auto(map, ss->channels, PA_CHANNEL_MAP_DEFAULT))
+		pa_channel_map_init(map);
+}
+
+static void backend_sink_info(const backend_device_t* d, pa_sink_info* info) {
+	memset(info, 0, sizeof(*info));
+	info->index = d->index;
+	info->name = d->name;
+	info->description = d->description;
+	info->volume = d->volume;
+	info->mute = d->mute;
+	info->state = PA_SINK_IDLE;
+	info->card = PA_INVALID_INDEX;
+	info->monitor_source = PA_INVALID_INDEX;
+	backend_fill_sample_spec(&info->sample_spec, &info->channel_map, d->volume.channels);
+}
+
+static void backend_source_info(const backend_device_t* d, pa_source_info* info) {
+	memset(info, 0, sizeof(*info));
+	info->index = d->index;
+	info->name = d->name;
+	info->description = d->description;
+	info->volume = d->volume;
+	info->mute = d->mute;
+	info->state = PA_SOURCE_IDLE;
+	info->card = PA_INVALID_INDEX;
+	info->monitor_of_sink = PA_INVALID_INDEX;
+	backend_fill_sample_spec(&info->sample_spec, &info->channel_map, d->volume.channels);
+}
+
+// Indexes the mapped cache, returns -1 when it is truncated or has another layout
+static int warm_index( ) {
+	const char* p = (const char*)warm.map;
+	const char* end = p + warm.size;
+	cache_header_t header;
+
+	if (warm.size < sizeof(header)) return -1;
+	memcpy(&header, p, sizeof(header));
+	p += sizeof(header);
+
+	if (header.magic != LUA_PA_CACHE_MAGIC || header.version != LUA_PA_CACHE_VERSION) return -1;
+
+	uint16_t default_len[2] = { header.default_sink_len, header.default_source_len };
+	for (int i = 0; i < 2; i++) {
+		if ((size_t)(end - p) < (size_t)default_len[i] + 1 || p[default_len[i]] != '\0') return -1;
+		warm.defaults[i] = p;
+		p += default_len[i] + 1;
+	}
+
+	uint32_t num[2] = { header.num_sinks, header.num_sources };
+	for (int source = 0; source < 2; source++) {
+		if (num[source] > warm.size / sizeof(cache_device_t)) return -1;
+
+		warm.devices[source] = calloc(num[source] ? num[source] : 1, sizeof(backend_device_t));
+		if (!warm.devices[source]) return -1;
+
+		for (uint32_t i = 0; i < num[source]; i++) {
+			cache_device_t entry;
+			if ((size_t)(end - p) < sizeof(entry)) return -1;
+			memcpy(&entry, p, sizeof(entry));
+			p += sizeof(entry);
+
+			if ((size_t)(end - p) < (size_t)entry.name_len + entry.description_len + 2
+				|| p[entry.name_len] != '\0' || p[entry.name_len + 1 + entry.description_len] != '\0')
+				return -1;
+
+			backend_device_t* d = &warm.devices[source][warm.num[source]++];
+			d->index = entry.index;
+			d->name = (char*)p;
+			d->description = (char*)p + entry.name_len + 1;
+			percent_to_cvolume((int)entry.volume, &d->volume);
+			d->mute = (int)entry.mute;
+			p += entry.name_len + entry.description_len + 2;
+		}
+	}
+
+	return 0;
+}
+
+// Drops the cached view, later getters go to the server
+static void warm_release( ) {
+	if (!warm.map) return;
+
+	for (int i = 0; i < 2; i++) {
+		free(warm.devices[i]);
+		warm.devices[i] = NULL;
+		warm.num[i] = 0;
+		warm.defaults[i] = NULL;
+	}
+	munmap(warm.map, warm.size);
+	warm.map = NULL;
+	warm.size = 0;
+}
+
+// Picks the cache path and maps what an earlier run left there. LUA_PA_CACHE=0 turns both off
+static void warm_load( ) {
+	const char* enabled = getenv("LUA_PA_CACHE");
+	const char* dir = getenv("XDG_RUNTIME_DIR");
+	if ((enabled && strcmp(enabled, "0") == 0) || !dir || !dir[0]) return;
+
+	size_t len = strlen(dir) + sizeof("/lua_pa.cache");
+	warm.path = malloc(len);
+	if (!warm.path) return;
+	snprintf(warm.path, len, "%s/lua_pa.cache", dir);
+
+	int fd = open(warm.path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) return;
+
+	struct stat st;
+	void* map = MAP_FAILED;
+	if (fstat(fd, &st) == 0 && st.st_size > 0)
+		map = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED) return;
+
+	warm.map = map;
+	warm.size = (size_t)st.st_size;
+	if (warm_index( ) < 0)
+		warm_release( );
+}
+
+// Pushes the device as the live getters would, marked stale. Returns 0 when it was filtered out
+static int warm_push(lua_State* L, int source, const backend_device_t* d, const list_query_t* q) {
+	unsigned int fields = q ? q->fields : LUA_PA_FIELD_ALL;
+
+	if (source) {
+		pa_source_info info;
+		backend_source_info(d, &info);
+		// The cache does not keep monitor_of_sink, the server names monitors <sink>.monitor
+		size_t len = strlen(d->name);
+		if (len > 8 && strcmp(d->name + len - 8, ".monitor") == 0)
+			info.monitor_of_sink = 0;
+		if ((q && !source_matches(q, &info)) || lua_source_factory_fields(L, &info, fields) != 0) return 0;
+	} else {
+		pa_sink_info info;
+		backend_sink_info(d, &info);
+		if ((q && !sink_matches(q, &info)) || lua_sink_factory_fields(L, &info, fields) != 0) return 0;
+	}
+
+	lua_pushboolean(L, 1);
+	lua_setfield(L, -2, "stale");
+	return 1;
+}
+
+// get_all_sinks() and get_all_sources() before the live sync, returns 0 once there is no cache
+static int warm_push_devices(lua_State* L, int source, const list_query_t* q) {
+	pa_threaded_mainloop_lock(pa_state->mainloop);
+
+	if (!warm.map) {
+		pa_threaded_mainloop_unlock(pa_state->mainloop);
+		return 0;
+	}
+
+	lua_createtable(L, (int)warm.num[source], 0);
+	lua_Integer count = 0;
+	for (size_t i = 0; i < warm.num[source]; i++)
+		if (warm_push(L, source, &warm.devices[source][i], q))
+			lua_rawseti(L, -2, ++count);
+
+	pa_threaded_mainloop_unlock(pa_state->mainloop);
+	return 1;
+}
+
+// A device by name, or the default one when name is NULL. Returns 0 when the cache does not
+// know it so the caller asks the server instead
+static int warm_push_device(lua_State* L, int source, const char* name) {
+	int found = 0;
+
+	pa_threaded_mainloop_lock(pa_state->mainloop);
+
+	if (warm.map) {
+		if (!name)
+			name = warm.defaults[source];
+		for (size_t i = 0; i < warm.num[source] && !found; i++)
+			if (strcmp(warm.devices[source][i].name, name) == 0)
+				found = warm_push(L, source, &warm.devices[source][i], NULL);
+	}
+
+	pa_threaded_mainloop_unlock(pa_state->mainloop);
+	return found;
+}
+
+static void cache_write_devices(FILE* f, const active_sink_sources_t* devices, size_t num) {
+	for (size_t i = 0; i < num; i++) {
+		const char* name = devices[i].name ? devices[i].name : "";
+		const char* description = devices[i].description ? devices[i].description : "";
+		cache_device_t entry = {
+			devices[i].index,
+			(uint32_t)devices[i].volume,
+			(uint32_t)devices[i].mute,
+			(uint16_t)strnlen(name, UINT16_MAX - 1),
+			(uint16_t)strnlen(description, UINT16_MAX - 1),
+		};
+		fwrite(&entry, sizeof(entry), 1, f);
+		fwrite(name, 1, entry.name_len, f);
+		fputc('\0', f);
+		fwrite(description, 1, entry.description_len, f);
+		fputc('\0', f);
+	}
+}
+
+// Writes the registry next to the cache and renames it over, so a reader never maps half a file
+static void cache_write( ) {
+	warm.dirty = 0;
+
+	// Every process writes a file of its own and renames it over the cache, the last one wins whole
+	size_t len = strlen(warm.path) + sizeof(".XXXXXX");
+	char* tmp = malloc(len);
+	if (!tmp) return;
+	snprintf(tmp, len, "%s.XXXXXX", warm.path);
+
+	int fd = mkstemp(tmp);
+	FILE* f = fd >= 0 ? fdopen(fd, "wb") : NULL;
+	if (!f) {
+		if (fd >= 0) {
+			close(fd);
+			unlink(tmp);
+		}
+		free(tmp);
+		return;
+	}
+
+	pthread_mutex_lock(&defaults_mutex);
+	const char* sink = default_sink_name ? default_sink_name : "";
+	const char* source = default_source_name ? default_source_name : "";
+	cache_header_t header = {
+		LUA_PA_CACHE_MAGIC,
+		LUA_PA_CACHE_VERSION,
+		(uint32_t)num_sinks,
+		(uint32_t)num_sources,
+		(uint16_t)strnlen(sink, UINT16_MAX - 1),
+		(uint16_t)strnlen(source, UINT16_MAX - 1),
+	};
+	fwrite(&header, sizeof(header), 1, f);
+	fwrite(sink, 1, header.default_sink_len, f);
+	fputc('\0', f);
+	fwrite(source, 1, header.default_source_len, f);
+	fputc('\0', f);
+	pthread_mutex_unlock(&defaults_mutex);
+
+	cache_write_devices(f, active_sinks, num_sinks);
+	cache_write_devices(f, active_sources, num_sources);
+
+	if (ferror(f) | fclose(f))
+		unlink(tmp);
+	else
+		rename(tmp, warm.path);
+	free(tmp);
+}
+
+static void cache_flush_cb(pa_mainloop_api* api __attribute__((unused)), pa_time_event* e __attribute__((unused)), const struct timeval* tv __attribute__((unused)), void* userdata __attribute__((unused))) {
+	cache_write( );
+}
+
+// Bursts of changes end up in one write LUA_PA_CACHE_DELAY after the last of them
+static void cache_schedule( ) {
+	if (!warm.path || warm.map || !pa_state) return;
+
+	pa_mainloop_api* api = pa_threaded_mainloop_get_api(pa_state->mainloop);
+	struct timeval tv;
+	if (warm.flush)
+		api->time_restart(warm.flush, timeval_after(&tv, LUA_PA_CACHE_DELAY));
+	else
+		warm.flush = api->time_new(api, timeval_after(&tv, LUA_PA_CACHE_DELAY), cache_flush_cb, NULL);
+	warm.dirty = 1;
+}
+
+// The server info is answered after both lists, the registry is complete by then
+static void warm_synced_cb(pa_context* c, const pa_server_info* info, void* userdata) {
+	track_defaults_cb(c, info, userdata);
+	warm_release( );
+	cache_schedule( );
+}
+
+// The blocking part of a cold start, issued from the state callback without waiting on anything
+static void warm_sync( ) {
+	pa_operation* ops[] = {
+		pa_context_subscribe(pa_state->ctx, PA_SUBSCRIPTION_MASK_ALL, lua_pa_successful_callback, NULL),
+		pa_context_get_sink_info_list(pa_state->ctx, fill_active_sinks, NULL),
+		pa_context_get_source_info_list(pa_state->ctx, fill_active_sources, NULL),
+		pa_context_get_server_info(pa_state->ctx, warm_synced_cb, NULL),
+	};
+	pa_context_set_subscribe_callback(pa_state->ctx, lua_pa_subscribe_cb, NULL);
+
+	for (size_t i = 0; i < sizeof(ops) / sizeof(ops[0]); i++)
+		if (ops[i])
+			pa_operation_unref(ops[i]);
+}
+
+static void fake_flush_cb(pa_mainloop_api* api __attribute__((unused)), pa_time_event* e __attribute__((unused)), const struct timeval* tv __attribute__((unused)), void* userdata __attribute__((unused))) {
+	for (size_t i = 0; i < fake.num_deferred; i++)
+		lua_pa_subscribe_cb(NULL, (pa_subscription_event_type_t)fake.deferred[i].type, fake.deferred[i].index, NULL);
+	fake.num_deferred = 0;
+}
+
+// Changes made through the API are announced from the mainloop thread, as a server would
+static void fake_defer(pa_subscription_event_type_t type, uint32_t index) {
+	if (!fake.subscribed) return;
+
+	journal_event_t* grown = realloc(fake.deferred, (fake.num_deferred + 1) * sizeof(journal_event_t));
+	if (!grown) return;
+	fake.deferred = grown;
+	fake.deferred[fake.num_deferred++] = (journal_event_t){ (uint32_t)type, index };
+
+	pa_mainloop_api* api = pa_threaded_mainloop_get_api(pa_state->mainloop);
+	struct timeval tv;
+	if (fake.flush)
+		api->time_restart(fake.flush, timeval_after(&tv, 0));
+	else
+		fake.flush = api->time_new(api, timeval_after(&tv, 0), fake_flush_cb, NULL);
+}
+
+static int fake_env_count(const char* name, int fallback) {
+	const char* value = getenv(name);
+	return value ? atoi(value) : fallback;
+}
+
+static int fake_init( ) {
+	pa_state = (lua_pa_state*)calloc(1, sizeof(lua_pa_state));
+	if (!pa_state) return -1;
+
+	pa_state->mainloop = pa_threaded_mainloop_new( );
+	if (!pa_state->mainloop) {
+		free(pa_state);
+		pa_state = NULL;
+		return -1;
+	}
+
+	pthread_mutex_init(&pa_state->mutex, NULL);
+
+	char name[64], description[64];
+	int sinks = fake_env_count("LUA_PA_FAKE_SINKS", 2);
+	int sources = fake_env_count("LUA_PA_FAKE_SOURCES", 2);
+	for (int i = 0; i < sinks; i++) {
+		snprintf(name, sizeof(name), "fake_sink_%d", i);
+		snprintf(description, sizeof(description), "Fake Sink %d", i);
+		fake_add(0, name, description);
+	}
+	for (int i = 0; i < sources; i++) {
+		snprintf(name, sizeof(name), "fake_source_%d", i);
+		snprintf(description, sizeof(description), "Fake Source %d", i);
+		fake_add(1, name, description);
+	}
+	fake.defaults[0] = fake.count[0] ? strdup(fake.devices[0][0].name) : NULL;
+	fake.defaults[1] = fake.count[1] ? strdup(fake.devices[1][0].name) : NULL;
+
+	return pa_threaded_mainloop_start(pa_state->mainloop) < 0 ? -1 : 0;
+}
+
+static int fake_subscribe( ) {
+	pa_threaded_mainloop_lock(pa_state->mainloop);
+	fake.subscribed = 1;
+	pa_threaded_mainloop_unlock(pa_state->mainloop);
+	return 0;
+}
+
+static int fake_list_sinks(pa_sink_info_cb_t cb, void* userdata) {
+	pa_sink_info info;
+	for (size_t i = 0; i < fake.count[0]; i++) {
+		backend_sink_info(&fake.devices[0][i], &info);
+		cb(NULL, &info, 0, userdata);
+	}
+	cb(NULL, NULL, 1, userdata);
+	return 0;
+}
+
+static int fake_list_sources(pa_source_info_cb_t cb, void* userdata) {
+	pa_source_info info;
+	for (size_t i = 0; i < fake.count[1]; i++) {
+		backend_source_info(&fake.devices[1][i], &info);
+		cb(NULL, &info, 0, userdata);
+	}
+	cb(NULL, NULL, 1, userdata);
+	return 0;
+}
+
+static int fake_get_sink(const char* name, pa_sink_info_cb_t cb, void* userdata) {
+	backend_device_t* d = name ? fake_find(0, name) : NULL;
+	if (d) {
+		pa_sink_info info;
+		backend_sink_info(d, &info);
+		cb(NULL, &info, 0, userdata);
+	}
+	cb(NULL, NULL, 1, userdata);
+	return 0;
+}
+
+static int fake_get_source(const char* name, pa_source_info_cb_t cb, void* userdata) {
+	backend_device_t* d = name ? fake_find(1, name) : NULL;
+	if (d) {
+		pa_source_info info;
+		backend_source_info(d, &info);
+		cb(NULL, &info, 0, userdata);
+	}
+	cb(NULL, NULL, 1, userdata);
+	return 0;
+}
+
+static int fake_get_server(pa_server_info_cb_t cb, void* userdata) {
+	pa_server_info info;
+	memset(&info, 0, sizeof(info));
+	info.server_name = "lua_pa fake server";
+	info.default_sink_name = fake.defaults[0];
+	info.default_source_name = fake.defaults[1];
+	cb(NULL, &info, userdata);
+	return 0;
+}
+
+static pa_subscription_event_type_t fake_facility(int source) {
+	return source ? PA_SUBSCRIPTION_EVENT_SOURCE : PA_SUBSCRIPTION_EVENT_SINK;
+}
+
+static int fake_set_volume(int source, const char* name, const pa_cvolume* volume) {
+	backend_device_t* d = fake_find(source, name);
+	if (!d) return 0;
+	pa_cvolume_set(&d->volume, d->volume.channels, pa_cvolume_avg(volume));
+	fake_defer(fake_facility(source) | PA_SUBSCRIPTION_EVENT_CHANGE, d->index);
+	return 0;
+}
+
+static int fake_set_mute(int source, const char* name, int mute) {
+	backend_device_t* d = fake_find(source, name);
+	if (!d) return 0;
+	d->mute = mute;
+	fake_defer(fake_facility(source) | PA_SUBSCRIPTION_EVENT_CHANGE, d->index);
+	return 0;
+}
+
+static int fake_set_default(int source, const char* name) {
+	if (!fake_find(source, name)) return 0;
+	free(fake.defaults[source]);
+	fake.defaults[source] = strdup(name);
+	fake_defer(PA_SUBSCRIPTION_EVENT_SERVER | PA_SUBSCRIPTION_EVENT_CHANGE, PA_INVALID_INDEX);
+	return 0;
+}
+
+static void fake_request_sink(uint32_t index, pa_sink_info_cb_t cb) {
+	backend_device_t* d = fake_find_index(0, index);
+	if (d) {
+		pa_sink_info info;
+		backend_sink_info(d, &info);
+		cb(NULL, &info, 0, NULL);
+	}
+	cb(NULL, NULL, 1, NULL);
+}
+
+static void fake_request_source(uint32_t index, pa_source_info_cb_t cb) {
+	backend_device_t* d = fake_find_index(1, index);
+	if (d) {
+		pa_source_info info;
+		backend_source_info(d, &info);
+		cb(NULL, &info, 0, NULL);
+	}
+	cb(NULL, NULL, 1, NULL);
+}
+
+static void fake_request_server(pa_server_info_cb_t cb) {
+	fake_get_server(cb, NULL);
+}
+
+static const lua_pa_backend_t fake_backend = {
+	.name = "fake",
+	.init = fake_init,
+	.subscribe = fake_subscribe,
+	.list_sinks = fake_list_sinks,
+	.list_sources = fake_list_sources,
+	.get_sink = fake_get_sink,
+	.get_source = fake_get_source,
+	.get_server = fake_get_server,
+	.set_volume = fake_set_volume,
+	.set_mute = fake_set_mute,
+	.set_default = fake_set_default,
+	.request_sink = fake_request_sink,
+	.request_source = fake_request_source,
+	.request_server = fake_request_server,
+};
+
+static void fake_free_steps( ) {
+	for (size_t i = 0; i < fake.num_steps; i++) {
+		free(fake.steps[i].name);
+		free(fake.steps[i].description);
+	}
+	free(fake.steps);
+	fake.steps = NULL;
+	fake.num_steps = 0;
+	fake.next_step = 0;
+}
+
+// Applies one step as the server would and announces it straight away, we are on the mainloop thread
+static void fake_apply_step(const fake_step_t* step) {
+	pa_subscription_event_type_t facility = fake_facility(step->source);
+	backend_device_t* d = fake_find(step->source, step->name);
+	pa_cvolume volume;
+
+	switch (step->event) {
+	case FAKE_STEP_NEW: {
+		uint32_t index = fake_add(step->source, step->name, step->description);
+		if (index != PA_INVALID_INDEX)
+			lua_pa_subscribe_cb(NULL, facility | PA_SUBSCRIPTION_EVENT_NEW, index, NULL);
+		break;
+	}
+	case FAKE_STEP_CHANGE:
+		if (!d) break;
+		if (step->volume >= 0) {
+			percent_to_cvolume(step->volume, &volume);
+			pa_cvolume_set(&d->volume, d->volume.channels, pa_cvolume_avg(&volume));
+		}
+		if (step->mute >= 0)
+			d->mute = step->mute;
+		if (step->description) {
+			free(d->description);
+			d->description = strdup(step->description);
+		}
+		lua_pa_subscribe_cb(NULL, facility | PA_SUBSCRIPTION_EVENT_CHANGE, d->index, NULL);
+		break;
+	case FAKE_STEP_REMOVE: {
+		if (!d) break;
+		uint32_t index = d->index;
+		fake_remove(step->source, d);
+		lua_pa_subscribe_cb(NULL, facility | PA_SUBSCRIPTION_EVENT_REMOVE, index, NULL);
+		break;
+	}
+	case FAKE_STEP_DEFAULT:
+		if (!d) break;
+		free(fake.defaults[step->source]);
+		fake.defaults[step->source] = strdup(step->name);
+		lua_pa_subscribe_cb(NULL, PA_SUBSCRIPTION_EVENT_SERVER | PA_SUBSCRIPTION_EVENT_CHANGE, PA_INVALID_INDEX, NULL);
+		break;
+	}
+}
+
+static void fake_step_cb(pa_mainloop_api* api, pa_time_event* e, const struct timeval* tv __attribute__((unused)), void* userdata __attribute__((unused))) {
+	if (fake.next_step >= fake.num_steps) {
+		if (--fake.loops <= 0) return;
+		fake.next_step = 0;
+	}
+
+	if (fake.num_steps == 0) return;
+	fake_apply_step(&fake.steps[fake.next_step++]);
+
+	struct timeval next;
+	api->time_restart(e, timeval_after(&next, fake.interval));
+}
+
+static const char* const fake_step_names[] = { "new", "change", "remove", "default", NULL };
+static const char* const fake_type_names[] = { "sink", "source", NULL };
+
+// fake_script({{event = "change", type = "sink", name = ..., volume = n, mute = b}, ...}, {rate = hz, loops = n})
+static int lua_pa_fake_script(lua_State* L) {
+	if (!pa_state || backend != &fake_backend)
+		return luaL_error(L, "fake_script needs the fake backend, set LUA_PA_BACKEND=fake");
+
+	luaL_checktype(L, 1, LUA_TTABLE);
+
+	double rate = 1000;
+	lua_Integer loops = 1;
+	if (lua_istable(L, 2)) {
+		lua_getfield(L, 2, "rate");
+		if (!lua_isnil(L, -1))
+			rate = luaL_checknumber(L, -1);
+		lua_pop(L, 1);
+
+		lua_getfield(L, 2, "loops");
+		if (!lua_isnil(L, -1))
+			loops = luaL_checkinteger(L, -1);
+		lua_pop(L, 1);
+	}
+	if (loops < 1) loops = 1;
+
+	size_t count = lua_rawlen(L, 1);
+	fake_step_t* steps = calloc(count ? count : 1, sizeof(fake_step_t));
+	if (!steps) {
+		lua_pushnil(L);
+		lua_pushstring(L, "out of memory");
+		return 2;
+	}
+
+	for (size_t i = 0; i < count; i++) {
+		lua_rawgeti(L, 1, i + 1);
+		luaL_checktype(L, -1, LUA_TTABLE);
+
+		lua_getfield(L, -1, "event");
+		steps[i].event = luaL_checkoption(L, -1, NULL, fake_step_names);
+		lua_pop(L, 1);
+
+		lua_getfield(L, -1, "type");
+		steps[i].source = luaL_checkoption(L, -1, "sink", fake_type_names);
+		lua_pop(L, 1);
+
+		lua_getfield(L, -1, "name");
+		steps[i].name = strdup(luaL_checkstring(L, -1));
+		lua_pop(L, 1);
+
+		lua_getfield(L, -1, "description");
+		steps[i].description = lua_isstring(L, -1) ? strdup(lua_tostring(L, -1)) : NULL;
+		lua_pop(L, 1);
+
+		lua_getfield(L, -1, "volume");
+		steps[i].volume = lua_isnil(L, -1) ? -1 : (int)luaL_checkinteger(L, -1);
+		lua_pop(L, 1);
+
+		lua_getfield(L, -1, "mute");
+		steps[i].mute = lua_isnil(L, -1) ? -1 : lua_toboolean(L, -1);
+		lua_pop(L, 1);
+
+		lua_pop(L, 1);
+	}
+
+	pa_threaded_mainloop_lock(pa_state->mainloop);
+
+	fake_free_steps( );
+	fake.steps = steps;
+	fake.num_steps = count;
+	fake.loops = loops;
+	fake.interval = rate > 0 ? (pa_usec_t)(1000000 / rate) : 0;
+
+	pa_mainloop_api* api = pa_threaded_mainloop_get_api(pa_state->mainloop);
+	struct timeval tv;
+	if (fake.timer)
+		api->time_restart(fake.timer, timeval_after(&tv, 0));
+	else
+		fake.timer = api->time_new(api, timeval_after(&tv, 0), fake_step_cb, NULL);
+
+	pa_threaded_mainloop_unlock(pa_state->mainloop);
+
+	lua_pushboolean(L, 1);
+	return 1;
+}
+
+// Steps of the running script that have not been applied yet
+static int lua_pa_fake_pending(lua_State* L) {
+	if (!pa_state || backend != &fake_backend)
+		return luaL_error(L, "fake_pending needs the fake backend, set LUA_PA_BACKEND=fake");
+
+	pa_threaded_mainloop_lock(pa_state->mainloop);
+	lua_Integer pending = 0;
+	if (fake.num_steps > 0 && fake.loops > 0)
+		pending = (lua_Integer)(fake.num_steps - fake.next_step) + (fake.loops - 1) * (lua_Integer)fake.num_steps;
+	pending += (lua_Integer)fake.num_deferred;
+	pa_threaded_mainloop_unlock(pa_state->mainloop);
+
+	lua_pushinteger(L, pending);
+	return 1;
+}
+
+static int lua_pa_backend(lua_State* L) {
+	lua_pushstring(L, backend->name);
+	return 1;
+}
+
+#ifdef LUA_PA_PIPEWIRE
+// Native PipeWire backend. The pw loop is driven from an io event on the pulse mainloop, so every
+// pw callback runs on the mainloop thread with its lock held, exactly like the libpulse callbacks
+static struct {
+	struct pw_loop* loop;
+	struct pw_context* context;
+	struct pw_core* core;
+	struct pw_registry* registry;
+	struct pw_metadata* metadata;
+	struct spa_hook core_listener;
+	struct spa_hook registry_listener;
+	struct spa_hook metadata_listener;
+	pa_io_event* io;
+	pw_device_t** devices;
+	size_t num_devices;
+	pw_card_t** cards;
+	size_t num_cards;
+	char* defaults[2];
+	int subscribed;
+	int sync_seq;
+	int synced;
+} pw;
+
+static void pipewire_io_cb(pa_mainloop_api* api __attribute__((unused)), pa_io_event* e __attribute__((unused)), int fd __attribute__((unused)), pa_io_event_flags_t events __attribute__((unused)), void* userdata __attribute__((unused))) {
+	pw_loop_enter(pw.loop);
+	pw_loop_iterate(pw.loop, 0);
+	pw_loop_leave(pw.loop);
+}
+
+static void pipewire_core_done(void* data __attribute__((unused)), uint32_t id, int seq) {
+	if (id == PW_ID_CORE && seq == pw.sync_seq) {
+		pw.synced = 1;
+		pa_threaded_mainloop_signal(pa_state->mainloop, 0);
+	}
+}
+
+static const struct pw_core_events pipewire_core_events = {
+	PW_VERSION_CORE_EVENTS,
+	.done = pipewire_core_done,
+};
+
+// Waits until the server processed everything sent so far, the mainloop must be locked.
+// A late done event carries a stale seq and is ignored, so giving up needs no cancel
+static int pipewire_roundtrip( ) {
+	int expired;
+	pa_time_event* deadline = deadline_start(&expired);
+
+	pw.synced = 0;
+	pw.sync_seq = pw_core_sync(pw.core, PW_ID_CORE, pw.sync_seq);
+	while (!pw.synced && !expired)
+		pa_threaded_mainloop_wait(pa_state->mainloop);
+
+	return deadline_stop(deadline, expired);
+}
+
+static pw_device_t* pipewire_find(int source, const char* name) {
+	for (size_t i = 0; i < pw.num_devices; i++)
+		if (pw.devices[i]->source == source && pw.devices[i]->base.name && strcmp(pw.devices[i]->base.name, name) == 0)
+			return pw.devices[i];
+	return NULL;
+}
+
+static pw_device_t* pipewire_find_index(int source, uint32_t index) {
+	for (size_t i = 0; i < pw.num_devices; i++)
+		if (pw.devices[i]->source == source && pw.devices[i]->base.index == index && pw.devices[i]->announced)
+			return pw.devices[i];
+	return NULL;
+}
+
+static void pipewire_announce(pw_device_t* dev) {
+	if (!dev->has_info || !dev->has_props) return;
 
-		al->signal_name = "pulseaudio::source_change";
-		al->types = "ssiib";
-		al->info = deep_copy_source_info(info);
-		pthread_mutex_lock(&pa_state->mutex);
-		pthread_create(&pa_state->thread, NULL, trigger_signal_7_source, al);
-		pthread_detach(pa_state->thread);
-	}
+	pa_subscription_event_type_t type = (dev->source ? PA_SUBSCRIPTION_EVENT_SOURCE : PA_SUBSCRIPTION_EVENT_SINK)
+		| (dev->announced ? PA_SUBSCRIPTION_EVENT_CHANGE : PA_SUBSCRIPTION_EVENT_NEW);
+	dev->announced = 1;
 
-	pa_threaded_mainloop_signal(pa_state->mainloop, 0);
+	if (pw.subscribed)
+		lua_pa_subscribe_cb(NULL, type, dev->base.index, NULL);
 }
 
-static void signal_source_new_cb(pa_context* c __attribute__((unused)), const pa_source_info* info, int eol, void* userdata __attribute__((unused))) {
-	if (eol < 0 || !info || !pa_state || !pa_state->mainloop) return;
+static void pipewire_set_string(char** field, const char* value) {
+	if (!value || (*field && strcmp(*field, value) == 0)) return;
+	free(*field);
+	*field = strdup(value);
+}
 
-	if (!eol) {
-		active_sources = realloc(active_sources, (num_sources + 1) * sizeof(active_sink_sources_t));
+static void pipewire_node_info(void* data, const struct pw_node_info* info) {
+	pw_device_t* dev = (pw_device_t*)data;
 
-		active_sources[num_sources].index = info->index;
-		active_sources[num_sources].name = strdup(info->name);
-		num_sources++;
+	if (!(info->change_mask & PW_NODE_CHANGE_MASK_PROPS) || !info->props) return;
 
-		arg_list* al = malloc(sizeof(arg_list));
+	pipewire_set_string(&dev->base.name, spa_dict_lookup(info->props, PW_KEY_NODE_NAME));
+	const char* description = spa_dict_lookup(info->props, PW_KEY_NODE_DESCRIPTION);
+	pipewire_set_string(&dev->base.description, description ? description : dev->base.name);
 
-		al->signal_name = "pulseaudio::source_new";
-		al->types = "o";
-		al->info = deep_copy_source_info(info);
+	const char* card = spa_dict_lookup(info->props, PW_KEY_DEVICE_ID);
+	const char* card_device = spa_dict_lookup(info->props, "card.profile.device");
+	dev->card_id = card ? (uint32_t)strtoul(card, NULL, 10) : SPA_ID_INVALID;
+	dev->card_device = card_device ? (int32_t)strtol(card_device, NULL, 10) : -1;
 
-		pthread_mutex_lock(&pa_state->mutex);
-		pthread_create(&pa_state->thread, NULL, trigger_signal_3_source, al);
-		pthread_detach(pa_state->thread);
-	}
-	pa_threaded_mainloop_signal(pa_state->mainloop, 0);
+	dev->has_info = dev->base.name != NULL;
+	pipewire_announce(dev);
 }
 
-static void source_info_cb(pa_context* c __attribute__((unused)), const pa_source_info* info, int eol, void* userdata) {
-	if (eol < 0 || !info || !pa_state || !pa_state->mainloop) return;
+// Props carry linear channel volumes, pulse volumes are their cube root
+static void pipewire_node_param(void* data, int seq __attribute__((unused)), uint32_t id, uint32_t index __attribute__((unused)), uint32_t next __attribute__((unused)), const struct spa_pod* param) {
+	pw_device_t* dev = (pw_device_t*)data;
+
+	if (id != SPA_PARAM_Props || !param || !spa_pod_is_object_type(param, SPA_TYPE_OBJECT_Props)) return;
+
+	const struct spa_pod_object* obj = (const struct spa_pod_object*)param;
+	const struct spa_pod_prop* prop;
+	SPA_POD_OBJECT_FOREACH(obj, prop) {
+		switch (prop->key) {
+		case SPA_PROP_mute: {
+			bool mute;
+			if (spa_pod_get_bool(&prop->value, &mute) == 0)
+				dev->base.mute = mute;
+			break;
+		}
+		case SPA_PROP_channelVolumes: {
+			float volumes[PA_CHANNELS_MAX];
+			uint32_t n = spa_pod_copy_array(&prop->value, SPA_TYPE_Float, volumes, PA_CHANNELS_MAX);
+			if (n == 0) break;
+			dev->base.volume.channels = (uint8_t)n;
+			for (uint32_t i = 0; i < n; i++)
+				dev->base.volume.values[i] = pa_sw_volume_from_linear(volumes[i]);
+			break;
+		}
+		default:
+			break;
+		}
+	}
 
-	lua_State* L = (lua_State*)userdata;
+	dev->has_props = 1;
+	pipewire_announce(dev);
+}
 
-	if (!eol)
-		if (lua_source_factory(L, info) == 0)
-			lua_rawseti(L, -2, luaL_len(L, -2) + 1);
+static const struct pw_node_events pipewire_node_events = {
+	PW_VERSION_NODE_EVENTS,
+	.info = pipewire_node_info,
+	.param = pipewire_node_param,
+};
 
-	pa_threaded_mainloop_signal(pa_state->mainloop, 0);
+static pw_card_t* pipewire_find_card(uint32_t id) {
+	for (size_t i = 0; i < pw.num_cards; i++)
+		if (pw.cards[i]->id == id)
+			return pw.cards[i];
+	return NULL;
 }
 
-static void sink_server_info_cb(pa_context* c __attribute__((unused)), const pa_server_info* info, void* userdata) {
-	if (!pa_state || !info || !pa_state->mainloop) return;
+static const pw_route_t* pipewire_find_route(const pw_card_t* card, int32_t device) {
+	for (size_t i = 0; i < card->num_routes; i++)
+		if (card->routes[i].device == device)
+			return &card->routes[i];
+	return NULL;
+}
 
-	lua_State* L = (lua_State*)userdata;
+// Every change enumerates the active routes again from index 0
+static void pipewire_card_param(void* data, int seq __attribute__((unused)), uint32_t id, uint32_t index, uint32_t next __attribute__((unused)), const struct spa_pod* param) {
+	pw_card_t* card = (pw_card_t*)data;
+
+	if (id != SPA_PARAM_Route || !param || !spa_pod_is_object_type(param, SPA_TYPE_OBJECT_ParamRoute)) return;
+	if (index == 0)
+		card->num_routes = 0;
+
+	pw_route_t route = { -1, -1 };
+	const struct spa_pod_object* obj = (const struct spa_pod_object*)param;
+	const struct spa_pod_prop* prop;
+	SPA_POD_OBJECT_FOREACH(obj, prop) {
+		if (prop->key == SPA_PARAM_ROUTE_index)
+			spa_pod_get_int(&prop->value, &route.index);
+		else if (prop->key == SPA_PARAM_ROUTE_device)
+			spa_pod_get_int(&prop->value, &route.device);
+	}
+	if (route.index < 0 || route.device < 0) return;
 
-	lua_pushstring(L, info->default_sink_name);
+	pw_route_t* known = (pw_route_t*)pipewire_find_route(card, route.device);
+	if (known) {
+		*known = route;
+		return;
+	}
 
-	pa_threaded_mainloop_signal(pa_state->mainloop, 0);
+	pw_route_t* grown = realloc(card->routes, (card->num_routes + 1) * sizeof(pw_route_t));
+	if (!grown) return;
+	card->routes = grown;
+	card->routes[card->num_routes++] = route;
 }
 
-static void source_server_info_cb(pa_context* c __attribute__((unused)), const pa_server_info* info, void* userdata) {
-	if (!pa_state || !info || !pa_state->mainloop) return;
-
-	lua_State* L = (lua_State*)userdata;
+static const struct pw_device_events pipewire_card_events = {
+	PW_VERSION_DEVICE_EVENTS,
+	.param = pipewire_card_param,
+};
 
-	lua_pushstring(L, info->default_source_name);
+static void pipewire_card_add(uint32_t id, const char* type) {
+	pw_card_t** grown = realloc(pw.cards, (pw.num_cards + 1) * sizeof(pw_card_t*));
+	if (!grown) return;
+	pw.cards = grown;
 
-	pa_threaded_mainloop_signal(pa_state->mainloop, 0);
-}
+	pw_card_t* card = calloc(1, sizeof(pw_card_t));
+	if (!card) return;
+	card->id = id;
 
-static void default_sink_info_cb(pa_context* c __attribute__((unused)), const pa_sink_info* info, int eol, void* userdata) {
-	if (eol < 0 || !info || !pa_state || !pa_state->mainloop) return;
+	card->proxy = pw_registry_bind(pw.registry, id, type, PW_VERSION_DEVICE, 0);
+	if (!card->proxy) {
+		free(card);
+		return;
+	}
+	pw_device_add_listener((struct pw_device*)card->proxy, &card->listener, &pipewire_card_events, card);
 
-	lua_State* L = (lua_State*)userdata;
+	uint32_t params[] = { SPA_PARAM_Route };
+	pw_device_subscribe_params((struct pw_device*)card->proxy, params, 1);
 
-	if (!eol)
-		lua_sink_factory(L, info);
+	pw.cards[pw.num_cards++] = card;
+}
 
-	pa_threaded_mainloop_signal(pa_state->mainloop, 0);
+static void pipewire_card_free(pw_card_t* card) {
+	spa_hook_remove(&card->listener);
+	pw_proxy_destroy(card->proxy);
+	free(card->routes);
+	free(card);
 }
 
-static void default_source_info_cb(pa_context* c __attribute__((unused)), const pa_source_info* info, int eol, void* userdata) {
-	if (eol < 0 || !info || !pa_state || !pa_state->mainloop) return;
+// Default names are stored as {"name": "..."} JSON in the "default" metadata object
+static char* pipewire_json_name(const char* value) {
+	if (!value) return NULL;
 
-	lua_State* L = (lua_State*)userdata;
+	struct spa_json it[2];
+	char key[64], name[1024];
 
-	if (!eol)
-		lua_source_factory(L, info);
+	spa_json_init(&it[0], value, strlen(value));
+	if (spa_json_enter_object(&it[0], &it[1]) <= 0) return NULL;
 
-	pa_threaded_mainloop_signal(pa_state->mainloop, 0);
-}
+	while (spa_json_get_string(&it[1], key, sizeof(key)) > 0) {
+		if (strcmp(key, "name") == 0)
+			return spa_json_get_string(&it[1], name, sizeof(name)) > 0 ? strdup(name) : NULL;
 
-static int lua_pa_connect_signal(lua_State* L) {
-	const char* signal_name = luaL_checkstring(L, 1);
-	if (!lua_isfunction(L, 2)) {
-		lua_pushstring(L, "Signal handler must be a function.");
-		lua_error(L);
+		const char* skip;
+		if (spa_json_next(&it[1], &skip) <= 0) break;
 	}
+	return NULL;
+}
+
+static int pipewire_metadata_property(void* data __attribute__((unused)), uint32_t subject, const char* key, const char* type __attribute__((unused)), const char* value) {
+	if (subject != PW_ID_CORE) return 0;
 
-	signal_handlers = realloc(signal_handlers, sizeof(signal_handler_t) * (num_signal_handlers + 1));
-	signal_handlers[num_signal_handlers].signal_name = strdup(signal_name);
-	signal_handlers[num_signal_handlers].L = L;
-	signal_handlers[num_signal_handlers].ref = luaL_ref(L, LUA_REGISTRYINDEX);
-	num_signal_handlers++;
+	int source;
+	if (key && strcmp(key, "default.audio.sink") == 0)
+		source = 0;
+	else if (key && strcmp(key, "default.audio.source") == 0)
+		source = 1;
+	else
+		return 0;
+
+	free(pw.defaults[source]);
+	pw.defaults[source] = pipewire_json_name(value);
 
+	if (pw.subscribed)
+		lua_pa_subscribe_cb(NULL, PA_SUBSCRIPTION_EVENT_SERVER | PA_SUBSCRIPTION_EVENT_CHANGE, PA_INVALID_INDEX, NULL);
 	return 0;
 }
 
-static void lua_pa_trigger_signal(const char* signal_name, const char* types, ...) {
-	va_list args;
-	va_start(args, types);
-	int argc = 0;
+static const struct pw_metadata_events pipewire_metadata_events = {
+	PW_VERSION_METADATA_EVENTS,
+	.property = pipewire_metadata_property,
+};
 
-	for (size_t i = 0; i < num_signal_handlers; i++) {
-		if (strcmp(signal_handlers[i].signal_name, signal_name) == 0) {
-			lua_State* L = signal_handlers[i].L;
-			lua_rawgeti(L, LUA_REGISTRYINDEX, signal_handlers[i].ref);
+static void pipewire_registry_global(void* data __attribute__((unused)), uint32_t id, uint32_t permissions __attribute__((unused)), const char* type, uint32_t version __attribute__((unused)), const struct spa_dict* props) {
+	if (!props) return;
 
-			for (size_t j = 0; types[j] != '\0'; j++) {
-				switch (types[j]) {
-				case 's':
-					const char* str = va_arg(args, const char*);
-					lua_pushstring(L, str);
-					break;
-				case 'i':
-					int i_val = va_arg(args, int);
-					lua_pushinteger(L, i_val);
-					break;
-				case 'b':
-					int b = va_arg(args, int);
-					lua_pushboolean(L, b);
-					break;
-				case 'u': {
-					const pa_sink_info* info = va_arg(args, const pa_sink_info*);
-					if (info)
-						lua_sink_factory(L, info);
-					else
-						lua_pushnil(L);
-					break;
-				}
-				case 'o': {
-					const pa_source_info* info = va_arg(args, const pa_source_info*);
-					if (info)
-						lua_source_factory(L, info);
-					else
-						lua_pushnil(L);
-					break;
-				}
-				default:
-					break;
-				}
-				argc++;
-			}
+	if (strcmp(type, PW_TYPE_INTERFACE_Metadata) == 0) {
+		const char* name = spa_dict_lookup(props, PW_KEY_METADATA_NAME);
+		if (pw.metadata || !name || strcmp(name, "default") != 0) return;
 
-			if (lua_pcall(L, argc, 0, 0) != 0) {
-				lua_pushstring(L, "Error in signal handler \n");
-				lua_error(L);
-			}
-		}
+		pw.metadata = pw_registry_bind(pw.registry, id, type, PW_VERSION_METADATA, 0);
+		if (pw.metadata)
+			pw_metadata_add_listener(pw.metadata, &pw.metadata_listener, &pipewire_metadata_events, NULL);
+		return;
 	}
 
-	va_end(args);
-}
+	const char* media_class = spa_dict_lookup(props, PW_KEY_MEDIA_CLASS);
 
-static void lua_pa_subscribe_cb(pa_context* c, pa_subscription_event_type_t type, uint32_t index, void* userdata) {
-	if ((type & PA_SUBSCRIPTION_EVENT_FACILITY_MASK) == PA_SUBSCRIPTION_EVENT_SINK) {
-		if ((type & PA_SUBSCRIPTION_EVENT_TYPE_MASK) == PA_SUBSCRIPTION_EVENT_CHANGE) {
-			pa_operation* op = pa_context_get_sink_info_by_index(c, index, signal_sink_info_cb, userdata);
-			pa_operation_unref(op);
-		}
-		if ((type & PA_SUBSCRIPTION_EVENT_TYPE_MASK) == PA_SUBSCRIPTION_EVENT_NEW) {
-			pa_operation* op = pa_context_get_sink_info_by_index(c, index, signal_sink_new_cb, userdata);
-			pa_operation_unref(op);
-		}
-		if ((type & PA_SUBSCRIPTION_EVENT_TYPE_MASK) == PA_SUBSCRIPTION_EVENT_REMOVE) {
-			for (size_t i = 0; i < num_sinks; i++) {
-				if (active_sinks[i].index == index) {
-					char* sink_name_copy = NULL;
-					if (active_sinks[i].name != NULL) {
-						sink_name_copy = strdup(active_sinks[i].name);
-					}
+	if (strcmp(type, PW_TYPE_INTERFACE_Device) == 0) {
+		if (media_class && strcmp(media_class, "Audio/Device") == 0)
+			pipewire_card_add(id, type);
+		return;
+	}
 
-					arg_list* al = malloc(sizeof(arg_list));
+	if (strcmp(type, PW_TYPE_INTERFACE_Node) != 0) return;
+
+	int source;
+	if (media_class && strcmp(media_class, "Audio/Sink") == 0)
+		source = 0;
+	else if (media_class && strncmp(media_class, "Audio/Source", 12) == 0)
+		source = 1;
+	else
+		return;
+
+	pw_device_t** grown = realloc(pw.devices, (pw.num_devices + 1) * sizeof(pw_device_t*));
+	if (!grown) return;
+	pw.devices = grown;
+
+	pw_device_t* dev = calloc(1, sizeof(pw_device_t));
+	if (!dev) return;
+	dev->base.index = id;
+	dev->source = source;
+	dev->card_id = SPA_ID_INVALID;
+	dev->card_device = -1;
+	pa_cvolume_set(&dev->base.volume, 2, PA_VOLUME_NORM);
+
+	dev->proxy = pw_registry_bind(pw.registry, id, type, PW_VERSION_NODE, 0);
+	if (!dev->proxy) {
+		free(dev);
+		return;
+	}
+	pw_node_add_listener((struct pw_node*)dev->proxy, &dev->listener, &pipewire_node_events, dev);
 
-					al->signal_name = "pulseaudio::sink_remove";
-					al->types = "s";
-					al->info = sink_name_copy;
+	uint32_t params[] = { SPA_PARAM_Props };
+	pw_node_subscribe_params((struct pw_node*)dev->proxy, params, 1);
 
-					pthread_mutex_lock(&pa_state->mutex);
-					pthread_create(&pa_state->thread, NULL, trigger_signal_3, al);
-					pthread_detach(pa_state->thread);
+	pw.devices[pw.num_devices++] = dev;
+}
 
-					if (active_sinks[i].name != NULL)
-						active_sinks[i].name = NULL;
+static void pipewire_device_free(pw_device_t* dev) {
+	spa_hook_remove(&dev->listener);
+	pw_proxy_destroy(dev->proxy);
+	free(dev->base.name);
+	free(dev->base.description);
+	free(dev);
+}
 
+static void pipewire_registry_global_remove(void* data __attribute__((unused)), uint32_t id) {
+	for (size_t i = 0; i < pw.num_cards; i++) {
+		if (pw.cards[i]->id != id) continue;
 
-					for (size_t j = i; j < num_sinks - 1; ++j)
-						active_sinks[j] = active_sinks[j + 1];
+		pw_card_t* card = pw.cards[i];
+		memmove(&pw.cards[i], &pw.cards[i + 1], (pw.num_cards - i - 1) * sizeof(pw_card_t*));
+		pw.num_cards--;
+		pipewire_card_free(card);
+		return;
+	}
 
-					num_sinks--;
+	for (size_t i = 0; i < pw.num_devices; i++) {
+		pw_device_t* dev = pw.devices[i];
+		if (dev->base.index != id) continue;
 
-					if (num_sinks > 0) {
-						active_sinks = realloc(active_sinks, num_sinks * sizeof(active_sink_sources_t));
-						if (active_sinks == NULL) {
-							perror("realloc failed");
-							exit(EXIT_FAILURE);
-						}
-					} else {
-						free(active_sinks);
-						active_sinks = NULL;
-					}
+		memmove(&pw.devices[i], &pw.devices[i + 1], (pw.num_devices - i - 1) * sizeof(pw_device_t*));
+		pw.num_devices--;
 
-					break;
-				}
-			}
-		}
-	}
-	if ((type & PA_SUBSCRIPTION_EVENT_FACILITY_MASK) == PA_SUBSCRIPTION_EVENT_SOURCE) {
-		if ((type & PA_SUBSCRIPTION_EVENT_TYPE_MASK) == PA_SUBSCRIPTION_EVENT_CHANGE) {
-			pa_operation* op = pa_context_get_source_info_by_index(c, index, signal_source_info_cb, userdata);
-			pa_operation_unref(op);
-		}
-		if ((type & PA_SUBSCRIPTION_EVENT_TYPE_MASK) == PA_SUBSCRIPTION_EVENT_NEW) {
-			pa_operation* op = pa_context_get_source_info_by_index(c, index, signal_source_new_cb, userdata);
-			pa_operation_unref(op);
-		}
-		if ((type & PA_SUBSCRIPTION_EVENT_TYPE_MASK) == PA_SUBSCRIPTION_EVENT_REMOVE) {
-			for (size_t i = 0; i < num_sources; i++) {
-				if (active_sources[i].index == index) {
-					char* source_name_copy = NULL;
-					if (active_sources[i].name != NULL) {
-						source_name_copy = strdup(active_sources[i].name);
-					}
-
-					arg_list* al = malloc(sizeof(arg_list));
-
-					al->signal_name = "pulseaudio::source_remove";
-					al->types = "s";
-					al->info = source_name_copy;
-
-					pthread_mutex_lock(&pa_state->mutex);
-					pthread_create(&pa_state->thread, NULL, trigger_signal_3, al);
-					pthread_detach(pa_state->thread);
-
-					if (active_sources[i].name != NULL)
-						active_sources[i].name = NULL;
-
-					for (size_t j = i; j < num_sources - 1; ++j)
-						active_sources[j] = active_sources[j + 1];
-
-					num_sources--;
-
-					if (num_sources > 0) {
-						active_sources = realloc(active_sources, num_sources * sizeof(active_sink_sources_t));
-						if (active_sources == NULL) {
-							perror("realloc failed");
-							exit(EXIT_FAILURE);
-						}
-					} else {
-						free(active_sources);
-						active_sources = NULL;
-					}
+		if (dev->announced && pw.subscribed)
+			lua_pa_subscribe_cb(NULL, (dev->source ? PA_SUBSCRIPTION_EVENT_SOURCE : PA_SUBSCRIPTION_EVENT_SINK) | PA_SUBSCRIPTION_EVENT_REMOVE, id, NULL);
 
-					break;
-				}
-			}
-		}
-	} else if ((type & PA_SUBSCRIPTION_EVENT_FACILITY_MASK) == PA_SUBSCRIPTION_EVENT_SERVER) {
-		printf("SERVER\n");
-	} else if ((type & PA_SUBSCRIPTION_EVENT_FACILITY_MASK) == PA_SUBSCRIPTION_EVENT_CLIENT) {
-		printf("CLIENT\n");
+		pipewire_device_free(dev);
+		return;
 	}
 }
 
-static int pa_init( ) {
-	pa_state = (lua_pa_state*)malloc(sizeof(lua_pa_state));
+static const struct pw_registry_events pipewire_registry_events = {
+	PW_VERSION_REGISTRY_EVENTS,
+	.global = pipewire_registry_global,
+	.global_remove = pipewire_registry_global_remove,
+};
+
+static int pipewire_init( ) {
+	pw_init(NULL, NULL);
+
+	pa_state = (lua_pa_state*)calloc(1, sizeof(lua_pa_state));
+	if (!pa_state) return -1;
 
 	pa_state->mainloop = pa_threaded_mainloop_new( );
 	if (!pa_state->mainloop) {
@@ -951,57 +6448,319 @@ static int pa_init( ) {
 		return -1;
 	}
 
-	pa_state->ctx = pa_context_new(pa_threaded_mainloop_get_api(pa_state->mainloop), "Lua Pulseaudio");
-	if (!pa_state->ctx) {
+	pthread_mutex_init(&pa_state->mutex, NULL);
+
+	pw.loop = pw_loop_new(NULL);
+	pw.context = pw.loop ? pw_context_new(pw.loop, NULL, 0) : NULL;
+	pw.core = pw.context ? pw_context_connect(pw.context, NULL, 0) : NULL;
+	if (!pw.core) {
+		if (pw.context) pw_context_destroy(pw.context);
+		if (pw.loop) pw_loop_destroy(pw.loop);
 		pa_threaded_mainloop_free(pa_state->mainloop);
 		free(pa_state);
 		pa_state = NULL;
 		return -1;
 	}
 
-	pa_context_set_state_callback(pa_state->ctx, context_state_cb, NULL);
+	pw_core_add_listener(pw.core, &pw.core_listener, &pipewire_core_events, NULL);
+	pw.registry = pw_core_get_registry(pw.core, PW_VERSION_REGISTRY, 0);
+	pw_registry_add_listener(pw.registry, &pw.registry_listener, &pipewire_registry_events, NULL);
 
-	if (pa_context_connect(pa_state->ctx, NULL, PA_CONTEXT_NOFAIL, NULL) < 0) {
-		pa_context_unref(pa_state->ctx);
+	pa_mainloop_api* api = pa_threaded_mainloop_get_api(pa_state->mainloop);
+	pw.io = api->io_new(api, pw_loop_get_fd(pw.loop), PA_IO_EVENT_INPUT, pipewire_io_cb, NULL);
+
+	pa_threaded_mainloop_lock(pa_state->mainloop);
+	if (pa_threaded_mainloop_start(pa_state->mainloop) < 0) {
+		pa_threaded_mainloop_unlock(pa_state->mainloop);
+		// Nothing iterated the pw loop yet, freeing the mainloop frees the io event with it
+		pipewire_cleanup( );
 		pa_threaded_mainloop_free(pa_state->mainloop);
+		pthread_mutex_destroy(&pa_state->mutex);
 		free(pa_state);
 		pa_state = NULL;
+		return -1;
 	}
 
-	pa_threaded_mainloop_lock(pa_state->mainloop);
-	pa_threaded_mainloop_start(pa_state->mainloop);
-
-	pa_threaded_mainloop_wait(pa_state->mainloop);
+	// The first sync delivers the globals, the second the info and Props of the nodes bound for them
+	pipewire_roundtrip( );
+	pipewire_roundtrip( );
+	pa_threaded_mainloop_unlock(pa_state->mainloop);
 
-	if (pa_context_get_state(pa_state->ctx) != PA_CONTEXT_READY)	return 0;
+	return 0;
+}
 
+static int pipewire_subscribe( ) {
+	pa_threaded_mainloop_lock(pa_state->mainloop);
+	pw.subscribed = 1;
 	pa_threaded_mainloop_unlock(pa_state->mainloop);
+	return 0;
+}
 
-	pa_threaded_mainloop_lock(pa_state->mainloop);
-	pa_operation* op = pa_context_subscribe(pa_state->ctx, PA_SUBSCRIPTION_MASK_ALL, lua_pa_successful_callback, NULL);
-	while (pa_operation_get_state(op) == PA_OPERATION_RUNNING)
-		pa_threaded_mainloop_wait(pa_state->mainloop);
-	pa_operation_unref(op);
+static int pipewire_list_sinks(pa_sink_info_cb_t cb, void* userdata) {
+	pa_sink_info info;
+	for (size_t i = 0; i < pw.num_devices; i++) {
+		if (pw.devices[i]->source || !pw.devices[i]->announced) continue;
+		backend_sink_info(&pw.devices[i]->base, &info);
+		cb(NULL, &info, 0, userdata);
+	}
+	cb(NULL, NULL, 1, userdata);
+	return 0;
+}
 
-	pa_context_set_subscribe_callback(pa_state->ctx, lua_pa_subscribe_cb, NULL);
-	pa_threaded_mainloop_unlock(pa_state->mainloop);
+static int pipewire_list_sources(pa_source_info_cb_t cb, void* userdata) {
+	pa_source_info info;
+	for (size_t i = 0; i < pw.num_devices; i++) {
+		if (!pw.devices[i]->source || !pw.devices[i]->announced) continue;
+		backend_source_info(&pw.devices[i]->base, &info);
+		cb(NULL, &info, 0, userdata);
+	}
+	cb(NULL, NULL, 1, userdata);
+	return 0;
+}
+
+static int pipewire_get_sink(const char* name, pa_sink_info_cb_t cb, void* userdata) {
+	pw_device_t* dev = name ? pipewire_find(0, name) : NULL;
+	if (dev && dev->announced) {
+		pa_sink_info info;
+		backend_sink_info(&dev->base, &info);
+		cb(NULL, &info, 0, userdata);
+	}
+	cb(NULL, NULL, 1, userdata);
+	return 0;
+}
 
+static int pipewire_get_source(const char* name, pa_source_info_cb_t cb, void* userdata) {
+	pw_device_t* dev = name ? pipewire_find(1, name) : NULL;
+	if (dev && dev->announced) {
+		pa_source_info info;
+		backend_source_info(&dev->base, &info);
+		cb(NULL, &info, 0, userdata);
+	}
+	cb(NULL, NULL, 1, userdata);
+	return 0;
+}
+
+static int pipewire_get_server(pa_server_info_cb_t cb, void* userdata) {
+	pa_server_info info;
+	memset(&info, 0, sizeof(info));
+	info.server_name = "PipeWire";
+	info.default_sink_name = pw.defaults[0];
+	info.default_source_name = pw.defaults[1];
+	cb(NULL, &info, userdata);
 	return 0;
 }
 
+// Nodes of a card take volume and mute through the Route param of the card's active route, the
+// card would otherwise restore the route's own values over node Props. Other nodes take Props
+static int pipewire_set_props(pw_device_t* dev, const float* volumes, uint32_t n, const bool* mute) {
+	pw_card_t* card = dev->card_id != SPA_ID_INVALID ? pipewire_find_card(dev->card_id) : NULL;
+	const pw_route_t* route = card && dev->card_device >= 0 ? pipewire_find_route(card, dev->card_device) : NULL;
+
+	uint8_t buffer[1024];
+	struct spa_pod_builder b = SPA_POD_BUILDER_INIT(buffer, sizeof(buffer));
+	struct spa_pod_frame f[2];
+
+	if (route) {
+		spa_pod_builder_push_object(&b, &f[0], SPA_TYPE_OBJECT_ParamRoute, SPA_PARAM_Route);
+		spa_pod_builder_add(&b,
+			SPA_PARAM_ROUTE_index, SPA_POD_Int(route->index),
+			SPA_PARAM_ROUTE_device, SPA_POD_Int(route->device),
+			SPA_PARAM_ROUTE_save, SPA_POD_Bool(true),
+			0);
+		spa_pod_builder_prop(&b, SPA_PARAM_ROUTE_props, 0);
+	}
+
+	spa_pod_builder_push_object(&b, &f[1], SPA_TYPE_OBJECT_Props, SPA_PARAM_Props);
+	if (volumes)
+		spa_pod_builder_add(&b, SPA_PROP_channelVolumes, SPA_POD_Array(sizeof(float), SPA_TYPE_Float, n, volumes), 0);
+	if (mute)
+		spa_pod_builder_add(&b, SPA_PROP_mute, SPA_POD_Bool(*mute), 0);
+	struct spa_pod* param = (struct spa_pod*)spa_pod_builder_pop(&b, &f[1]);
+
+	if (route) {
+		param = (struct spa_pod*)spa_pod_builder_pop(&b, &f[0]);
+		pw_device_set_param((struct pw_device*)card->proxy, SPA_PARAM_Route, 0, param);
+	} else {
+		pw_node_set_param((struct pw_node*)dev->proxy, SPA_PARAM_Props, 0, param);
+	}
+	return pipewire_roundtrip( );
+}
+
+static int pipewire_set_volume(int source, const char* name, const pa_cvolume* volume) {
+	pw_device_t* dev = pipewire_find(source, name);
+	if (!dev) return 0;
+
+	float volumes[PA_CHANNELS_MAX];
+	uint32_t n = dev->base.volume.channels ? dev->base.volume.channels : 1;
+	float linear = (float)pa_sw_volume_to_linear(pa_cvolume_avg(volume));
+	for (uint32_t i = 0; i < n; i++)
+		volumes[i] = linear;
+
+	return pipewire_set_props(dev, volumes, n, NULL);
+}
+
+static int pipewire_set_mute(int source, const char* name, int mute) {
+	pw_device_t* dev = pipewire_find(source, name);
+	if (!dev) return 0;
+
+	bool value = mute ? true : false;
+	return pipewire_set_props(dev, NULL, 0, &value);
+}
+
+// Quotes s as a JSON string, escaping what would end it or break the object around it
+static char* pipewire_json_string(const char* s) {
+	char* out = malloc(strlen(s) * 6 + 3);
+	if (!out) return NULL;
+
+	char* p = out;
+	*p++ = '"';
+	for (; *s; s++) {
+		unsigned char ch = (unsigned char)*s;
+		if (ch == '"' || ch == '\\') {
+			*p++ = '\\';
+			*p++ = (char)ch;
+		} else if (ch < 0x20) {
+			p += sprintf(p, "\\u%04x", ch);
+		} else {
+			*p++ = (char)ch;
+		}
+	}
+	*p++ = '"';
+	*p = '\0';
+	return out;
+}
+
+static int pipewire_set_default(int source, const char* name) {
+	if (!pw.metadata) return 0;
+
+	char* quoted = pipewire_json_string(name);
+	char* value = quoted ? malloc(strlen(quoted) + 16) : NULL;
+	if (!value) {
+		free(quoted);
+		return 0;
+	}
+
+	sprintf(value, "{ \"name\": %s }", quoted);
+	pw_metadata_set_property(pw.metadata, PW_ID_CORE, source ? "default.configured.audio.source" : "default.configured.audio.sink",
+		"Spa:String:JSON", value);
+	free(quoted);
+	free(value);
+	return pipewire_roundtrip( );
+}
+
+static void pipewire_request_sink(uint32_t index, pa_sink_info_cb_t cb) {
+	pw_device_t* dev = pipewire_find_index(0, index);
+	if (dev) {
+		pa_sink_info info;
+		backend_sink_info(&dev->base, &info);
+		cb(NULL, &info, 0, NULL);
+	}
+	cb(NULL, NULL, 1, NULL);
+}
+
+static void pipewire_request_source(uint32_t index, pa_source_info_cb_t cb) {
+	pw_device_t* dev = pipewire_find_index(1, index);
+	if (dev) {
+		pa_source_info info;
+		backend_source_info(&dev->base, &info);
+		cb(NULL, &info, 0, NULL);
+	}
+	cb(NULL, NULL, 1, NULL);
+}
+
+static void pipewire_request_server(pa_server_info_cb_t cb) {
+	pipewire_get_server(cb, NULL);
+}
+
+// Runs after the mainloop stopped, nothing iterates the pw loop anymore
+static void pipewire_cleanup( ) {
+	for (size_t i = 0; i < pw.num_devices; i++)
+		pipewire_device_free(pw.devices[i]);
+	free(pw.devices);
+	pw.devices = NULL;
+	pw.num_devices = 0;
+
+	for (size_t i = 0; i < pw.num_cards; i++)
+		pipewire_card_free(pw.cards[i]);
+	free(pw.cards);
+
+	if (pw.metadata) {
+		spa_hook_remove(&pw.metadata_listener);
+		pw_proxy_destroy((struct pw_proxy*)pw.metadata);
+	}
+	spa_hook_remove(&pw.registry_listener);
+	pw_proxy_destroy((struct pw_proxy*)pw.registry);
+	pw_core_disconnect(pw.core);
+	pw_context_destroy(pw.context);
+	pw_loop_destroy(pw.loop);
+	free(pw.defaults[0]);
+	free(pw.defaults[1]);
+	memset(&pw, 0, sizeof(pw));
+	pw_deinit( );
+}
+
+static const lua_pa_backend_t pipewire_backend = {
+	.name = "pipewire",
+	.init = pipewire_init,
+	.subscribe = pipewire_subscribe,
+	.list_sinks = pipewire_list_sinks,
+	.list_sources = pipewire_list_sources,
+	.get_sink = pipewire_get_sink,
+	.get_source = pipewire_get_source,
+	.get_server = pipewire_get_server,
+	.set_volume = pipewire_set_volume,
+	.set_mute = pipewire_set_mute,
+	.set_default = pipewire_set_default,
+	.request_sink = pipewire_request_sink,
+	.request_source = pipewire_request_source,
+	.request_server = pipewire_request_server,
+	.cleanup = pipewire_cleanup,
+};
+#endif // LUA_PA_PIPEWIRE
+
 static int lua_pa_cleanup(lua_State* L) {
+	if (journal) {
+		fclose(journal);
+		journal = NULL;
+	}
+
+	shm_unexport( );
+
 	if (pa_state) {
+		// A pending cache write would otherwise be lost with the mainloop
+		pa_threaded_mainloop_lock(pa_state->mainloop);
+		if (warm.dirty)
+			cache_write( );
+		if (warm.flush) {
+			pa_mainloop_api* api = pa_threaded_mainloop_get_api(pa_state->mainloop);
+			api->time_free(warm.flush);
+			warm.flush = NULL;
+		}
+		if (duck.timer) {
+			pa_mainloop_api* api = pa_threaded_mainloop_get_api(pa_state->mainloop);
+			api->time_free(duck.timer);
+			duck.timer = NULL;
+		}
+		pa_threaded_mainloop_unlock(pa_state->mainloop);
+
 		if (pa_state->ctx) {
 			pa_context_disconnect(pa_state->ctx);
 			pa_context_unref(pa_state->ctx);
 		}
 		pa_threaded_mainloop_stop(pa_state->mainloop);
+		if (backend->cleanup)
+			backend->cleanup( );
 		if (pa_state->mainloop)
 			pa_threaded_mainloop_free(pa_state->mainloop);
 		free(pa_state);
 		pa_state = NULL;
 	}
 
+	warm_release( );
+	free(warm.path);
+	warm.path = NULL;
+	duck_free( );
+
 	lua_pushboolean(L, 1);
 	return 1;
 }
@@ -1010,12 +6769,7 @@ static void fill_active_sinks(pa_context* c __attribute__((unused)), const pa_si
 	if (eol < 0 || !pa_state || !pa_state->mainloop) return;
 
 	if (!eol) {
-		active_sinks = realloc(active_sinks, (num_sinks + 1) * sizeof(active_sink_sources_t));
-
-		active_sinks[num_sinks].name = strdup(info->name);
-
-		active_sinks[num_sinks].index = info->index;
-		num_sinks++;
+		device_registry_update(&active_sinks, &num_sinks, info->index, info->name, info->description, &info->volume, info->mute, PA_INVALID_INDEX);
 	}
 
 	pa_threaded_mainloop_signal(pa_state->mainloop, 0);
@@ -1025,11 +6779,7 @@ static void fill_active_sources(pa_context* c __attribute__((unused)), const pa_
 	if (eol < 0 || !pa_state || !pa_state->mainloop) return;
 
 	if (!eol) {
-		active_sources = realloc(active_sources, (num_sources + 1) * sizeof(active_sink_sources_t));
-
-		active_sources[num_sources].name = strdup(info->name);
-		active_sources[num_sources].index = info->index;
-		num_sources++;
+		device_registry_update(&active_sources, &num_sources, info->index, info->name, info->description, &info->volume, info->mute, info->monitor_of_sink);
 	}
 
 	pa_threaded_mainloop_signal(pa_state->mainloop, 0);
@@ -1055,13 +6805,45 @@ static const struct luaL_Reg lua_pa_funcs[] = {
 	{"set_mute_source", lua_pa_set_mute_source},
 	{"get_sink_by_name", lua_pa_get_sink_by_name},
 	{"get_source_by_name", lua_pa_get_source_by_name},
+	{"sinks", lua_pa_sinks},
+	{"sources", lua_pa_sources},
 	{"connect_signal", lua_pa_connect_signal},
+	{"upload_sample", lua_pa_upload_sample},
+	{"play_sample", lua_pa_play_sample},
+	{"new_playback", lua_pa_new_playback},
+	{"new_record", lua_pa_new_record},
+	{"spectrum", lua_pa_spectrum},
+	{"dispatch_fd", lua_pa_dispatch_fd},
+	{"measure_latency", lua_pa_measure_latency},
+	{"capture_scene", lua_pa_capture_scene},
+	{"apply_scene", lua_pa_apply_scene},
+	{"snapshot", lua_pa_snapshot},
+	{"journal_start", lua_pa_journal_start},
+	{"journal_stop", lua_pa_journal_stop},
+	{"export_shm", lua_pa_export_shm},
+	{"replay", lua_pa_replay},
+	{"backend", lua_pa_backend},
+	{"fake_script", lua_pa_fake_script},
+	{"fake_pending", lua_pa_fake_pending},
+	{"set_timeout", lua_pa_set_timeout},
+	{"stats", lua_pa_stats},
+	{"add_duck_rule", lua_pa_add_duck_rule},
+	{"remove_duck_rule", lua_pa_remove_duck_rule},
+	{"dispatch", lua_pa_dispatch},
 	{ NULL, NULL },
 };
 
 int luaopen_lua_pa(lua_State* L) {
 	luaL_newlib(L, lua_pa_funcs);
 
+	// Bits of the changed-fields mask passed to change handlers
+	lua_newtable(L);
+	for (int i = 0; device_change_field_names[i]; i++) {
+		lua_pushinteger(L, 1 << i);
+		lua_setfield(L, -2, device_change_field_names[i]);
+	}
+	lua_setfield(L, -2, "fields");
+
 	void* ud __attribute__((unused)) = lua_newuserdata(L, 0);
 
 	luaL_newmetatable(L, "lua_quit");
@@ -1071,22 +6853,73 @@ int luaopen_lua_pa(lua_State* L) {
 
 	lua_setfield(L, -2, "__finalizer");
 
-	if (pa_init( ) != 0) {
+	luaL_newmetatable(L, "lua_pa_playback");
+	luaL_newlib(L, lua_pa_playback_methods);
+	lua_setfield(L, -2, "__index");
+	lua_pushcfunction(L, lua_pa_playback_close);
+	lua_setfield(L, -2, "__gc");
+	lua_pop(L, 1);
+
+	luaL_newmetatable(L, "lua_pa_record");
+	luaL_newlib(L, lua_pa_record_methods);
+	lua_setfield(L, -2, "__index");
+	lua_pushcfunction(L, lua_pa_record_close);
+	lua_setfield(L, -2, "__gc");
+	lua_pop(L, 1);
+
+	luaL_newmetatable(L, "lua_pa_spectrum");
+	luaL_newlib(L, lua_pa_spectrum_methods);
+	lua_setfield(L, -2, "__index");
+	lua_pushcfunction(L, lua_pa_spectrum_close);
+	lua_setfield(L, -2, "__gc");
+	lua_pop(L, 1);
+
+	luaL_newmetatable(L, "lua_pa_device_iter");
+	lua_pushcfunction(L, lua_pa_device_iter_close);
+	lua_setfield(L, -2, "__gc");
+	lua_pushcfunction(L, lua_pa_device_iter_close);
+	lua_setfield(L, -2, "__close");
+	lua_pop(L, 1);
+
+	// LUA_PA_BACKEND=fake runs against an in-process server, for benchmarks and tests without audio.
+	// Builds with PIPEWIRE=1 talk to PipeWire natively unless LUA_PA_BACKEND=pulse
+	const char* backend_name = getenv("LUA_PA_BACKEND");
+	if (backend_name && strcmp(backend_name, fake_backend.name) == 0)
+		backend = &fake_backend;
+	else if (backend_name && strcmp(backend_name, pulse_backend.name) == 0)
+		backend = &pulse_backend;
+#ifdef LUA_PA_PIPEWIRE
+	else if (backend_name && strcmp(backend_name, pipewire_backend.name) == 0)
+		backend = &pipewire_backend;
+#endif
+	else if (backend_name)
+		return luaL_error(L, "Unknown backend %s", backend_name);
+
+	if (backend == &pulse_backend)
+		warm_load( );
+
+	if (backend->init( ) != 0 || backend->subscribe( ) != 0) {
 		luaL_error(L, "Error initializing pulseaudio\n");
 		return -1;
 	}
 
 	pa_threaded_mainloop_lock(pa_state->mainloop);
 
-	pa_operation* op = pa_context_get_sink_info_list(pa_state->ctx, fill_active_sinks, NULL);
-	while (pa_operation_get_state(op) == PA_OPERATION_RUNNING)
-		pa_threaded_mainloop_wait(pa_state->mainloop);
-
-	op = pa_context_get_source_info_list(pa_state->ctx, fill_active_sources, NULL);
-
-	while (pa_operation_get_state(op) == PA_OPERATION_RUNNING)
-		pa_threaded_mainloop_wait(pa_state->mainloop);
-	pa_operation_unref(op);
+	// Seeding the registries is one round trip when the queries can be pipelined
+	if (warm.map) {
+		// warm_sync() seeds them once connected
+	} else if (backend == &pulse_backend) {
+		pa_operation* ops[] = {
+			pa_context_get_sink_info_list(pa_state->ctx, fill_active_sinks, NULL),
+			pa_context_get_source_info_list(pa_state->ctx, fill_active_sources, NULL),
+			pa_context_get_server_info(pa_state->ctx, track_defaults_cb, NULL),
+		};
+		wait_all_operations(ops, sizeof(ops) / sizeof(ops[0]));
+	} else {
+		backend->list_sinks(fill_active_sinks, NULL);
+		backend->list_sources(fill_active_sources, NULL);
+		backend->get_server(track_defaults_cb, NULL);
+	}
 
 	pa_threaded_mainloop_unlock(pa_state->mainloop);
 	return 1;
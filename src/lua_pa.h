@@ -11,6 +11,27 @@
 #include <math.h>
 #include <pthread.h>
 #include <unistd.h>
+#include <stdatomic.h>
+#include <sys/eventfd.h>
+#include <time.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <endian.h>
+
+#include "lua_pa_shm.h"
+
+#ifdef LUA_PA_PIPEWIRE
+#include <pipewire/pipewire.h>
+#include <pipewire/extensions/metadata.h>
+#include <spa/param/props.h>
+#include <spa/param/route.h>
+#include <spa/pod/builder.h>
+#include <spa/pod/iter.h>
+#include <spa/utils/json.h>
+#endif
 
 typedef struct {
 	pa_threaded_mainloop* mainloop;
@@ -23,14 +44,36 @@ typedef struct {
 	const char* signal_name;
 	lua_State* L;
 	int ref;
+	unsigned int fields;
+	char* device;
+	uint32_t index;
+	int follow_default;
+	int source_scope;
 } signal_handler_t;
 
 typedef struct {
 	const char* name;
 	uint32_t index;
+	char* description;
+	int volume;
+	int mute;
+	uint32_t monitor_of_sink;
 } active_sink_sources_t;
 
+// Devices and defaults as the signals see them. The live registry follows the server and feeds shm
+// and the cache, replay() keeps one of its own that nothing else reads
+typedef struct {
+	active_sink_sources_t** sinks;
+	size_t* num_sinks;
+	active_sink_sources_t** sources;
+	size_t* num_sources;
+	char** default_sink;
+	char** default_source;
+	int live;
+} signal_registry_t;
+
 typedef struct {
+	const signal_registry_t* registry;
 	const char* signal_name;
 	const char* types;
 	const char* description;
@@ -38,9 +81,429 @@ typedef struct {
 	uint32_t index;
 	int volume;
 	int mute;
+	int value;
 	const void* info;
 }arg_list;
 
+enum {
+	LUA_PA_FIELD_DESCRIPTION = 1 << 0,
+	LUA_PA_FIELD_NAME = 1 << 1,
+	LUA_PA_FIELD_INDEX = 1 << 2,
+	LUA_PA_FIELD_VOLUME = 1 << 3,
+	LUA_PA_FIELD_MUTE = 1 << 4,
+	LUA_PA_FIELD_SET_VOLUME = 1 << 5,
+	LUA_PA_FIELD_SET_MUTE = 1 << 6,
+	LUA_PA_FIELD_SET_DEFAULT = 1 << 7,
+	LUA_PA_FIELD_LATENCY = 1 << 8,
+	LUA_PA_FIELD_CONFIGURED_LATENCY = 1 << 9,
+	LUA_PA_FIELD_SAMPLE_SPEC = 1 << 10,
+	LUA_PA_FIELD_CHANNEL_MAP = 1 << 11,
+	LUA_PA_FIELD_STATE = 1 << 12,
+	LUA_PA_FIELD_ALL = (1 << 13) - 1,
+};
+
+// Projection and filter for list queries, -1 means the filter is unset
+typedef struct {
+	lua_State* L;
+	lua_Integer count;
+	unsigned int fields;
+	int state;
+	int monitor;
+	int mute;
+} list_query_t;
+
+enum {
+	PENDING_SUCCESS,
+	PENDING_SINK,
+	PENDING_SOURCE,
+	PENDING_SINK_LIST,
+	PENDING_SOURCE_LIST,
+};
+
+// An operation started from a coroutine, results are deep copies until dispatch() pushes them
+typedef struct lua_pa_pending {
+	lua_State* co;
+	int ref;
+	int kind;
+	int success;
+	int timed_out;
+	list_query_t query;
+	void** items;
+	size_t count;
+	pa_operation* op;
+	pa_time_event* deadline;
+	struct lua_pa_pending* next;
+} lua_pa_pending_t;
+
+#define LUA_PA_RECORD_NAME_MAX 256
+
+// One device copied out of a list callback. Fixed size, so filling the buffer never allocates per
+// device and names longer than LUA_PA_RECORD_NAME_MAX - 1 bytes are cut
+typedef struct {
+	uint32_t index;
+	pa_cvolume volume;
+	int mute;
+	int state;
+	pa_usec_t latency;
+	pa_usec_t configured_latency;
+	pa_sample_spec sample_spec;
+	pa_channel_map channel_map;
+	char name[LUA_PA_RECORD_NAME_MAX];
+	char description[LUA_PA_RECORD_NAME_MAX];
+} device_record_t;
+
+// State of a sinks() or sources() loop. The callback appends records under the mainloop lock,
+// the iterator takes them on the caller's thread and rewinds the buffer once it caught up.
+// Peak memory is one record per device, the loop only saves building the Lua result table
+typedef struct {
+	int source;
+	list_query_t query;
+	pa_operation* op;
+	device_record_t* records;
+	size_t count;
+	size_t capacity;
+	size_t next;
+	int done;
+	pa_usec_t timeout;
+} device_iter_t;
+
+typedef struct {
+	uint32_t index;
+	char* name;
+	char* driver;
+	char* active_profile;
+	char** profiles;
+	size_t num_profiles;
+} snapshot_card_t;
+
+// A sink input or source output, device is the sink or source it plays to or records from
+typedef struct {
+	uint32_t index;
+	uint32_t device;
+	char* name;
+	char* application;
+	char* role;
+	pa_cvolume volume;
+	int mute;
+} snapshot_stream_t;
+
+// Everything snapshot() returns, collected by callbacks of queries that all run at once
+typedef struct {
+	char* server_name;
+	char* server_version;
+	char* default_sink;
+	char* default_source;
+	device_iter_t sinks;
+	device_iter_t sources;
+	snapshot_card_t* cards;
+	size_t num_cards;
+	snapshot_stream_t* sink_inputs;
+	size_t num_sink_inputs;
+	snapshot_stream_t* source_outputs;
+	size_t num_source_outputs;
+} lua_pa_snapshot_t;
+
+typedef struct {
+	pa_stream* stream;
+	pa_sample_spec ss;
+	uint32_t index;
+} lua_pa_playback_t;
+
+typedef struct {
+	pa_stream* stream;
+	pa_sample_spec ss;
+	uint32_t index;
+	char* ring;
+	size_t capacity;
+	atomic_size_t head;
+	atomic_size_t tail;
+	atomic_size_t overruns;
+	int fd;
+} lua_pa_record_t;
+
+typedef struct {
+	int samples;
+	pa_usec_t total;
+	pa_usec_t max;
+} latency_probe_t;
+
+typedef struct {
+	char* name;
+	int volume;
+	int mute;
+} scene_device_t;
+
+typedef struct {
+	char* name;
+	char* profile;
+} scene_card_t;
+
+// Plain C copy of the mixer state, filled from callbacks so Lua is only touched on the caller's thread
+typedef struct {
+	char* default_sink;
+	char* default_source;
+	scene_device_t* sinks;
+	size_t num_sinks;
+	scene_device_t* sources;
+	size_t num_sources;
+	scene_card_t* cards;
+	size_t num_cards;
+} lua_pa_scene_t;
+
+enum {
+	SCENE_CARD_PROFILE,
+	SCENE_SINK_VOLUME,
+	SCENE_SINK_MUTE,
+	SCENE_SOURCE_VOLUME,
+	SCENE_SOURCE_MUTE,
+	SCENE_DEFAULT_SINK,
+	SCENE_DEFAULT_SOURCE,
+};
+
+// One difference between the requested scene and the server, text holds a profile or default device name
+typedef struct {
+	int kind;
+	const char* name;
+	int value;
+	const char* text;
+	int old_value;
+	const char* old_text;
+	int missing;
+	int success;
+	int undone;
+} scene_item_t;
+
+// Streams to move onto a new default device, target is PA_INVALID_INDEX when the registry does not know it
+typedef struct {
+	uint32_t* indexes;
+	size_t count;
+	uint32_t target;
+	int moved;
+} stream_move_t;
+
+// Journal file: a header, then records of a fixed header followed by a payload padded to 8 bytes.
+// All fields are little endian so the file can be mapped and walked in place
+#define LUA_PA_JOURNAL_MAGIC 0x4a41504c
+#define LUA_PA_JOURNAL_VERSION 1
+
+enum {
+	JOURNAL_EVENT = 1,
+	JOURNAL_SINK_NEW,
+	JOURNAL_SINK_CHANGE,
+	JOURNAL_SOURCE_NEW,
+	JOURNAL_SOURCE_CHANGE,
+	JOURNAL_SERVER,
+	JOURNAL_SINK_KNOWN,
+	JOURNAL_SOURCE_KNOWN,
+};
+
+typedef struct {
+	uint32_t magic;
+	uint32_t version;
+} journal_header_t;
+
+typedef struct {
+	uint32_t tag;
+	uint32_t size;
+	uint64_t usec;
+} journal_record_t;
+
+typedef struct {
+	uint32_t type;
+	uint32_t index;
+} journal_event_t;
+
+// Followed by the name and description, each NUL terminated
+typedef struct {
+	uint32_t index;
+	uint32_t volume;
+	uint32_t mute;
+	uint32_t state;
+	uint64_t latency;
+	uint64_t configured_latency;
+	uint32_t rate;
+	uint8_t format;
+	uint8_t channels;
+	uint16_t name_len;
+	uint16_t description_len;
+	uint16_t reserved;
+	uint32_t reserved2;
+} journal_device_t;
+
+// Written as is, a hole the compiler pads would go to disk uninitialized
+_Static_assert(sizeof(journal_device_t) == 48, "journal_device_t layout changed");
+
+// Followed by the default sink and source names, each NUL terminated
+typedef struct {
+	uint16_t sink_len;
+	uint16_t source_len;
+	uint32_t reserved;
+} journal_server_t;
+
+
+// Ducking ramps advance in steps of this length
+#define LUA_PA_DUCK_STEP (20 * PA_USEC_PER_MSEC)
+
+// Stream properties a duck rule matches on, NULL matches anything
+typedef struct {
+	char* role;
+	char* application;
+} duck_match_t;
+
+// Target streams drop to level percent of their volume while a trigger stream is playing
+typedef struct {
+	lua_Integer id;
+	duck_match_t trigger;
+	duck_match_t target;
+	int level;
+	pa_usec_t fade;
+} duck_rule_t;
+
+// A sink input as the duck rules see it. base is the volume restored once no rule ducks it anymore,
+// the stream ramps from from towards level percent of base, current is the last volume sent.
+// epoch counts the ramps started, a volume query sent before the latest one is stale
+typedef struct {
+	uint32_t index;
+	char* role;
+	char* application;
+	pa_cvolume base;
+	pa_cvolume from;
+	pa_cvolume current;
+	int level;
+	pa_usec_t fade;
+	pa_usec_t start;
+	int ramping;
+	unsigned int epoch;
+} duck_stream_t;
+
+// Warm-start cache: a header, the default sink and source names, then the sinks and the sources.
+// Strings are NUL terminated and nothing is aligned, readers copy the fixed parts out
+#define LUA_PA_CACHE_MAGIC 0x4341504c
+#define LUA_PA_CACHE_VERSION 1
+#define LUA_PA_CACHE_DELAY (1 * PA_USEC_PER_SEC)
+
+typedef struct {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t num_sinks;
+	uint32_t num_sources;
+	uint16_t default_sink_len;
+	uint16_t default_source_len;
+} cache_header_t;
+
+// Followed by the name and description, volume is in percent
+typedef struct {
+	uint32_t index;
+	uint32_t volume;
+	uint32_t mute;
+	uint16_t name_len;
+	uint16_t description_len;
+} cache_device_t;
+
+// Server access used by the device API. list, get and set calls run with the mainloop locked
+// and return once every callback ran, or -1 when call_timeout passed first and no callback
+// will run any more. request calls come from the subscribe callback and must not wait
+typedef struct {
+	const char* name;
+	int (*init)(void);
+	int (*subscribe)(void);
+	int (*list_sinks)(pa_sink_info_cb_t cb, void* userdata);
+	int (*list_sources)(pa_source_info_cb_t cb, void* userdata);
+	int (*get_sink)(const char* name, pa_sink_info_cb_t cb, void* userdata);
+	int (*get_source)(const char* name, pa_source_info_cb_t cb, void* userdata);
+	int (*get_server)(pa_server_info_cb_t cb, void* userdata);
+	int (*set_volume)(int source, const char* name, const pa_cvolume* volume);
+	int (*set_mute)(int source, const char* name, int mute);
+	int (*set_default)(int source, const char* name);
+	void (*request_sink)(uint32_t index, pa_sink_info_cb_t cb);
+	void (*request_source)(uint32_t index, pa_source_info_cb_t cb);
+	void (*request_server)(pa_server_info_cb_t cb);
+	void (*cleanup)(void);
+} lua_pa_backend_t;
+
+// A device as kept by backends that answer queries from their own cache
+typedef struct {
+	uint32_t index;
+	char* name;
+	char* description;
+	pa_cvolume volume;
+	int mute;
+} backend_device_t;
+
+#ifdef LUA_PA_PIPEWIRE
+// An Audio/Sink or Audio/Source node, announced once both its info and its Props arrived
+typedef struct {
+	backend_device_t base;
+	int source;
+	struct pw_proxy* proxy;
+	struct spa_hook listener;
+	int has_info;
+	int has_props;
+	int announced;
+	// The card and card profile device behind a hardware node, SPA_ID_INVALID and -1 otherwise
+	uint32_t card_id;
+	int32_t card_device;
+} pw_device_t;
+
+// The active route of one card profile device
+typedef struct {
+	int32_t index;
+	int32_t device;
+} pw_route_t;
+
+// An Audio/Device, bound for the Route params that own the volume and mute of its nodes
+typedef struct {
+	uint32_t id;
+	struct pw_proxy* proxy;
+	struct spa_hook listener;
+	pw_route_t* routes;
+	size_t num_routes;
+} pw_card_t;
+#endif
+
+enum {
+	FAKE_STEP_NEW,
+	FAKE_STEP_CHANGE,
+	FAKE_STEP_REMOVE,
+	FAKE_STEP_DEFAULT,
+};
+
+// One scripted server-side change, volume and mute are -1 when the step leaves them alone
+typedef struct {
+	int event;
+	int source;
+	char* name;
+	char* description;
+	int volume;
+	int mute;
+} fake_step_t;
+
+#define LUA_PA_SPECTRUM_MAX_BANDS 256
+
+typedef struct {
+	lua_pa_record_t capture;
+	pthread_t worker;
+	atomic_int running;
+	unsigned int fft_size;
+	unsigned int bands;
+	unsigned int fps;
+	float scale;
+	float* window;
+	float* history;
+	float* re;
+	float* im;
+	float* power;
+	float* twiddle_re;
+	float* twiddle_im;
+	float* split_re;
+	float* split_im;
+	unsigned int* bitrev;
+	unsigned int* band_lo;
+	unsigned int* band_hi;
+	float out[2][LUA_PA_SPECTRUM_MAX_BANDS];
+	atomic_uint seq;
+} lua_pa_spectrum_t;
+
 static int lua_pa_set_volume_sink(lua_State* L);
 static int lua_pa_set_volume_source(lua_State* L);
 static int lua_pa_set_mute_sink(lua_State* L);
@@ -54,6 +517,27 @@ static int lua_pa_get_all_sources(lua_State* L);
 static int lua_pa_get_default_sink(lua_State* L);
 static int lua_pa_get_default_source(lua_State* L);
 
+static int lua_pa_upload_sample(lua_State* L);
+static int lua_pa_play_sample(lua_State* L);
+static int lua_pa_new_playback(lua_State* L);
+static int lua_pa_new_record(lua_State* L);
+static int lua_pa_spectrum(lua_State* L);
+static int lua_pa_measure_latency(lua_State* L);
+static int lua_pa_capture_scene(lua_State* L);
+static int lua_pa_snapshot(lua_State* L);
+static int lua_pa_apply_scene(lua_State* L);
+static int lua_pa_journal_start(lua_State* L);
+static int lua_pa_journal_stop(lua_State* L);
+static int lua_pa_export_shm(lua_State* L);
+static int lua_pa_replay(lua_State* L);
+static int lua_pa_backend(lua_State* L);
+static int lua_pa_fake_script(lua_State* L);
+static int lua_pa_fake_pending(lua_State* L);
+static int lua_pa_set_timeout(lua_State* L);
+static int lua_pa_sinks(lua_State* L);
+static int lua_pa_sources(lua_State* L);
+static int lua_pa_stats(lua_State* L);
+
 static void context_state_cb(pa_context* c, void* userdata);
 static void lua_pa_successful_callback(pa_context* c, int success, void* userdata);
 static void sink_info_cb(pa_context* c, const pa_sink_info* info, int eol, void* userdata);
@@ -64,7 +548,22 @@ static void source_server_info_cb(pa_context* c, const pa_server_info* info, voi
 static void default_source_info_cb(pa_context* c, const pa_source_info* info, int eol, void* userdata);
 
 static void lua_pa_trigger_signal(const char* signal_name, const char* types, ...);
+static void lua_pa_trigger_signal_device(const signal_registry_t* registry, const char* signal_name, unsigned int changed, const char* device_name, uint32_t device_index, const char* types, ...);
+static int has_signal_handler(const char* signal_name);
+static void emit_stream_signal(const char* signal_name, const char* types, uint32_t index, int value);
 
 static int pa_init( );
+static int pulse_subscribe( );
+
+static void fill_active_sinks(pa_context* c, const pa_sink_info* info, int eol, void* userdata);
+static void fill_active_sources(pa_context* c, const pa_source_info* info, int eol, void* userdata);
+static void cache_schedule( );
+static void warm_sync( );
+static int warm_push_devices(lua_State* L, int source, const list_query_t* q);
+static int warm_push_device(lua_State* L, int source, const char* name);
+
+#ifdef LUA_PA_PIPEWIRE
+static void pipewire_cleanup( );
+#endif
 
 #endif // LUA_PA_H
@@ -0,0 +1,130 @@
+#ifndef LUA_PA_SHM_H
+#define LUA_PA_SHM_H
+
+// Layout of the segment published by lua_pa.export_shm(name) and a header-only reader for it.
+// Readers map /dev/shm/<name> once and then take consistent copies without any syscall or
+// server connection:
+//
+//	lua_pa_shm_t* shm = lua_pa_shm_open("lua_pa");
+//	lua_pa_shm_device_t sink;
+//	if (shm && lua_pa_shm_read_default(shm, 0, &sink) == 0)
+//		printf("%s %u%%%s\n", sink.description, sink.volume, sink.mute ? " muted" : "");
+//
+// The writer bumps seq to an odd value before it touches the segment and to the next even value
+// once it is done, so a copy taken while seq was odd or changed underneath is simply retried.
+// A writer that died in the middle of an update leaves seq odd, readers give up on it after
+// LUA_PA_SHM_SPIN_MAX loads instead of spinning forever. Link with -lrt on glibc older than 2.34
+
+#include <stdint.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define LUA_PA_SHM_MAGIC 0x4d48534c
+#define LUA_PA_SHM_VERSION 1
+#define LUA_PA_SHM_MAX_DEVICES 64
+#define LUA_PA_SHM_NAME_MAX 128
+#define LUA_PA_SHM_NONE UINT32_MAX
+#define LUA_PA_SHM_SPIN_MAX (1u << 20)
+
+// Volume in percent as lua_pa reports it, names longer than LUA_PA_SHM_NAME_MAX - 1 bytes are cut
+typedef struct {
+	uint32_t index;
+	uint32_t volume;
+	uint32_t mute;
+	uint32_t reserved;
+	char name[LUA_PA_SHM_NAME_MAX];
+	char description[LUA_PA_SHM_NAME_MAX];
+} lua_pa_shm_device_t;
+
+// default_sink and default_source are slots in sinks and sources, LUA_PA_SHM_NONE when unknown
+typedef struct {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t seq;
+	uint32_t num_sinks;
+	uint32_t num_sources;
+	uint32_t default_sink;
+	uint32_t default_source;
+	uint32_t reserved;
+	uint64_t updated_usec;
+	lua_pa_shm_device_t sinks[LUA_PA_SHM_MAX_DEVICES];
+	lua_pa_shm_device_t sources[LUA_PA_SHM_MAX_DEVICES];
+} lua_pa_shm_t;
+
+// Maps the segment read only, returns NULL when it does not exist or has another layout
+static inline lua_pa_shm_t* lua_pa_shm_open(const char* name) {
+	char path[256];
+	path[0] = '/';
+	strncpy(path + 1, name, sizeof(path) - 2);
+	path[sizeof(path) - 1] = '\0';
+
+	int fd = shm_open(path, O_RDONLY | O_CLOEXEC, 0);
+	if (fd < 0) return NULL;
+
+	struct stat st;
+	if (fstat(fd, &st) < 0 || (size_t)st.st_size < sizeof(lua_pa_shm_t)) {
+		close(fd);
+		return NULL;
+	}
+
+	void* map = mmap(NULL, sizeof(lua_pa_shm_t), PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED) return NULL;
+
+	lua_pa_shm_t* shm = (lua_pa_shm_t*)map;
+	if (shm->magic != LUA_PA_SHM_MAGIC || shm->version != LUA_PA_SHM_VERSION) {
+		munmap(map, sizeof(lua_pa_shm_t));
+		return NULL;
+	}
+
+	return shm;
+}
+
+static inline void lua_pa_shm_close(lua_pa_shm_t* shm) {
+	if (shm)
+		munmap(shm, sizeof(lua_pa_shm_t));
+}
+
+// Waits for an even seq, returns -1 when it stayed odd for LUA_PA_SHM_SPIN_MAX loads
+static inline int lua_pa_shm_begin(const lua_pa_shm_t* shm, uint32_t* seq) {
+	for (uint32_t i = 0; i < LUA_PA_SHM_SPIN_MAX; i++) {
+		*seq = __atomic_load_n(&shm->seq, __ATOMIC_ACQUIRE);
+		if (!(*seq & 1)) return 0;
+	}
+	return -1;
+}
+
+static inline int lua_pa_shm_retry(const lua_pa_shm_t* shm, uint32_t seq) {
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	return __atomic_load_n(&shm->seq, __ATOMIC_RELAXED) != seq;
+}
+
+// Copies the whole segment into out. Returns -1 when the writer stopped in the middle of an update
+static inline int lua_pa_shm_read(const lua_pa_shm_t* shm, lua_pa_shm_t* out) {
+	uint32_t seq;
+	do {
+		if (lua_pa_shm_begin(shm, &seq) < 0) return -1;
+		memcpy(out, shm, sizeof(*out));
+	} while (lua_pa_shm_retry(shm, seq));
+
+	return 0;
+}
+
+// Copies the default sink, or the default source when source is set. Returns -1 when there is none
+// and -2 when the writer stopped in the middle of an update
+static inline int lua_pa_shm_read_default(const lua_pa_shm_t* shm, int source, lua_pa_shm_device_t* out) {
+	uint32_t seq, slot;
+	do {
+		if (lua_pa_shm_begin(shm, &seq) < 0) return -2;
+		slot = source ? shm->default_source : shm->default_sink;
+		if (slot < LUA_PA_SHM_MAX_DEVICES)
+			memcpy(out, source ? &shm->sources[slot] : &shm->sinks[slot], sizeof(*out));
+	} while (lua_pa_shm_retry(shm, seq));
+
+	return slot < LUA_PA_SHM_MAX_DEVICES ? 0 : -1;
+}
+
+#endif // LUA_PA_SHM_H
@@ -0,0 +1,125 @@
+local socket = require 'socket'
+
+-- Stress the event path with module churn, run through `make stress` which
+-- starts a private daemon for it
+local lua_pa = require 'lua_pa'
+
+local iterations = tonumber(arg[1]) or 2000
+local prefix = 'lua_pa_stress_'
+
+local function rss_kb()
+	local f = io.open('/proc/self/status')
+	if not f then return 0 end
+	local rss = f:read('*a'):match('VmRSS:%s*(%d+)')
+	f:close()
+	return tonumber(rss) or 0
+end
+
+local function pactl(args)
+	local p = io.popen('pactl ' .. args .. ' 2>/dev/null')
+	local out = p:read('*a')
+	p:close()
+	return out
+end
+
+-- Per device name, the events in delivery order. Every stress sink and its monitor source must
+-- see exactly new, change, remove
+local events = { sink = {}, source = {} }
+local expected = { 'new', 'change', 'remove' }
+
+-- Volume flips go through lua_pa so the clock starts right before the request leaves the process.
+-- Modules are loaded by pactl, whose fork and exec would dominate, so new and remove are not timed
+local issued = {}
+local latencies = {}
+
+local function record(facility, kind, name)
+	if not name or name:sub(1, #prefix) ~= prefix then return end
+	local now = socket.gettime()
+	local seq = events[facility][name] or {}
+	events[facility][name] = seq
+	table.insert(seq, kind)
+	if kind == 'change' and issued[name] then
+		table.insert(latencies, now - issued[name])
+		issued[name] = nil
+	end
+end
+
+for _, facility in ipairs({ 'sink', 'source' }) do
+	lua_pa.connect_signal('pulseaudio::' .. facility .. '_new', function(device)
+		record(facility, 'new', device and device.name)
+	end)
+
+	lua_pa.connect_signal('pulseaudio::' .. facility .. '_change', function(_, name)
+		record(facility, 'change', name)
+	end)
+
+	lua_pa.connect_signal('pulseaudio::' .. facility .. '_remove', function(name)
+		record(facility, 'remove', name)
+	end)
+end
+
+local rss_start = rss_kb()
+local started = socket.gettime()
+
+for i = 1, iterations do
+	local name = prefix .. i
+	local monitor = name .. '.monitor'
+	local sink_module = tonumber(pactl('load-module module-null-sink sink_name=' .. name))
+	local loopback_module = tonumber(pactl('load-module module-loopback source=' .. monitor .. ' sink=lua_pa_stress_base'))
+
+	issued[name] = socket.gettime()
+	lua_pa.set_volume_sink(name, 10 + i % 80)
+	issued[monitor] = socket.gettime()
+	lua_pa.set_volume_source(monitor, 10 + i % 80)
+
+	if loopback_module then pactl('unload-module ' .. loopback_module) end
+	if sink_module then pactl('unload-module ' .. sink_module) end
+end
+
+-- Let the last events drain
+local deadline = socket.gettime() + 5
+while socket.gettime() < deadline do
+	local sink = events.sink[prefix .. iterations]
+	local source = events.source[prefix .. iterations .. '.monitor']
+	if sink and sink[#sink] == 'remove' and source and source[#source] == 'remove' then break end
+	socket.select(nil, nil, 0.1)
+end
+
+local elapsed = socket.gettime() - started
+local rss_end = rss_kb()
+
+local failures = 0
+local function check(facility, name)
+	local seq = events[facility][name] or {}
+	local ok = #seq == #expected
+	for j, kind in ipairs(expected) do
+		if seq[j] ~= kind then ok = false end
+	end
+
+	if not ok then
+		failures = failures + 1
+		if failures <= 10 then
+			print(string.format('%s %s: events=%s', facility, name, table.concat(seq, ',')))
+		end
+	end
+end
+
+for i = 1, iterations do
+	check('sink', prefix .. i)
+	check('source', prefix .. i .. '.monitor')
+end
+
+table.sort(latencies)
+local function percentile(p)
+	if #latencies == 0 then return 0 end
+	return latencies[math.max(1, math.ceil(#latencies * p))] * 1000
+end
+
+print(string.format('iterations:   %d in %.1fs', iterations, elapsed))
+print(string.format('failures:     %d', failures))
+print(string.format('devices:      %d sinks and %d sources checked for new, change, remove', iterations, iterations))
+print(string.format('latency p50:  %.2fms (volume change to handler, %d samples)', percentile(0.5), #latencies))
+print(string.format('latency p99:  %.2fms', percentile(0.99)))
+print(string.format('rss growth:   %dkB (%dkB -> %dkB)', rss_end - rss_start, rss_start, rss_end))
+
+os.exit(failures == 0 and 0 or 1)
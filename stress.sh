@@ -0,0 +1,33 @@
+#!/bin/sh
+# Runs stress.lua, or the script given, against a private pulseaudio daemon so the host setup
+# is never touched. The script finds the daemon's pid in LUA_PA_DAEMON_PID
+
+LUA=${LUA:-lua}
+ITERATIONS=${ITERATIONS:-2000}
+SCRIPT=${1:-stress.lua}
+
+tmp=$(mktemp -d)
+trap 'kill -CONT $pa_pid 2>/dev/null; kill $pa_pid 2>/dev/null; wait $pa_pid 2>/dev/null; rm -rf "$tmp"' EXIT INT TERM
+
+export XDG_RUNTIME_DIR="$tmp"
+export PULSE_RUNTIME_PATH="$tmp/pulse"
+export PULSE_STATE_PATH="$tmp/state"
+export PULSE_SERVER="unix:$tmp/native"
+
+pulseaudio -n --daemonize=no --use-pid-file=false --exit-idle-time=-1 --disallow-exit \
+	-L "module-native-protocol-unix socket=$tmp/native auth-anonymous=1" \
+	-L "module-null-sink sink_name=lua_pa_stress_base" &
+pa_pid=$!
+export LUA_PA_DAEMON_PID=$pa_pid
+
+i=0
+while [ ! -S "$tmp/native" ]; do
+	i=$((i + 1))
+	if [ $i -gt 50 ]; then
+		echo "pulseaudio did not start"
+		exit 1
+	fi
+	sleep 0.1
+done
+
+LUA_CPATH="./bin/?.so;$LUA_CPATH;;" "$LUA" "$SCRIPT" "$ITERATIONS"
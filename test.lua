@@ -19,6 +19,40 @@ if not all_sources then
 end
 print('lua_pa.get_all_sources OK')
 
+-- TEST field projection and filters
+local sources = lua_pa.get_all_sources { fields = { 'name' }, filter = { monitor = false } }
+for _, source in ipairs(sources) do
+	if source.volume ~= nil or source.set_volume ~= nil or source.name:match('%.monitor$') then
+		print('lua_pa.get_all_sources filter ERROR')
+		return false
+	end
+end
+print('lua_pa.get_all_sources filter OK')
+
+-- TEST per-call deadlines and the stats counters
+local timed_sinks, timed_err = lua_pa.get_all_sinks { timeout_ms = 2000 }
+local stats = lua_pa.stats()
+if not timed_sinks or stats.operations < 1 or stats.timeouts ~= 0 then
+	print('lua_pa.get_all_sinks timeout_ms ERROR', timed_err)
+	return false
+end
+print('lua_pa.get_all_sinks timeout_ms OK')
+
+-- TEST iterating devices, including leaving the loop early
+local iterated = 0
+for sink in lua_pa.sinks() do
+	if not sink.name then break end
+	iterated = iterated + 1
+end
+for _ in lua_pa.sources() do
+	break
+end
+if iterated ~= #all_sinks then
+	print('lua_pa.sinks ERROR')
+	return false
+end
+print('lua_pa.sinks OK')
+
 -- Test getting default sink
 local default_sink = lua_pa.get_default_sink()
 if not default_sink then
@@ -27,6 +61,26 @@ if not default_sink then
 end
 print('lua_pa.get_default_sink OK')
 
+-- Test latency and sample spec introspection
+if not default_sink.sample_spec or not default_sink.channel_map or not default_sink.state then
+	print('lua_pa sink introspection ERROR')
+	return false
+end
+print('lua_pa sink introspection OK')
+
+if not lua_pa.measure_latency(default_sink) then
+	print('lua_pa.measure_latency ERROR')
+	return false
+end
+print('lua_pa.measure_latency OK')
+
+-- Test setting the same default again while moving its streams
+if not lua_pa.set_default_sink(default_sink, { move_streams = true }) then
+	print('lua_pa.set_default_sink move_streams ERROR')
+	return false
+end
+print('lua_pa.set_default_sink move_streams OK')
+
 -- Test getting default source
 local default_source = lua_pa.get_default_source()
 if not default_source then
@@ -35,6 +89,221 @@ if not default_source then
 end
 print('lua_pa.get_default_source OK')
 
+-- Test taking the whole server state in one go
+local snapshot = lua_pa.snapshot()
+if not snapshot or #snapshot.sinks ~= #all_sinks or not snapshot.default_sink
+	or snapshot.default_sink.name ~= default_sink.name then
+	print('lua_pa.snapshot ERROR')
+	return false
+end
+print('lua_pa.snapshot OK')
+
+-- Test that answers come from the server once it was reached, not from the warm-start cache
+local live_sink = lua_pa.get_sink_by_name(default_sink.name)
+if not live_sink or live_sink.stale then
+	print('lua_pa warm cache ERROR')
+	return false
+end
+print('lua_pa warm cache OK')
+
+-- Test adding and removing a ducking rule
+local duck_rule = lua_pa.add_duck_rule { trigger = { role = 'phone' }, target = { role = 'music' }, level = 20, fade_ms = 200 }
+if not duck_rule or not lua_pa.remove_duck_rule(duck_rule) or lua_pa.remove_duck_rule(duck_rule) then
+	print('lua_pa.add_duck_rule ERROR')
+	return false
+end
+print('lua_pa.add_duck_rule OK')
+
+-- Test capturing a scene and applying it again, which must not need any change
+local scene = lua_pa.capture_scene()
+local applied, results = lua_pa.apply_scene(scene, { rollback = true })
+if not scene or not scene.sinks or not applied or #results ~= 0 then
+	print('lua_pa.apply_scene ERROR')
+	return false
+end
+print('lua_pa.apply_scene OK')
+
+-- Test that a malformed scene is rejected before anything is applied
+if pcall(lua_pa.apply_scene, { sinks = { [default_sink.name] = { volume = 50 }, bogus = 5 } }) then
+	print('lua_pa.apply_scene malformed ERROR')
+	return false
+end
+print('lua_pa.apply_scene malformed OK')
+
+-- Test uploading and playing a cached sample
+local silence = string.rep('\0', 4 * 441)
+if not lua_pa.upload_sample('lua_pa_test', { data = silence, rate = 44100, channels = 2, format = 's16le' }) then
+	print('lua_pa.upload_sample ERROR')
+	return false
+end
+print('lua_pa.upload_sample OK')
+
+if not lua_pa.play_sample('lua_pa_test', default_sink, 10) then
+	print('lua_pa.play_sample ERROR')
+	return false
+end
+print('lua_pa.play_sample OK')
+
+-- Test a playback stream, closing it while its drain may still be pending
+local playback = lua_pa.new_playback { device = default_sink.name, rate = 44100, channels = 2, format = 's16le' }
+if not playback or playback:write(silence) ~= #silence or not playback:drain() then
+	print('lua_pa.new_playback ERROR')
+	return false
+end
+playback:close()
+playback = nil
+collectgarbage()
+socket.select(nil, nil, 0.2)
+print('lua_pa.new_playback OK')
+
+-- Test a record stream on the default sink's monitor, reading it in two parts
+local record = lua_pa.new_record { source = default_sink.name .. '.monitor', rate = 44100, channels = 2, format = 's16le' }
+if not record then
+	print('lua_pa.new_record ERROR')
+	return false
+end
+for _ = 1, 50 do
+	if record:readable_size() >= 8 then break end
+	socket.select(nil, nil, 0.1)
+end
+local buffered = record:readable_size()
+local head = record:read(4)
+local rest = record:read()
+record:close()
+if buffered < 8 or #head ~= 4 or #rest < buffered - 4 or #rest % 4 ~= 0 then
+	print('lua_pa.new_record ERROR')
+	return false
+end
+print('lua_pa.new_record OK')
+
+-- Test the spectrum analyzer within its budget, 32 bands at 60 fps under 2% of one core.
+-- os.clock() counts the CPU time of every thread of the process
+local spectrum = lua_pa.spectrum(default_sink, { bands = 32, fps = 60 })
+if not spectrum then
+	print('lua_pa.spectrum ERROR')
+	return false
+end
+local cpu_start, wall_start = os.clock(), socket.gettime()
+socket.select(nil, nil, 2)
+local cpu = (os.clock() - cpu_start) / (socket.gettime() - wall_start)
+local bands, frame = spectrum:bands()
+spectrum:close()
+if #bands ~= 32 or frame < 1 or cpu > 0.02 then
+	print(string.format('lua_pa.spectrum ERROR (frame %d, %.2f%% of a core)', frame, cpu * 100))
+	return false
+end
+print(string.format('lua_pa.spectrum OK (%.2f%% of a core)', cpu * 100))
+
+-- Test coroutine calls resumed through dispatch
+if not lua_pa.dispatch_fd() then
+	print('lua_pa.dispatch_fd ERROR')
+	return false
+end
+local co_sinks = nil
+local co = coroutine.create(function()
+	co_sinks = lua_pa.get_all_sinks()
+end)
+coroutine.resume(co)
+for _ = 1, 50 do
+	lua_pa.dispatch()
+	if coroutine.status(co) == 'dead' then break end
+	socket.select(nil, nil, 0.1)
+end
+if type(co_sinks) ~= 'table' then
+	print('lua_pa.dispatch ERROR')
+	return false
+end
+print('lua_pa.dispatch OK')
+
+-- Test two calls in a row from one coroutine, the second one is resumed while the first frame is live
+local co_default, co_set = nil, nil
+co = coroutine.create(function()
+	local sinks = lua_pa.get_all_sinks()
+	co_default = lua_pa.get_default_sink()
+	co_set = lua_pa.set_volume_sink(co_default.name, co_default.volume)
+	return sinks
+end)
+coroutine.resume(co)
+for _ = 1, 50 do
+	lua_pa.dispatch()
+	if coroutine.status(co) == 'dead' then break end
+	socket.select(nil, nil, 0.1)
+end
+if coroutine.status(co) ~= 'dead' or not co_default or co_default.name ~= default_sink.name or not co_set then
+	print('lua_pa.dispatch chained ERROR')
+	return false
+end
+print('lua_pa.dispatch chained OK')
+
+-- Test journaling and replaying it without delays
+local journal_path = os.tmpname()
+os.remove(journal_path)
+if not lua_pa.journal_start(journal_path) or not lua_pa.journal_stop() then
+	print('lua_pa.journal_start ERROR')
+	return false
+end
+local replayed = lua_pa.replay(journal_path, { speed = 0 })
+os.remove(journal_path)
+if not replayed or replayed < 1 then
+	print('lua_pa.replay ERROR')
+	return false
+end
+print('lua_pa.replay OK')
+
+-- Test that a replay only reaches handlers, resolving devices and defaults from the journal
+if string.pack then
+	local name = 'lua_pa_replayed'
+	local function record(tag, payload)
+		return string.pack('<I4I4I8', tag, #payload, 0) .. payload .. string.rep('\0', (8 - #payload % 8) % 8)
+	end
+	local function device(tag, index, volume)
+		return record(tag, string.pack('<I4I4I4I4I8I8I4BBI2I2I2I4', index, volume, 0, 0, 0, 0, 0, 0, 1, #name, #name, 0, 0)
+			.. name .. '\0' .. name .. '\0')
+	end
+
+	local f = io.open(journal_path, 'wb')
+	f:write(string.pack('<I4I4', 0x4a41504c, 1),
+		device(7, 4242, 0x10000),
+		record(6, string.pack('<I2I2I4', #name, 0, 0) .. name .. '\0\0'),
+		device(3, 4242, 0x8000),
+		record(1, string.pack('<I4I4', 0x0020, 4242)))
+	f:close()
+
+	local seen = {}
+	lua_pa.connect_signal('pulseaudio::sink_change', function(_, n) seen.change = n end, { device = name, default = true })
+	lua_pa.connect_signal('pulseaudio::sink_remove', function(n) seen.remove = n end, { device = name })
+	replayed = lua_pa.replay(journal_path, { speed = 0 })
+	os.remove(journal_path)
+
+	local live = lua_pa.get_default_sink()
+	if replayed ~= 3 or seen.change ~= name or seen.remove ~= name or not live or live.name ~= default_sink.name then
+		print('lua_pa.replay isolated ERROR')
+		return false
+	end
+	print('lua_pa.replay isolated OK')
+end
+
+-- Test exporting the registry for other processes, reading it back through lua_pa_shm.h
+local exported = lua_pa.export_shm('lua_pa_test')
+local reader = io.popen('./bin/shm_check lua_pa_test')
+local shm_sink = reader:read('*l')
+reader:close()
+local shm_name, shm_volume = (shm_sink or ''):match('^([^\t]*)\t(%d+)\t[01]$')
+local shm_default = lua_pa.get_default_sink()
+if not exported or not lua_pa.export_shm(false) or not shm_default or shm_name ~= shm_default.name
+	or tonumber(shm_volume) ~= shm_default.volume then
+	print('lua_pa.export_shm ERROR', shm_sink)
+	return false
+end
+print('lua_pa.export_shm OK')
+
+-- Test that change handlers can only be scoped to fields a change is reported for
+if pcall(lua_pa.connect_signal, 'pulseaudio::sink_change', function() end, { fields = { 'latency' } }) then
+	print('lua_pa.connect_signal fields ERROR')
+	return false
+end
+print('lua_pa.connect_signal fields OK')
+
 -- Test signals
 local signal_processed = {
 	sink_change = false,
@@ -0,0 +1,67 @@
+local socket = require 'socket'
+
+-- Stall the server and check that calls give up on their deadline, run through `make timeout`
+-- which starts a private daemon and passes its pid in LUA_PA_DAEMON_PID
+local lua_pa = require 'lua_pa'
+
+local pid = os.getenv('LUA_PA_DAEMON_PID')
+if not pid then
+	print('timeout.lua needs LUA_PA_DAEMON_PID, run it through make timeout')
+	os.exit(1)
+end
+
+local failures = 0
+local function check(ok, what)
+	print(what .. (ok and ' OK' or ' ERROR'))
+	if not ok then failures = failures + 1 end
+end
+
+-- Times one call, returns its results and how long it took
+local function timed(f, ...)
+	local started = socket.gettime()
+	local result, err = f(...)
+	return result, err, socket.gettime() - started
+end
+
+local sink = lua_pa.get_default_sink()
+check(sink ~= nil, 'lua_pa.get_default_sink before the stall')
+
+local timeouts = lua_pa.stats().timeouts
+
+os.execute('kill -STOP ' .. pid)
+
+-- The module default, set_timeout(ms)
+lua_pa.set_timeout(200)
+local sinks, err, elapsed = timed(lua_pa.get_all_sinks)
+check(sinks == nil and err == 'timeout' and elapsed >= 0.15 and elapsed < 1, 'lua_pa.set_timeout')
+
+-- A per call deadline overrides it, and a timed out set cancels its operation
+local ok
+ok, err, elapsed = timed(lua_pa.set_volume_sink, sink.name, sink.volume, { timeout_ms = 100 })
+check(ok == nil and err == 'timeout' and elapsed >= 0.05 and elapsed < 0.5, 'lua_pa.set_volume_sink timeout_ms')
+
+-- A coroutine call suspended on the stalled server is resumed by its own deadline
+lua_pa.dispatch_fd()
+local co_result, co_err = false, nil
+local co = coroutine.create(function()
+	co_result, co_err = lua_pa.get_all_sinks { timeout_ms = 200 }
+end)
+coroutine.resume(co)
+for _ = 1, 20 do
+	lua_pa.dispatch()
+	if coroutine.status(co) == 'dead' then break end
+	socket.select(nil, nil, 0.1)
+end
+check(coroutine.status(co) == 'dead' and co_result == nil and co_err == 'timeout', 'lua_pa.dispatch deadline')
+
+check(lua_pa.stats().timeouts == timeouts + 3, 'lua_pa.stats timeouts')
+
+os.execute('kill -CONT ' .. pid)
+
+-- Replies to the cancelled operations arrive late and must not disturb the next calls
+lua_pa.set_timeout(5000)
+sinks = lua_pa.get_all_sinks()
+check(sinks ~= nil and #sinks > 0, 'lua_pa.get_all_sinks after the stall')
+check(lua_pa.stats().timeouts == timeouts + 3, 'lua_pa.stats no late timeouts')
+
+os.exit(failures == 0 and 0 or 1)
@@ -0,0 +1,49 @@
+-- Write the warm-start cache and load it from a second process, run through `make warm` which
+-- starts a private daemon and gives the cache a runtime dir of its own
+local lua_pa = require 'lua_pa'
+
+local expected = os.getenv('LUA_PA_WARM_SINK')
+
+-- The second process, started while the daemon is stalled: it is never reached, so the default
+-- sink can only come from the cache the first process wrote
+if expected then
+	local sink = lua_pa.get_default_sink()
+	local ok = sink ~= nil and sink.stale == true and sink.name == expected
+	print('lua_pa warm load' .. (ok and ' OK' or ' ERROR'))
+	os.exit(ok and 0 or 1)
+end
+
+local pid = os.getenv('LUA_PA_DAEMON_PID')
+local dir = os.getenv('XDG_RUNTIME_DIR')
+if not pid or not dir then
+	print('warm.lua needs LUA_PA_DAEMON_PID, run it through make warm')
+	os.exit(1)
+end
+
+local failures = 0
+local function check(ok, what)
+	print(what .. (ok and ' OK' or ' ERROR'))
+	if not ok then failures = failures + 1 end
+end
+
+local sink = lua_pa.get_default_sink()
+check(sink ~= nil and not sink.stale, 'lua_pa.get_default_sink live')
+
+-- cleanup() writes a pending cache right away instead of after LUA_PA_CACHE_DELAY
+lua_pa.cleanup()
+local cache = io.open(dir .. '/lua_pa.cache', 'rb')
+check(cache ~= nil, 'lua_pa cache written')
+if cache then cache:close() end
+
+-- No temp file is left behind next to it
+local p = io.popen('ls "' .. dir .. '"')
+local listing = p:read('*a')
+p:close()
+check(not listing:find('lua_pa.cache.', 1, true), 'lua_pa cache temp file renamed')
+
+os.execute('kill -STOP ' .. pid)
+local loaded = os.execute('LUA_PA_WARM_SINK="' .. sink.name .. '" "' .. arg[-1] .. '" warm.lua')
+os.execute('kill -CONT ' .. pid)
+check(loaded == true or loaded == 0, 'lua_pa warm start')
+
+os.exit(failures == 0 and 0 or 1)